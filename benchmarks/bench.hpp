@@ -0,0 +1,126 @@
+#pragma once
+
+// Minimal harness for the micro benchmarks. Each case is calibrated until one
+// batch runs for about a tenth of the time budget, then timed over several
+// batches; the median batch is reported so a stray context switch does not
+// move the result. With --json the suite prints one document that release
+// runs can store and diff.
+//
+//   <bench> [--json] [--filter=<substring>] [--min-time=<ms>]
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+// Keeps the optimizer from discarding a value the benchmark computed.
+template <typename T> inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+class Suite {
+public:
+  Suite(std::string name, int argc, char **argv) : name_(std::move(name)) {
+    for (int i = 1; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (arg == "--json") {
+        json_ = true;
+      } else if (arg.substr(0, 9) == "--filter=") {
+        filter_ = arg.substr(9);
+      } else if (arg.substr(0, 11) == "--min-time=") {
+        min_time_ = std::chrono::milliseconds(
+            std::strtoll(argv[i] + 11, nullptr, 10));
+      } else {
+        std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+        std::exit(2);
+      }
+    }
+  }
+
+  // Times `body(iterations)`, which must run the measured operation exactly
+  // `iterations` times.
+  template <typename F> void run(std::string_view name, F &&body) {
+    if (name.find(filter_) == std::string_view::npos) {
+      return;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto time_batch = [&](uint64_t iterations) {
+      const auto start = Clock::now();
+      body(iterations);
+      return std::chrono::duration<double, std::nano>(Clock::now() - start)
+          .count();
+    };
+
+    const double target =
+        std::chrono::duration<double, std::nano>(min_time_).count() / kBatches;
+    uint64_t iterations = 1;
+    double elapsed = time_batch(iterations);
+    while (elapsed < target && iterations < (uint64_t(1) << 40)) {
+      const double scale = elapsed > 0 ? target / elapsed * 1.2 : 100;
+      iterations = std::max(iterations + 1,
+                            static_cast<uint64_t>(iterations *
+                                                  std::min(scale, 100.0)));
+      elapsed = time_batch(iterations);
+    }
+
+    std::vector<double> samples;
+    for (int i = 0; i < kBatches; ++i) {
+      samples.push_back(time_batch(iterations) /
+                        static_cast<double>(iterations));
+    }
+    std::sort(samples.begin(), samples.end());
+
+    Result result{std::string(name), samples[samples.size() / 2],
+                  samples.front(), iterations};
+    if (!json_) {
+      std::printf("%-40s %12.1f ns/op %12.1f min %12llu iters\n",
+                  result.name.c_str(), result.ns_per_op, result.min_ns,
+                  static_cast<unsigned long long>(result.iterations));
+    }
+    results_.push_back(std::move(result));
+  }
+
+  int finish() const {
+    if (json_) {
+      nlohmann::json doc;
+      doc["suite"] = name_;
+      doc["unit"] = "ns/op";
+      doc["results"] = nlohmann::json::array();
+      for (const Result &result : results_) {
+        doc["results"].push_back({{"name", result.name},
+                                  {"ns_per_op", result.ns_per_op},
+                                  {"min_ns_per_op", result.min_ns},
+                                  {"iterations", result.iterations}});
+      }
+      std::printf("%s\n", doc.dump(2).c_str());
+    }
+    return 0;
+  }
+
+private:
+  static constexpr int kBatches = 5;
+
+  struct Result {
+    std::string name;
+    double ns_per_op;
+    double min_ns;
+    uint64_t iterations;
+  };
+
+  std::string name_;
+  bool json_ = false;
+  std::string filter_;
+  std::chrono::milliseconds min_time_{500};
+  std::vector<Result> results_;
+};
+
+} // namespace bench
@@ -0,0 +1,607 @@
+// HTTP/1.1 load generator on io_uring, for measuring a running server over
+// loopback.
+//
+// Closed loop (default): every connection keeps one request in flight and
+// sends the next as soon as the response is complete, so the offered load
+// follows the server. Open loop (--rate): requests are scheduled at a fixed
+// rate whatever the server does and pipelined on their connection; latency is
+// measured from the scheduled send time, so a stalled server shows up in the
+// tail instead of silently lowering the rate (coordinated omission).
+//
+// --ring-profile sets up the generator's own rings like the server's (see
+// RingProfile), so both sides of a loopback run can use the same one.
+//
+//   load-gen [--host=127.0.0.1] [--port=8080] [--path=/] [--connections=64]
+//            [--threads=1] [--duration=10] [--warmup=1] [--rate=<req/s>]
+//            [--ring-profile=default|defer-taskrun|sqpoll] [--json]
+
+#include "metrics.hpp"
+#include "ring_profile.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <arpa/inet.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 8080;
+  std::string path = "/";
+  size_t connections = 64;
+  size_t threads = 1;
+  double duration = 10;
+  double warmup = 1;
+  double rate = 0; // total requests per second; 0 selects closed loop
+  RingOptions ring;
+  bool json = false;
+};
+
+struct Totals {
+  LatencyHistogram::Snapshot latency;
+  uint64_t responses[5] = {}; // by status class
+  uint64_t reconnects = 0;
+  uint64_t errors = 0;
+  uint64_t bytes_in = 0;
+  RingProfile ring = RingProfile::Default; // in effect, after any fallback
+};
+
+uint64_t now_ns() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(
+                                   Clock::now().time_since_epoch())
+                                   .count());
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(static_cast<unsigned char>(x)) ==
+                  std::tolower(static_cast<unsigned char>(y));
+         });
+}
+
+// Length of the first complete response in `in`, or 0 if more bytes are
+// needed; -1 for a malformed response. Handles Content-Length and chunked
+// bodies.
+ptrdiff_t response_length(std::string_view in, int &status, bool &close) {
+  const size_t head_end = in.find("\r\n\r\n");
+  if (head_end == std::string_view::npos) {
+    return 0;
+  }
+  if (in.size() < 12 || in.substr(0, 5) != "HTTP/") {
+    return -1;
+  }
+  status = std::atoi(in.data() + 9);
+  close = false;
+
+  size_t content_length = 0;
+  bool chunked = false;
+  size_t line = in.find("\r\n") + 2;
+  while (line < head_end) {
+    const size_t eol = in.find("\r\n", line);
+    const std::string_view field = in.substr(line, eol - line);
+    line = eol + 2;
+    const size_t colon = field.find(':');
+    if (colon == std::string_view::npos) {
+      continue;
+    }
+    const std::string_view name = field.substr(0, colon);
+    std::string_view value = field.substr(colon + 1);
+    while (!value.empty() && value.front() == ' ') {
+      value.remove_prefix(1);
+    }
+    if (iequals(name, "content-length")) {
+      content_length = std::strtoull(value.data(), nullptr, 10);
+    } else if (iequals(name, "transfer-encoding")) {
+      chunked = iequals(value, "chunked");
+    } else if (iequals(name, "connection")) {
+      close = iequals(value, "close");
+    }
+  }
+
+  size_t end = head_end + 4;
+  if (!chunked) {
+    return in.size() >= end + content_length
+               ? static_cast<ptrdiff_t>(end + content_length)
+               : 0;
+  }
+  for (;;) {
+    const size_t eol = in.find("\r\n", end);
+    if (eol == std::string_view::npos) {
+      return 0;
+    }
+    const size_t size = std::strtoull(in.data() + end, nullptr, 16);
+    end = eol + 2;
+    if (size == 0) {
+      // Trailer section: ends at the first empty line.
+      const size_t trailer = in.find("\r\n", end);
+      if (trailer == std::string_view::npos) {
+        return 0;
+      }
+      if (trailer == end) {
+        return static_cast<ptrdiff_t>(end + 2);
+      }
+      const size_t done = in.find("\r\n\r\n", end);
+      return done == std::string_view::npos
+                 ? 0
+                 : static_cast<ptrdiff_t>(done + 4);
+    }
+    if (in.size() < end + size + 2) {
+      return 0;
+    }
+    end += size + 2;
+  }
+}
+
+enum Op : uintptr_t { CONNECT = 0, SEND = 1, RECV = 2, TICK = 3 };
+
+struct Connection {
+  int fd = -1;
+  bool open = false;
+  bool sending = false;
+  bool receiving = false;
+  std::string out;      // bytes being sent; untouched while `sending`
+  size_t out_sent = 0;
+  size_t written = 0;   // requests of `queue` already placed in `out`
+  std::deque<uint64_t> queue; // start time of each unanswered request
+  std::string in;
+  std::unique_ptr<char[]> buffer;
+};
+
+constexpr size_t RECV_SIZE = 64 * 1024;
+
+class Worker {
+public:
+  Worker(const Options &options, size_t connections, double rate)
+      : options_(options), conns_(connections), rate_(rate) {
+    request_ = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host +
+               "\r\nUser-Agent: ws-cpp-load-gen\r\n\r\n";
+    addr_.sin_family = AF_INET;
+    addr_.sin_port = htons(static_cast<uint16_t>(options.port));
+    if (inet_pton(AF_INET, options.host.c_str(), &addr_.sin_addr) != 1) {
+      throw std::runtime_error("invalid IPv4 address: " + options.host);
+    }
+    for (Connection &conn : conns_) {
+      conn.buffer = std::make_unique<char[]>(RECV_SIZE);
+    }
+  }
+
+  Totals run(uint64_t start, uint64_t measure_from, uint64_t stop) {
+    const std::optional<RingProfile> profile = init_ring(
+        ring_, static_cast<unsigned>(conns_.size() * 3 + 16), options_.ring);
+    if (!profile) {
+      throw std::runtime_error("io_uring_queue_init failed");
+    }
+    totals_.ring = *profile;
+    measure_from_ = measure_from;
+    next_due_ = start;
+    for (Connection &conn : conns_) {
+      connect(conn);
+    }
+    submit_tick();
+
+    while (now_ns() < stop) {
+      io_uring_submit_and_wait(&ring_, 1);
+      unsigned head;
+      unsigned count = 0;
+      io_uring_cqe *cqe;
+      io_uring_for_each_cqe(&ring_, head, cqe) {
+        ++count;
+        const auto data = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(
+            cqe));
+        auto *conn = reinterpret_cast<Connection *>(data & ~uintptr_t(3));
+        switch (static_cast<Op>(data & 3)) {
+        case CONNECT:
+          handle_connect(*conn, cqe->res);
+          break;
+        case SEND:
+          handle_send(*conn, cqe->res);
+          break;
+        case RECV:
+          handle_recv(*conn, cqe->res);
+          break;
+        case TICK:
+          handle_tick();
+          break;
+        }
+      }
+      io_uring_cq_advance(&ring_, count);
+    }
+
+    for (Connection &conn : conns_) {
+      if (conn.fd >= 0) {
+        ::close(conn.fd);
+      }
+    }
+    io_uring_queue_exit(&ring_);
+    latency_.merge_into(totals_.latency);
+    return totals_;
+  }
+
+private:
+  const Options &options_;
+  std::vector<Connection> conns_;
+  double rate_;
+  std::string request_;
+  sockaddr_in addr_{};
+  io_uring ring_{};
+  __kernel_timespec tick_spec_{};
+  LatencyHistogram latency_;
+  Totals totals_;
+  uint64_t measure_from_ = 0;
+  uint64_t next_due_ = 0;
+  size_t next_conn_ = 0;
+
+  io_uring_sqe *sqe() {
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    if (!sqe) {
+      io_uring_submit(&ring_);
+      sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+  }
+
+  static void *tag(Connection *conn, Op op) {
+    return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(conn) | op);
+  }
+
+  void connect(Connection &conn) {
+    conn.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0) {
+      throw std::runtime_error("socket failed");
+    }
+    const int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    io_uring_sqe *s = sqe();
+    io_uring_prep_connect(s, conn.fd, reinterpret_cast<sockaddr *>(&addr_),
+                          sizeof(addr_));
+    io_uring_sqe_set_data(s, tag(&conn, CONNECT));
+  }
+
+  void handle_connect(Connection &conn, int res) {
+    if (res < 0) {
+      std::fprintf(stderr, "connect: %s\n", std::strerror(-res));
+      std::exit(1);
+    }
+    conn.open = true;
+    conn.out.clear();
+    conn.out_sent = 0;
+    conn.written = 0;
+    conn.in.clear();
+    if (rate_ == 0 && conn.queue.empty()) {
+      conn.queue.push_back(0); // stamped when written
+    }
+    submit_recv(conn);
+    flush(conn);
+  }
+
+  void submit_recv(Connection &conn) {
+    conn.receiving = true;
+    io_uring_sqe *s = sqe();
+    io_uring_prep_recv(s, conn.fd, conn.buffer.get(), RECV_SIZE, 0);
+    io_uring_sqe_set_data(s, tag(&conn, RECV));
+  }
+
+  // Sends every queued request that has not been written yet.
+  void flush(Connection &conn) {
+    if (!conn.open || conn.sending) {
+      return;
+    }
+    if (conn.out_sent == conn.out.size()) {
+      conn.out.clear();
+      conn.out_sent = 0;
+      const uint64_t now = now_ns();
+      for (; conn.written < conn.queue.size(); ++conn.written) {
+        if (rate_ == 0) {
+          conn.queue[conn.written] = now;
+        }
+        conn.out += request_;
+      }
+      if (conn.out.empty()) {
+        return;
+      }
+    }
+    conn.sending = true;
+    io_uring_sqe *s = sqe();
+    io_uring_prep_send(s, conn.fd, conn.out.data() + conn.out_sent,
+                       conn.out.size() - conn.out_sent, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(s, tag(&conn, SEND));
+  }
+
+  void handle_send(Connection &conn, int res) {
+    conn.sending = false;
+    if (res > 0) {
+      conn.out_sent += static_cast<size_t>(res);
+    }
+    if (!conn.open) {
+      reconnect(conn);
+    } else if (res >= 0) {
+      flush(conn);
+    }
+    // On a send error the pending recv fails as well and reconnects.
+  }
+
+  void handle_recv(Connection &conn, int res) {
+    conn.receiving = false;
+    if (res <= 0) {
+      if (res < 0 && conn.open) {
+        ++totals_.errors;
+      }
+      conn.open = false;
+      reconnect(conn);
+      return;
+    }
+    totals_.bytes_in += static_cast<uint64_t>(res);
+    conn.in.append(conn.buffer.get(), static_cast<size_t>(res));
+
+    size_t consumed = 0;
+    bool close = false;
+    while (!close) {
+      int status = 0;
+      const ptrdiff_t length = response_length(
+          std::string_view(conn.in).substr(consumed), status, close);
+      if (length < 0 || (length > 0 && conn.queue.empty())) {
+        std::fprintf(stderr, "malformed or unexpected response\n");
+        std::exit(1);
+      }
+      if (length == 0) {
+        break;
+      }
+      consumed += static_cast<size_t>(length);
+      complete(conn, status);
+    }
+    conn.in.erase(0, consumed);
+
+    if (close) {
+      // The server drops anything pipelined after this response; it is
+      // resent on the new connection.
+      conn.open = false;
+      ::shutdown(conn.fd, SHUT_RDWR);
+    }
+    submit_recv(conn);
+    flush(conn);
+  }
+
+  void complete(Connection &conn, int status) {
+    const uint64_t start = conn.queue.front();
+    conn.queue.pop_front();
+    --conn.written;
+    const uint64_t now = now_ns();
+    if (start >= measure_from_) {
+      latency_.record(now - start);
+      if (status >= 100 && status < 600) {
+        ++totals_.responses[status / 100 - 1];
+      } else {
+        ++totals_.errors;
+      }
+    }
+    if (rate_ == 0) {
+      conn.queue.push_back(0);
+    }
+  }
+
+  // Runs once both the send and the recv of a closed connection are done.
+  void reconnect(Connection &conn) {
+    if (conn.sending || conn.receiving) {
+      return;
+    }
+    ::close(conn.fd);
+    ++totals_.reconnects;
+    connect(conn);
+  }
+
+  void submit_tick() {
+    // Open loop wakes often enough to keep the schedule within ~50us;
+    // closed loop only needs to notice the end of the run.
+    const uint64_t interval =
+        rate_ > 0 ? std::min<uint64_t>(
+                        static_cast<uint64_t>(1e9 / rate_), 50000)
+                  : 10000000;
+    tick_spec_.tv_sec = 0;
+    tick_spec_.tv_nsec = static_cast<long long>(interval);
+    io_uring_sqe *s = sqe();
+    io_uring_prep_timeout(s, &tick_spec_, 0, 0);
+    io_uring_sqe_set_data(s, tag(nullptr, TICK));
+  }
+
+  void handle_tick() {
+    if (rate_ > 0) {
+      const double gap = 1e9 / rate_;
+      const uint64_t now = now_ns();
+      while (next_due_ <= now) {
+        Connection &conn = conns_[next_conn_++ % conns_.size()];
+        conn.queue.push_back(next_due_);
+        next_due_ += static_cast<uint64_t>(gap);
+      }
+      for (Connection &conn : conns_) {
+        flush(conn);
+      }
+    }
+    submit_tick();
+  }
+};
+
+bool parse_option(std::string_view arg, std::string_view name,
+                  std::string &value) {
+  if (arg.size() <= name.size() + 3 || arg.substr(0, 2) != "--" ||
+      arg.substr(2, name.size()) != name || arg[name.size() + 2] != '=') {
+    return false;
+  }
+  value = std::string(arg.substr(name.size() + 3));
+  return true;
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    std::string value;
+    if (arg == "--json") {
+      options.json = true;
+    } else if (parse_option(arg, "host", value)) {
+      options.host = value;
+    } else if (parse_option(arg, "port", value)) {
+      options.port = std::atoi(value.c_str());
+    } else if (parse_option(arg, "path", value)) {
+      options.path = value;
+    } else if (parse_option(arg, "connections", value)) {
+      options.connections = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (parse_option(arg, "threads", value)) {
+      options.threads = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (parse_option(arg, "duration", value)) {
+      options.duration = std::atof(value.c_str());
+    } else if (parse_option(arg, "warmup", value)) {
+      options.warmup = std::atof(value.c_str());
+    } else if (parse_option(arg, "rate", value)) {
+      options.rate = std::atof(value.c_str());
+    } else if (parse_option(arg, "ring-profile", value)) {
+      const std::optional<RingProfile> profile = parse_ring_profile(value);
+      if (!profile) {
+        std::fprintf(stderr, "unknown ring profile: %s\n", value.c_str());
+        std::exit(2);
+      }
+      options.ring.profile = *profile;
+    } else {
+      std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+      std::exit(2);
+    }
+  }
+  options.threads = std::max<size_t>(options.threads, 1);
+  options.connections = std::max(options.connections, options.threads);
+  return options;
+}
+
+void report(const Options &options, const Totals &totals) {
+  const auto &latency = totals.latency;
+  const double throughput = static_cast<double>(latency.count) /
+                            std::max(options.duration - options.warmup, 1e-9);
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+  const double mean =
+      latency.count ? us(latency.sum) / static_cast<double>(latency.count) : 0;
+
+  if (options.json) {
+    nlohmann::json doc;
+    doc["mode"] = options.rate > 0 ? "open" : "closed";
+    doc["target"] = options.host + ":" + std::to_string(options.port) +
+                    options.path;
+    doc["connections"] = options.connections;
+    doc["threads"] = options.threads;
+    doc["ring_profile"] = ring_profile_name(totals.ring);
+    doc["duration_s"] = options.duration - options.warmup;
+    if (options.rate > 0) {
+      doc["rate"] = options.rate;
+    }
+    doc["requests"] = latency.count;
+    doc["throughput_rps"] = throughput;
+    doc["bytes_in"] = totals.bytes_in;
+    doc["reconnects"] = totals.reconnects;
+    doc["errors"] = totals.errors;
+    doc["responses"] = {{"1xx", totals.responses[0]},
+                        {"2xx", totals.responses[1]},
+                        {"3xx", totals.responses[2]},
+                        {"4xx", totals.responses[3]},
+                        {"5xx", totals.responses[4]}};
+    doc["latency_us"] = {{"mean", mean},
+                         {"p50", us(latency.quantile(0.5))},
+                         {"p90", us(latency.quantile(0.9))},
+                         {"p99", us(latency.quantile(0.99))},
+                         {"p999", us(latency.quantile(0.999))},
+                         {"max", us(latency.quantile(1.0))}};
+    std::printf("%s\n", doc.dump(2).c_str());
+    return;
+  }
+
+  std::printf("%s loop, %zu connections, %zu threads, %s ring, "
+              "%.1fs measured\n",
+              options.rate > 0 ? "open" : "closed", options.connections,
+              options.threads, ring_profile_name(totals.ring),
+              options.duration - options.warmup);
+  std::printf("requests:   %llu (%.0f req/s)\n",
+              static_cast<unsigned long long>(latency.count), throughput);
+  std::printf("responses:  2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+              static_cast<unsigned long long>(totals.responses[1]),
+              static_cast<unsigned long long>(totals.responses[2]),
+              static_cast<unsigned long long>(totals.responses[3]),
+              static_cast<unsigned long long>(totals.responses[4]));
+  std::printf("reconnects: %llu, errors: %llu\n",
+              static_cast<unsigned long long>(totals.reconnects),
+              static_cast<unsigned long long>(totals.errors));
+  std::printf("latency us: mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+              "p999 %.1f  max %.1f\n",
+              mean, us(latency.quantile(0.5)), us(latency.quantile(0.9)),
+              us(latency.quantile(0.99)), us(latency.quantile(0.999)),
+              us(latency.quantile(1.0)));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const Options options = parse_options(argc, argv);
+
+  const uint64_t start = now_ns();
+  const uint64_t measure_from =
+      start + static_cast<uint64_t>(options.warmup * 1e9);
+  const uint64_t stop = start + static_cast<uint64_t>(options.duration * 1e9);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (size_t t = 0; t < options.threads; ++t) {
+    const size_t connections =
+        options.connections / options.threads +
+        (t < options.connections % options.threads ? 1 : 0);
+    workers.push_back(std::make_unique<Worker>(
+        options, connections,
+        options.rate / static_cast<double>(options.threads)));
+  }
+
+  std::vector<Totals> results(workers.size());
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < workers.size(); ++t) {
+    threads.emplace_back([&, t] {
+      results[t] = workers[t]->run(start, measure_from, stop);
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  Totals totals;
+  for (const Totals &result : results) {
+    for (size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+      totals.latency.buckets[i] += result.latency.buckets[i];
+    }
+    totals.latency.count += result.latency.count;
+    totals.latency.sum += result.latency.sum;
+    for (size_t i = 0; i < 5; ++i) {
+      totals.responses[i] += result.responses[i];
+    }
+    totals.reconnects += result.reconnects;
+    totals.errors += result.errors;
+    totals.bytes_in += result.bytes_in;
+    totals.ring = result.ring;
+  }
+  report(options, totals);
+  return 0;
+}
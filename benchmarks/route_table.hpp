@@ -0,0 +1,54 @@
+#pragma once
+
+// REST-style route table shared by the routing benchmarks: 142 routes over
+// 20 resources, plus a request mix of static, parameterised and missing
+// paths.
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+constexpr const char *kResources[] = {
+    "users",  "posts",    "comments", "orders",   "products", "carts",
+    "images", "sessions", "invoices", "payments", "reviews",  "tags",
+    "events", "teams",    "projects", "tickets",  "files",    "reports",
+    "alerts", "settings"};
+
+constexpr size_t kRouteCount = 2 + 7 * std::size(kResources);
+
+template <typename R> void register_routes(R &router) {
+  auto ok = [](const HttpRequest &) { return HttpResponse(); };
+  router.get("/", ok);
+  router.get("/health", ok);
+  for (const char *resource : kResources) {
+    const std::string base = std::string("/api/v1/") + resource;
+    router.get(base, ok);
+    router.post(base, ok);
+    router.get(base + "/:id", ok);
+    router.put(base + "/:id", ok);
+    router.del(base + "/:id", ok);
+    router.get(base + "/:id/history", ok);
+    router.get(base + "/:id/children/:child", ok);
+  }
+}
+
+inline std::vector<std::string> build_requests() {
+  std::vector<std::string> raw;
+  for (const char *resource : kResources) {
+    const std::string base = std::string("/api/v1/") + resource;
+    raw.push_back("GET " + base + " HTTP/1.1\r\n\r\n");
+    raw.push_back("GET " + base + "/1234 HTTP/1.1\r\n\r\n");
+    raw.push_back("DELETE " + base + "/1234 HTTP/1.1\r\n\r\n");
+    raw.push_back("GET " + base + "/1234/children/99 HTTP/1.1\r\n\r\n");
+    raw.push_back("GET " + base + "/1234/missing HTTP/1.1\r\n\r\n");
+  }
+  raw.push_back("GET /health HTTP/1.1\r\n\r\n");
+  return raw;
+}
+
+} // namespace bench
@@ -0,0 +1,59 @@
+// Compares route lookup in the radix-tree Router against the former
+// std::regex router on the same route table.
+//
+//   router-bench [iterations]
+
+#include "regex_router.hpp"
+#include "route_table.hpp"
+#include "router.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace {
+
+template <typename R>
+double ns_per_lookup(const R &router, std::vector<HttpRequest> &requests,
+                     size_t iterations, size_t &checksum) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    HttpRequest &req = requests[i % requests.size()];
+    checksum += static_cast<size_t>(router.handle(req).status_code);
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         static_cast<double>(iterations);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const size_t iterations =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+
+  Router radix;
+  RegexRouter regex;
+  bench::register_routes(radix);
+  bench::register_routes(regex);
+
+  const std::vector<std::string> raw = bench::build_requests();
+  std::vector<HttpRequest> requests(raw.size());
+  for (size_t i = 0; i < raw.size(); ++i) {
+    requests[i].parse_view(raw[i]);
+  }
+
+  size_t checksum = 0;
+  const double radix_ns = ns_per_lookup(radix, requests, iterations, checksum);
+  const double regex_ns = ns_per_lookup(regex, requests, iterations, checksum);
+
+  std::printf("routes: %zu, paths: %zu, iterations: %zu\n",
+              bench::kRouteCount, requests.size(), iterations);
+  std::printf("radix: %10.1f ns/lookup\n", radix_ns);
+  std::printf("regex: %10.1f ns/lookup\n", regex_ns);
+  std::printf("speedup: %.1fx (checksum %zu)\n", regex_ns / radix_ns,
+              checksum);
+  return 0;
+}
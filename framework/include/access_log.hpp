@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "spsc_ring.hpp"
+
+// One access-log entry as captured on the request path: fixed size, no
+// pointers, so recording it is a single copy into the worker's ring.
+struct AccessRecord {
+  static constexpr size_t METHOD_CAPACITY = 8;
+  static constexpr size_t PATH_CAPACITY = 104; // longer paths are truncated
+
+  int64_t unix_seconds;
+  uint32_t duration_us;
+  uint16_t status;
+  uint8_t method_length;
+  uint8_t path_length;
+  char method[METHOD_CAPACITY];
+  char path[PATH_CAPACITY];
+
+  void set_method(std::string_view m) noexcept {
+    method_length = static_cast<uint8_t>(std::min(m.size(), METHOD_CAPACITY));
+    std::memcpy(method, m.data(), method_length);
+  }
+
+  void set_path(std::string_view p) noexcept {
+    path_length = static_cast<uint8_t>(std::min(p.size(), PATH_CAPACITY));
+    std::memcpy(path, p.data(), path_length);
+  }
+};
+
+static_assert(sizeof(AccessRecord) == 128, "AccessRecord should be 2 lines");
+
+struct AccessLogConfig {
+  std::string path;           // empty = standard output
+  size_t max_file_bytes = 0;  // rotate once a file reaches this; 0 = never
+  unsigned max_files = 5;     // rotated files kept as path.1 .. path.N
+  size_t ring_capacity = 4096; // records buffered per worker thread
+  std::chrono::milliseconds flush_interval{5};
+};
+
+// Asynchronous access log. Every thread that records gets its own SPSC ring;
+// a background thread drains the rings, formats the records and writes them
+// in batches, so formatting and file I/O never run on a worker. A full ring
+// drops the record and counts it instead of blocking the event loop.
+class AccessLog {
+public:
+  static constexpr size_t WRITE_BATCH_BYTES = 64 * 1024;
+
+  explicit AccessLog(AccessLogConfig config = {})
+      : config_(std::move(config)), id_(next_id()) {
+    open_file();
+  }
+
+  ~AccessLog() {
+    running_.store(false, std::memory_order_release);
+    if (writer_.joinable()) {
+      writer_.join();
+    }
+    flush();
+    close_file();
+  }
+
+  AccessLog(const AccessLog &) = delete;
+  AccessLog &operator=(const AccessLog &) = delete;
+
+  // Process-wide log used by Middlewares::Logger; writes to stdout until
+  // configure() points it elsewhere.
+  static AccessLog &global() {
+    static AccessLog log;
+    return log;
+  }
+
+  // Switches the output file and rotation policy. Meant to be called before
+  // the server starts; records already queued go to the new file.
+  bool configure(AccessLogConfig config) {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    close_file();
+    config_ = std::move(config);
+    return open_file();
+  }
+
+  // Called on the request path. Never blocks and never allocates once the
+  // calling thread has its ring.
+  void record(const AccessRecord &entry) noexcept {
+    Producer &producer = local_producer();
+    if (!producer.ring.try_push(entry)) {
+      producer.dropped.store(
+          producer.dropped.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    }
+  }
+
+  // Records discarded because a worker's ring was full.
+  uint64_t dropped() const {
+    std::lock_guard<std::mutex> lock(producers_mutex_);
+    uint64_t total = 0;
+    for (const auto &producer : producers_) {
+      total += producer->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+private:
+  struct Producer {
+    explicit Producer(size_t capacity) : ring(capacity) {}
+    SpscRing<AccessRecord> ring;
+    std::atomic<uint64_t> dropped{0}; // written by the producer only
+  };
+
+  AccessLogConfig config_;
+  uint64_t id_; // identifies this log to the thread-local producer cache
+  int fd_ = -1;
+  size_t file_bytes_ = 0;
+  std::mutex file_mutex_;
+
+  mutable std::mutex producers_mutex_;
+  std::vector<std::unique_ptr<Producer>> producers_;
+
+  std::atomic<bool> running_{true};
+  std::thread writer_;
+
+  std::string batch_;
+  int64_t formatted_second_ = -1;
+  char timestamp_[32] = {};
+  size_t timestamp_length_ = 0;
+
+  // The calling thread's ring for this log, registered on the thread's first
+  // record to it. Ids are never reused, so entries of destroyed logs are
+  // never matched again.
+  Producer &local_producer() {
+    thread_local std::vector<std::pair<uint64_t, Producer *>> producers;
+    for (const auto &[id, producer] : producers) {
+      if (id == id_) {
+        return *producer;
+      }
+    }
+    producers.emplace_back(id_, register_producer());
+    return *producers.back().second;
+  }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> counter{0};
+    return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  // First record from a thread: give it a ring and make sure the writer runs.
+  Producer *register_producer() {
+    std::lock_guard<std::mutex> lock(producers_mutex_);
+    producers_.push_back(std::make_unique<Producer>(config_.ring_capacity));
+    if (!writer_.joinable()) {
+      writer_ = std::thread([this] { write_loop(); });
+    }
+    return producers_.back().get();
+  }
+
+  void write_loop() {
+    while (running_.load(std::memory_order_acquire)) {
+      if (flush() == 0) {
+        std::this_thread::sleep_for(config_.flush_interval);
+      }
+    }
+  }
+
+  // Drains every ring once; returns the number of records written.
+  size_t flush() {
+    std::vector<Producer *> producers;
+    {
+      std::lock_guard<std::mutex> lock(producers_mutex_);
+      producers.reserve(producers_.size());
+      for (auto &producer : producers_) {
+        producers.push_back(producer.get());
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    size_t written = 0;
+    for (Producer *producer : producers) {
+      written += producer->ring.drain([this](const AccessRecord &entry) {
+        format(entry);
+        if (batch_.size() >= WRITE_BATCH_BYTES) {
+          write_batch();
+        }
+      });
+    }
+    write_batch();
+    return written;
+  }
+
+  // "<ISO-8601>  <method>  <path>  <status>  <duration>μs"
+  void format(const AccessRecord &entry) {
+    if (entry.unix_seconds != formatted_second_) {
+      formatted_second_ = entry.unix_seconds;
+      const std::time_t t = static_cast<std::time_t>(entry.unix_seconds);
+      std::tm tm{};
+      gmtime_r(&t, &tm);
+      timestamp_length_ = std::strftime(timestamp_, sizeof(timestamp_),
+                                        "%Y-%m-%dT%H:%M:%SZ", &tm);
+    }
+
+    batch_.append(timestamp_, timestamp_length_);
+    batch_.append("  ");
+    batch_.append(entry.method, entry.method_length);
+    batch_.append("  ");
+    batch_.append(entry.path, entry.path_length);
+    batch_.append("  ");
+    append_number(entry.status);
+    batch_.append("  ");
+    append_number(entry.duration_us);
+    batch_.append("μs\n");
+  }
+
+  void append_number(uint64_t value) {
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    (void)ec;
+    batch_.append(digits, end);
+  }
+
+  void write_batch() {
+    if (batch_.empty()) {
+      return;
+    }
+    if (config_.max_file_bytes > 0 && !config_.path.empty() &&
+        file_bytes_ + batch_.size() > config_.max_file_bytes &&
+        file_bytes_ > 0) {
+      rotate();
+    }
+
+    if (fd_ < 0 && !config_.path.empty()) {
+      batch_.clear(); // the log file could not be opened
+      return;
+    }
+
+    const int fd = fd_ >= 0 ? fd_ : STDOUT_FILENO;
+    size_t offset = 0;
+    while (offset < batch_.size()) {
+      const ssize_t n =
+          ::write(fd, batch_.data() + offset, batch_.size() - offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break; // nowhere to log to; drop the batch
+      }
+      offset += static_cast<size_t>(n);
+    }
+    file_bytes_ += offset;
+    batch_.clear();
+  }
+
+  // path.N-1 -> path.N, ..., path -> path.1, then reopen path.
+  void rotate() {
+    close_file();
+    for (unsigned i = config_.max_files; i > 1; --i) {
+      const std::string from = config_.path + "." + std::to_string(i - 1);
+      const std::string to = config_.path + "." + std::to_string(i);
+      std::rename(from.c_str(), to.c_str());
+    }
+    if (config_.max_files > 0) {
+      std::rename(config_.path.c_str(), (config_.path + ".1").c_str());
+    } else {
+      ::unlink(config_.path.c_str());
+    }
+    open_file();
+  }
+
+  bool open_file() {
+    file_bytes_ = 0;
+    if (config_.path.empty()) {
+      return true;
+    }
+    fd_ = ::open(config_.path.c_str(),
+                 O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    const off_t size = ::lseek(fd_, 0, SEEK_END);
+    file_bytes_ = size > 0 ? static_cast<size_t>(size) : 0;
+    return true;
+  }
+
+  void close_file() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+#include "metrics.hpp"
+#include "peer_address.hpp"
+#include "request_arena.hpp"
+#include "task.hpp"
+
+// Coroutine route handler. It may co_await other Tasks and the ring
+// operations in async_io.hpp; the worker serves other connections while it
+// is suspended. The request stays valid until the handler returns.
+using AsyncHandler = std::function<Task<HttpResponse>(HttpRequest &)>;
+
+// A request answered by a coroutine handler, from routing to response.
+//
+// A coroutine route answers with a placeholder response carrying the call
+// (see defer()). Middleware around the route sees that placeholder; header
+// fields it adds are carried over to the real response, but nothing else
+// it does to it is. Middleware that needs the final response registers
+// on_response() (Middlewares::Logger does); ResponseCache and Compress do
+// not, so coroutine and proxy responses are neither cached nor compressed.
+// The socket then starts the call and writes the response once it has
+// finished. If the connection goes away first, the handler still runs to
+// completion and its response is dropped.
+//
+// The parsed request points into buffers that are recycled while the
+// handler is suspended, so the call keeps its own copy.
+class AsyncCall : public std::enable_shared_from_this<AsyncCall> {
+public:
+  AsyncCall(const HttpRequest &req,
+            std::shared_ptr<const AsyncHandler> handler)
+      : request_(req), handler_(std::move(handler)) {
+    request_.own();
+    if (req.peer) {
+      req.peer->ip(); // resolve while the descriptor is still the client's
+      peer_ = *req.peer;
+      request_.peer = &peer_;
+    }
+  }
+
+  static HttpResponse defer(const HttpRequest &req,
+                            std::shared_ptr<const AsyncHandler> handler) {
+    HttpResponse res;
+    res.deferred = std::make_shared<AsyncCall>(req, std::move(handler));
+    res.keep_alive = req.wants_keep_alive();
+    return res;
+  }
+
+  const HttpRequest &request() const noexcept { return request_; }
+
+  // Records the call's latency in the route's histogram when it finishes.
+  void measure(uint32_t metric_id,
+               std::chrono::steady_clock::time_point start) noexcept {
+    metric_id_ = metric_id;
+    start_ = start;
+  }
+
+  // Header fields set on the placeholder, added to the handler's response
+  // unless it sets them itself.
+  void keep_headers(const HeaderMap &headers) {
+    for (const auto &field : headers) {
+      headers_.push_back(field);
+    }
+  }
+
+  // Runs the handler up to its first suspension, or to the end.
+  void start() {
+    // The handler's frame and response outlive the batch being served.
+    RequestArena::Bypass heap;
+    run(shared_from_this());
+  }
+
+  bool finished() const noexcept { return response_.has_value(); }
+
+  HttpResponse &response() noexcept { return *response_; }
+
+  // Called with the final response when the handler finishes, on the
+  // worker that started the call, before the response is written.
+  void on_response(std::function<void(const HttpResponse &)> hook) {
+    response_hooks_.push_back(std::move(hook));
+  }
+
+  // Called once the handler finishes, if it had not by the end of start().
+  void on_finish(std::function<void()> callback) {
+    on_finish_ = std::move(callback);
+  }
+
+  // The connection is gone; the response will not be collected.
+  void abandon() noexcept { on_finish_ = nullptr; }
+
+private:
+  static constexpr uint32_t NO_METRIC = static_cast<uint32_t>(-1);
+
+  HttpRequest request_;
+  PeerAddress peer_;
+  std::shared_ptr<const AsyncHandler> handler_;
+  std::vector<std::pair<std::string, std::string>> headers_;
+  uint32_t metric_id_ = NO_METRIC;
+  std::chrono::steady_clock::time_point start_;
+  std::optional<HttpResponse> response_;
+  std::vector<std::function<void(const HttpResponse &)>> response_hooks_;
+  std::function<void()> on_finish_;
+
+  // Owns a reference to the call until the handler is done.
+  static DetachedTask run(std::shared_ptr<AsyncCall> self) {
+    HttpResponse res;
+    bool failed = false;
+    try {
+      res = co_await (*self->handler_)(self->request_);
+    } catch (...) {
+      failed = true;
+    }
+    if (failed) {
+      res.set_status(500);
+      res.set_body("Internal Server Error");
+    }
+    self->finish(std::move(res));
+  }
+
+  void finish(HttpResponse res) {
+    for (auto &[name, value] : headers_) {
+      if (!res.headers.count(name)) {
+        res.headers[name] = std::move(value);
+      }
+    }
+    if (metric_id_ != NO_METRIC) {
+      Metrics::global().local().record_route(
+          metric_id_,
+          static_cast<uint64_t>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start_)
+                  .count()));
+    }
+    response_.emplace(std::move(res));
+    for (const auto &hook : response_hooks_) {
+      hook(*response_);
+    }
+    if (on_finish_) {
+      const std::function<void()> callback = std::move(on_finish_);
+      callback();
+    }
+  }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+#include "task.hpp"
+
+namespace async {
+
+// A ring operation a coroutine is suspended on. Its completion stores the
+// CQE result and resumes the coroutine.
+struct alignas(8) Operation {
+  std::coroutine_handle<> waiter;
+  int result = 0;
+};
+
+inline __kernel_timespec to_timespec(std::chrono::nanoseconds duration) {
+  __kernel_timespec spec{};
+  spec.tv_sec = duration.count() / 1000000000;
+  spec.tv_nsec = duration.count() % 1000000000;
+  return spec;
+}
+
+} // namespace async
+
+// The ring that coroutine handlers submit their operations to. A socket
+// binds its ring to the thread running its event loop (see Scope) and hands
+// the completions tagged with its `tag` back to resume(), so a suspended
+// handler continues on that thread. Awaiting an operation on a thread with
+// no bound ring throws std::logic_error.
+class AsyncIo {
+public:
+  // Completions carry `tag` in the low bits of their user_data; linked
+  // timeouts, whose results nobody waits for, carry `ignored_user_data`.
+  AsyncIo(io_uring &ring, uint64_t tag, uint64_t ignored_user_data)
+      : ring_(&ring), tag_(tag), ignored_user_data_(ignored_user_data) {}
+
+  AsyncIo(const AsyncIo &) = delete;
+  AsyncIo &operator=(const AsyncIo &) = delete;
+
+  static AsyncIo &current() {
+    if (!active_) {
+      throw std::logic_error("no io_uring bound to this thread");
+    }
+    return *active_;
+  }
+
+  // A free SQE. The SQ is flushed first if fewer than `count` are free, so
+  // that linked entries reach the kernel together.
+  io_uring_sqe *get_sqe(unsigned count = 1) {
+    if (io_uring_sq_space_left(ring_) < count) {
+      io_uring_submit(ring_);
+    }
+    io_uring_sqe *sqe = io_uring_get_sqe(ring_);
+    while (!sqe) {
+      io_uring_submit(ring_);
+      sqe = io_uring_get_sqe(ring_);
+    }
+    return sqe;
+  }
+
+  uint64_t user_data(async::Operation *op) const noexcept {
+    return reinterpret_cast<uintptr_t>(op) | tag_;
+  }
+
+  uint64_t ignored_user_data() const noexcept { return ignored_user_data_; }
+
+  static void resume(async::Operation *op, int result) {
+    op->result = result;
+    op->waiter.resume();
+  }
+
+  // Binds `io` to the calling thread until the scope ends.
+  class Scope {
+  public:
+    explicit Scope(AsyncIo &io) : previous_(active_) { active_ = &io; }
+    ~Scope() { active_ = previous_; }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    AsyncIo *previous_;
+  };
+
+private:
+  static inline thread_local AsyncIo *active_ = nullptr;
+
+  io_uring *ring_;
+  uint64_t tag_;
+  uint64_t ignored_user_data_;
+};
+
+namespace async {
+
+// Awaitable submitting one SQE filled in by `prep`. co_await yields the CQE
+// result: a byte count or descriptor, or -errno. Buffers and addresses the
+// SQE points at must stay valid until then.
+template <typename Prep> class Op {
+public:
+  explicit Op(Prep prep) : prep_(std::move(prep)) {}
+
+  // Cancels the operation if it has not completed within `limit` (zero
+  // means never); it then yields -ECANCELED.
+  Op &timeout(std::chrono::nanoseconds limit) & {
+    timed_ = limit.count() > 0;
+    limit_ = to_timespec(limit);
+    return *this;
+  }
+
+  Op &&timeout(std::chrono::nanoseconds limit) && {
+    return std::move(timeout(limit));
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> waiter) {
+    AsyncIo &io = AsyncIo::current();
+    op_.waiter = waiter;
+    io_uring_sqe *sqe = io.get_sqe(timed_ ? 2 : 1);
+    prep_(sqe);
+    io_uring_sqe_set_data64(sqe, io.user_data(&op_));
+    if (timed_) {
+      sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe *timer = io.get_sqe();
+      io_uring_prep_link_timeout(timer, &limit_, 0);
+      io_uring_sqe_set_data64(timer, io.ignored_user_data());
+    }
+  }
+
+  int await_resume() const noexcept { return op_.result; }
+
+private:
+  Prep prep_;
+  Operation op_;
+  __kernel_timespec limit_{};
+  bool timed_ = false;
+};
+
+// Offset for reads and writes at the file position (and on sockets/pipes).
+inline constexpr uint64_t CURRENT_POSITION = static_cast<uint64_t>(-1);
+
+inline auto read(int fd, void *buffer, size_t length,
+                 uint64_t offset = CURRENT_POSITION) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_read(sqe, fd, buffer, static_cast<unsigned>(length),
+                       offset);
+  });
+}
+
+inline auto write(int fd, const void *data, size_t length,
+                  uint64_t offset = CURRENT_POSITION) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_write(sqe, fd, data, static_cast<unsigned>(length), offset);
+  });
+}
+
+// Socket I/O; sends never raise SIGPIPE.
+inline auto send(int fd, const void *data, size_t length) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_send(sqe, fd, data, length, MSG_NOSIGNAL);
+  });
+}
+
+inline auto recv(int fd, void *buffer, size_t length) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_recv(sqe, fd, buffer, length, 0);
+  });
+}
+
+// Moves up to `length` bytes between descriptors, one of which must be a
+// pipe, without copying them through user space. An offset of
+// CURRENT_POSITION reads or writes at the descriptor's position.
+inline auto splice(int fd_in, uint64_t offset_in, int fd_out,
+                   uint64_t offset_out, size_t length) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_splice(sqe, fd_in, static_cast<int64_t>(offset_in), fd_out,
+                         static_cast<int64_t>(offset_out),
+                         static_cast<unsigned>(length), 0);
+  });
+}
+
+inline auto connect(int fd, const sockaddr *address, socklen_t length) {
+  return Op([=](io_uring_sqe *sqe) {
+    io_uring_prep_connect(sqe, fd, address, length);
+  });
+}
+
+// Suspends the coroutine for `duration` without blocking the worker.
+class Sleep {
+public:
+  explicit Sleep(std::chrono::nanoseconds duration)
+      : spec_(to_timespec(duration)) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> waiter) {
+    AsyncIo &io = AsyncIo::current();
+    op_.waiter = waiter;
+    io_uring_sqe *sqe = io.get_sqe();
+    io_uring_prep_timeout(sqe, &spec_, 0, 0);
+    io_uring_sqe_set_data64(sqe, io.user_data(&op_));
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  __kernel_timespec spec_;
+  Operation op_;
+};
+
+inline Sleep sleep(std::chrono::nanoseconds duration) {
+  return Sleep(duration);
+}
+
+// Writes all of `bytes`, each write bounded by `limit`. The byte count, or
+// -errno (-EPIPE if the peer stopped accepting data).
+inline Task<int> write_all(int fd, std::string_view bytes,
+                           std::chrono::nanoseconds limit = {}) {
+  size_t done = 0;
+  while (done < bytes.size()) {
+    const int n =
+        co_await async::write(fd, bytes.data() + done, bytes.size() - done)
+            .timeout(limit);
+    if (n <= 0) {
+      co_return n < 0 ? n : -EPIPE;
+    }
+    done += static_cast<size_t>(n);
+  }
+  co_return static_cast<int>(done);
+}
+
+// write_all() for sockets: never raises SIGPIPE.
+inline Task<int> send_all(int fd, std::string_view bytes,
+                          std::chrono::nanoseconds limit = {}) {
+  size_t done = 0;
+  while (done < bytes.size()) {
+    const int n =
+        co_await async::send(fd, bytes.data() + done, bytes.size() - done)
+            .timeout(limit);
+    if (n <= 0) {
+      co_return n < 0 ? n : -EPIPE;
+    }
+    done += static_cast<size_t>(n);
+  }
+  co_return static_cast<int>(done);
+}
+
+// Opens a TCP connection to the numeric IPv4 or IPv6 address `host`. The
+// connected socket, or -errno. Host names are not resolved, since that
+// would block the worker.
+inline Task<int> connect_tcp(std::string host, uint16_t port,
+                             std::chrono::nanoseconds limit = {}) {
+  sockaddr_storage address{};
+  socklen_t length = 0;
+  auto *in = reinterpret_cast<sockaddr_in *>(&address);
+  auto *in6 = reinterpret_cast<sockaddr_in6 *>(&address);
+  if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    length = sizeof(sockaddr_in);
+  } else if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    length = sizeof(sockaddr_in6);
+  } else {
+    co_return -EINVAL;
+  }
+
+  const int fd = ::socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    co_return -errno;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  const int res =
+      co_await async::connect(
+          fd, reinterpret_cast<const sockaddr *>(&address), length)
+          .timeout(limit);
+  if (res < 0) {
+    ::close(fd);
+    co_return res;
+  }
+  co_return fd;
+}
+
+} // namespace async
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+
+#include "output_buffer.hpp"
+
+// Sink for a response body produced while the response is serialized (see
+// HttpResponse::set_writer()). Bytes go straight into the connection's
+// output buffer behind the already formatted head, so a body is never built
+// in a temporary string first. Shared pre-serialized fragments are sent from
+// where they are when large enough to be worth an iovec of their own.
+//
+// In chunked mode every run of bytes between fragments becomes one chunk;
+// its size is backpatched when the run ends.
+class BodyWriter {
+public:
+  // Fragments at most this long are copied rather than referenced.
+  static constexpr size_t INLINE_FRAGMENT_LIMIT = 2048;
+
+  BodyWriter(OutputBuffer &out, bool chunked)
+      : out_(&out), text_(&out.storage()), chunked_(chunked) {}
+
+  // Renders into a plain string; fragments are always copied.
+  explicit BodyWriter(std::string &text) : text_(&text) {}
+
+  BodyWriter(const BodyWriter &) = delete;
+  BodyWriter &operator=(const BodyWriter &) = delete;
+
+  void write(std::string_view bytes) {
+    open_chunk();
+    text_->append(bytes);
+    written_ += bytes.size();
+  }
+
+  void write(char c) {
+    open_chunk();
+    text_->push_back(c);
+    ++written_;
+  }
+
+  // Serializes `value` in place, the way nlohmann::json::dump() would.
+  void write_json(const nlohmann::json &value, int indent = -1) {
+    open_chunk();
+    const size_t start = text_->size();
+    // The adapter lives on the stack; the aliasing shared_ptr owns nothing.
+    Adapter adapter(*text_);
+    nlohmann::detail::serializer<nlohmann::json> serializer(
+        nlohmann::detail::output_adapter_t<char>(std::shared_ptr<void>(),
+                                                 &adapter),
+        ' ');
+    serializer.dump(value, indent >= 0, false,
+                    static_cast<unsigned>(indent >= 0 ? indent : 0));
+    written_ += text_->size() - start;
+  }
+
+  // A pre-serialized fragment that `fragment` keeps alive until it is sent.
+  void write_fragment(std::shared_ptr<const std::string> fragment) {
+    if (!out_ || fragment->size() <= INLINE_FRAGMENT_LIMIT) {
+      write(*fragment);
+      return;
+    }
+    const std::string_view bytes = *fragment;
+    close_chunk();
+    if (chunked_) {
+      append_chunk_size(bytes.size());
+    }
+    out_->append_shared(std::move(fragment), bytes);
+    if (chunked_) {
+      text_->append("\r\n");
+    }
+    written_ += bytes.size();
+  }
+
+  // Body bytes written so far, excluding chunk framing.
+  size_t size() const noexcept { return written_; }
+
+  // Ends the body: closes the open chunk and writes the last-chunk marker.
+  void finish() {
+    if (chunked_) {
+      close_chunk();
+      text_->append("0\r\n\r\n");
+    }
+  }
+
+private:
+  // Chunk sizes are reserved at a fixed width (any size_t fits) and
+  // backpatched; leading zeros are valid in chunk-size.
+  static constexpr size_t CHUNK_DIGITS = 2 * sizeof(size_t);
+  static constexpr size_t NO_CHUNK = static_cast<size_t>(-1);
+
+  struct Adapter final : nlohmann::detail::output_adapter_protocol<char> {
+    explicit Adapter(std::string &text) : text(text) {}
+
+    void write_character(char c) override { text.push_back(c); }
+
+    void write_characters(const char *s, std::size_t length) override {
+      text.append(s, length);
+    }
+
+    std::string &text;
+  };
+
+  OutputBuffer *out_ = nullptr;
+  std::string *text_;
+  bool chunked_ = false;
+  size_t written_ = 0;
+  size_t chunk_start_ = NO_CHUNK; // body offset in text_ of the open chunk
+
+  void open_chunk() {
+    if (!chunked_ || chunk_start_ != NO_CHUNK) {
+      return;
+    }
+    text_->append(CHUNK_DIGITS, '0');
+    text_->append("\r\n");
+    chunk_start_ = text_->size();
+  }
+
+  void close_chunk() {
+    if (chunk_start_ == NO_CHUNK) {
+      return;
+    }
+    const size_t length = text_->size() - chunk_start_;
+    const size_t header = chunk_start_ - CHUNK_DIGITS - 2;
+    chunk_start_ = NO_CHUNK;
+    if (length == 0) {
+      text_->resize(header); // a zero-size chunk would end the body
+      return;
+    }
+    write_hex(text_->data() + header, length);
+    text_->append("\r\n");
+  }
+
+  void append_chunk_size(size_t length) {
+    const size_t header = text_->size();
+    text_->append(CHUNK_DIGITS, '0');
+    write_hex(text_->data() + header, length);
+    text_->append("\r\n");
+  }
+
+  // Right-aligns `value` in CHUNK_DIGITS hex digits at `field`.
+  static void write_hex(char *field, size_t value) {
+    char digits[CHUNK_DIGITS];
+    const auto [end, ec] =
+        std::to_chars(digits, digits + sizeof(digits), value, 16);
+    (void)ec;
+    const size_t n = static_cast<size_t>(end - digits);
+    std::copy(digits, end, field + CHUNK_DIGITS - n);
+  }
+};
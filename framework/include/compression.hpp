@@ -0,0 +1,493 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <zlib.h>
+#ifdef WS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+
+enum class ContentEncoding : uint8_t { Identity, Deflate, Gzip, Zstd };
+
+namespace compression {
+
+inline constexpr bool zstd_available() {
+#ifdef WS_HAVE_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+inline std::string_view name(ContentEncoding encoding) {
+  switch (encoding) {
+  case ContentEncoding::Deflate:
+    return "deflate";
+  case ContentEncoding::Gzip:
+    return "gzip";
+  case ContentEncoding::Zstd:
+    return "zstd";
+  default:
+    return "identity";
+  }
+}
+
+namespace detail {
+
+inline std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ), in
+// thousandths. Anything malformed counts as 1.
+inline int parse_qvalue(std::string_view params) {
+  while (!params.empty()) {
+    const size_t semi = std::min(params.find(';'), params.size());
+    std::string_view param = trim(params.substr(0, semi));
+    params.remove_prefix(std::min(semi + 1, params.size()));
+    if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') ||
+        param[1] != '=') {
+      continue;
+    }
+    param.remove_prefix(2);
+    if (param.empty() || (param[0] != '0' && param[0] != '1')) {
+      return 1000;
+    }
+    int value = (param[0] - '0') * 1000;
+    int scale = 100;
+    for (size_t i = 2; i < param.size() && i < 5 && scale > 0; ++i) {
+      if (param[i] < '0' || param[i] > '9') {
+        break;
+      }
+      value += (param[i] - '0') * scale;
+      scale /= 10;
+    }
+    return std::min(value, 1000);
+  }
+  return 1000;
+}
+
+// One z_stream per wrapper and thread, reset between bodies instead of being
+// re-initialized (deflateInit2 allocates ~256 KiB of state).
+inline bool deflate_into(std::string_view input, int level, int window_bits,
+                         std::string &out) {
+  struct State {
+    z_stream stream{};
+    bool ready = false;
+    int level = 0;
+    ~State() {
+      if (ready) {
+        deflateEnd(&stream);
+      }
+    }
+  };
+  thread_local State states[2];
+  State &state = states[window_bits > 15];
+
+  if (input.size() > UINT32_MAX) {
+    return false;
+  }
+  if (state.ready && state.level != level) {
+    deflateEnd(&state.stream);
+    state.ready = false;
+  }
+  if (!state.ready) {
+    state.stream = {};
+    if (deflateInit2(&state.stream, level, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+    }
+    state.ready = true;
+    state.level = level;
+  } else {
+    deflateReset(&state.stream);
+  }
+
+  z_stream &stream = state.stream;
+  out.resize(deflateBound(&stream, static_cast<uLong>(input.size())));
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream.avail_in = static_cast<uInt>(input.size());
+  stream.next_out = reinterpret_cast<Bytef *>(out.data());
+  stream.avail_out = static_cast<uInt>(out.size());
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    return false;
+  }
+  out.resize(stream.total_out);
+  return true;
+}
+
+} // namespace detail
+
+// Picks the encoding for an Accept-Encoding value: the highest q-value wins,
+// ties go to zstd, then gzip, then deflate. Identity when nothing usable is
+// accepted.
+inline ContentEncoding negotiate(std::string_view accept, bool allow_zstd) {
+  int quality[4] = {-1, -1, -1, -1}; // indexed by ContentEncoding
+  int wildcard = -1;
+  while (!accept.empty()) {
+    const size_t comma = std::min(accept.find(','), accept.size());
+    std::string_view item = accept.substr(0, comma);
+    accept.remove_prefix(std::min(comma + 1, accept.size()));
+
+    const size_t semi = std::min(item.find(';'), item.size());
+    const std::string_view coding = detail::trim(item.substr(0, semi));
+    const int q = detail::parse_qvalue(item.substr(semi));
+    if (http_detail::iequals(coding, "gzip") ||
+        http_detail::iequals(coding, "x-gzip")) {
+      quality[static_cast<int>(ContentEncoding::Gzip)] = q;
+    } else if (http_detail::iequals(coding, "deflate")) {
+      quality[static_cast<int>(ContentEncoding::Deflate)] = q;
+    } else if (http_detail::iequals(coding, "zstd")) {
+      quality[static_cast<int>(ContentEncoding::Zstd)] = q;
+    } else if (coding == "*") {
+      wildcard = q;
+    }
+  }
+
+  ContentEncoding best = ContentEncoding::Identity;
+  int best_q = 0;
+  for (ContentEncoding candidate :
+       {ContentEncoding::Zstd, ContentEncoding::Gzip,
+        ContentEncoding::Deflate}) {
+    if (candidate == ContentEncoding::Zstd && !allow_zstd) {
+      continue;
+    }
+    int q = quality[static_cast<int>(candidate)];
+    if (q < 0) {
+      q = wildcard;
+    }
+    if (q > best_q) {
+      best = candidate;
+      best_q = q;
+    }
+  }
+  return best;
+}
+
+// Compresses `input` into `out`. `level` is the zlib level (1-9) for gzip
+// and deflate, the zstd level (1-19) for zstd.
+inline bool compress(ContentEncoding encoding, std::string_view input,
+                     int level, std::string &out) {
+  switch (encoding) {
+  case ContentEncoding::Gzip:
+    return detail::deflate_into(input, level, 15 + 16, out);
+  case ContentEncoding::Deflate:
+    // HTTP "deflate" is the zlib format (RFC 1950), not raw deflate.
+    return detail::deflate_into(input, level, 15, out);
+#ifdef WS_HAVE_ZSTD
+  case ContentEncoding::Zstd: {
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> context(
+        ZSTD_createCCtx(), ZSTD_freeCCtx);
+    if (!context) {
+      return false;
+    }
+    out.resize(ZSTD_compressBound(input.size()));
+    const size_t n = ZSTD_compressCCtx(context.get(), out.data(), out.size(),
+                                       input.data(), input.size(), level);
+    if (ZSTD_isError(n)) {
+      return false;
+    }
+    out.resize(n);
+    return true;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+} // namespace compression
+
+struct CompressionOptions {
+  size_t min_size = 1024; // smaller bodies are sent as they are
+  int gzip_level = 6;     // zlib level for gzip and deflate, 1 (fast) - 9
+  int zstd_level = 3;     // 1 (fast) - 19
+  bool zstd = true;       // offer zstd when built with it
+  // Compressed bodies of cacheable responses kept for reuse; 0 disables the
+  // cache and with it compression of file bodies.
+  size_t cache_bytes = 32 << 20;
+  size_t max_file_size = 8 << 20; // larger file bodies are not compressed
+};
+
+// Compresses response bodies for clients that accept gzip, deflate or zstd.
+// Only compressible media types (text, JSON, JavaScript, XML, SVG, WASM) of
+// at least `min_size` bytes in 200/203 responses are touched; responses that
+// already carry a Content-Encoding, ranges, prepared (cached) responses and
+// those of coroutine routes, which finish after this stage has run (see
+// AsyncCall), pass through. A response cache placed outside this stage must
+// vary on Accept-Encoding.
+//
+// The compressed bodies of cacheable responses are kept in a sharded LRU
+// keyed by encoding, request target and ETag (or, without an ETag, the body
+// itself), so repeated hits on the same JSON document or static asset pay for
+// compression once. File bodies are read and compressed only when they have
+// an ETag and the cache is enabled.
+class Compress {
+public:
+  static constexpr size_t SHARD_COUNT = 16;
+
+  explicit Compress(CompressionOptions options = {})
+      : store_(std::make_shared<Store>(std::move(options))) {}
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &req, NextFn &&next) const {
+    const std::string_view accept = req.header("Accept-Encoding");
+    HttpResponse res = next();
+    if (res.writer && !accept.empty()) {
+      auto type = res.headers.find("Content-Type");
+      if (type != res.headers.end() && compressible(type->second)) {
+        res.render_body(); // compression needs the whole body up front
+      }
+    }
+    if (!eligible(res)) {
+      return res;
+    }
+    add_vary(res);
+
+    const CompressionOptions &options = store_->options;
+    const ContentEncoding encoding = compression::negotiate(
+        accept, options.zstd && compression::zstd_available());
+    if (encoding == ContentEncoding::Identity) {
+      return res;
+    }
+
+    Body compressed = compressed_body(req, res, encoding);
+    if (!compressed || compressed->size() >= res.content_length()) {
+      return res;
+    }
+    res.body.assign(*compressed);
+    res.file = {};
+    res.headers["Content-Encoding"] = compression::name(encoding);
+    // The representation changed; a strong validator no longer matches it
+    // byte for byte.
+    auto etag = res.headers.find("ETag");
+    if (etag != res.headers.end() && etag->second.compare(0, 2, "W/") != 0) {
+      etag->second.insert(0, "W/");
+    }
+    return res;
+  }
+
+  uint64_t hits() const noexcept {
+    return store_->hits.load(std::memory_order_relaxed);
+  }
+
+  uint64_t misses() const noexcept {
+    return store_->misses.load(std::memory_order_relaxed);
+  }
+
+private:
+  using Body = std::shared_ptr<const std::string>;
+
+  struct Entry {
+    std::string identity; // see cache_identity()
+    Body body;
+    std::list<uint64_t>::iterator position;
+
+    size_t bytes() const noexcept { return identity.size() + body->size(); }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru; // keys, most recently used first
+    size_t bytes = 0;
+
+    void erase(std::unordered_map<uint64_t, Entry>::iterator it) {
+      bytes -= it->second.bytes();
+      lru.erase(it->second.position);
+      entries.erase(it);
+    }
+  };
+
+  struct Store {
+    explicit Store(CompressionOptions o)
+        : options(std::move(o)),
+          shard_budget(options.cache_bytes / SHARD_COUNT) {}
+
+    CompressionOptions options;
+    size_t shard_budget;
+    Shard shards[SHARD_COUNT];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
+
+  std::shared_ptr<Store> store_;
+
+  bool eligible(const HttpResponse &res) const {
+    if ((res.status_code != 200 && res.status_code != 203) || res.prepared ||
+        res.writer || res.deferred || res.headers.count("Content-Encoding")) {
+      return false;
+    }
+    const size_t length = res.content_length();
+    if (length < store_->options.min_size) {
+      return false;
+    }
+    if (res.file.fd >= 0 && (res.file.offset < 0 ||
+                             length > store_->options.max_file_size ||
+                             store_->options.cache_bytes == 0 ||
+                             !res.headers.count("ETag"))) {
+      return false;
+    }
+    auto type = res.headers.find("Content-Type");
+    return type != res.headers.end() && compressible(type->second);
+  }
+
+  static bool compressible(std::string_view type) {
+    if (type.substr(0, 5) == "text/") {
+      return true;
+    }
+    for (std::string_view marker : {"json", "javascript", "xml", "wasm"}) {
+      if (http_detail::icontains(type, marker)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void add_vary(HttpResponse &res) {
+    std::string &vary = res.headers["Vary"];
+    if (vary.empty()) {
+      vary = "Accept-Encoding";
+    } else if (!http_detail::icontains(vary, "accept-encoding") &&
+               vary != "*") {
+      vary += ", Accept-Encoding";
+    }
+  }
+
+  static bool cacheable(const HttpResponse &res) {
+    if (res.headers.count("Set-Cookie")) {
+      return false;
+    }
+    auto control = res.headers.find("Cache-Control");
+    if (control != res.headers.end()) {
+      for (std::string_view directive : {"no-store", "private"}) {
+        if (http_detail::icontains(control->second, directive)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  int level(ContentEncoding encoding) const {
+    return encoding == ContentEncoding::Zstd ? store_->options.zstd_level
+                                             : store_->options.gzip_level;
+  }
+
+  // What a cached body was compressed from: encoding, level and length,
+  // then the request target and ETag or, without an ETag, the body itself.
+  // ETags are only unique per resource, and static file ones are just size
+  // and mtime. Entries are found by its hash but must match all of it.
+  static void cache_identity(const HttpRequest &req, const HttpResponse &res,
+                             ContentEncoding encoding, int level,
+                             std::string &identity) {
+    const uint64_t length = res.content_length();
+    identity.clear();
+    identity += static_cast<char>(encoding);
+    identity += static_cast<char>(level);
+    identity.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    auto etag = res.headers.find("ETag");
+    if (etag != res.headers.end()) {
+      identity += 'E';
+      identity.append(req.raw_path_view);
+      identity += '\0';
+      identity.append(etag->second);
+    } else {
+      identity += 'B';
+      identity.append(res.body);
+    }
+  }
+
+  Body compressed_body(const HttpRequest &req, const HttpResponse &res,
+                       ContentEncoding encoding) const {
+    Store &store = *store_;
+    const int lvl = level(encoding);
+    const bool use_cache = store.options.cache_bytes > 0 && cacheable(res);
+    if (res.file.fd >= 0 && !use_cache) {
+      return nullptr;
+    }
+
+    thread_local std::string identity;
+    uint64_t key = 0;
+    Shard *shard = nullptr;
+    if (use_cache) {
+      cache_identity(req, res, encoding, lvl, identity);
+      key = std::hash<std::string>{}(identity);
+      shard = &store.shards[key % SHARD_COUNT];
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      auto it = shard->entries.find(key);
+      if (it != shard->entries.end() && it->second.identity == identity) {
+        shard->lru.splice(shard->lru.begin(), shard->lru, it->second.position);
+        store.hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second.body;
+      }
+    }
+
+    thread_local std::string input;
+    std::string_view source = res.body;
+    if (res.file.fd >= 0) {
+      if (!read_file(res.file, input)) {
+        return nullptr;
+      }
+      source = input;
+    }
+    auto output = std::make_shared<std::string>();
+    if (!compression::compress(encoding, source, lvl, *output)) {
+      return nullptr;
+    }
+    if (!use_cache) {
+      return output;
+    }
+
+    store.misses.fetch_add(1, std::memory_order_relaxed);
+    if (identity.size() + output->size() <= store.shard_budget) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      auto it = shard->entries.find(key);
+      if (it != shard->entries.end()) {
+        shard->erase(it); // the same entry, or one whose hash collides
+      }
+      shard->lru.push_front(key);
+      auto entry = shard->entries.emplace(
+          key, Entry{identity, output, shard->lru.begin()});
+      shard->bytes += entry.first->second.bytes();
+      while (shard->bytes > store.shard_budget) {
+        shard->erase(shard->entries.find(shard->lru.back()));
+      }
+    }
+    return output;
+  }
+
+  static bool read_file(const FileRange &range, std::string &out) {
+    out.resize(range.length);
+    size_t done = 0;
+    while (done < range.length) {
+      const ssize_t n = ::pread(range.fd, out.data() + done,
+                                range.length - done,
+                                range.offset + static_cast<off_t>(done));
+      if (n <= 0) {
+        return false;
+      }
+      done += static_cast<size_t>(n);
+    }
+    return true;
+  }
+};
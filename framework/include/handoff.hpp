@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// Listening sockets passed from a running server to the one replacing it,
+// so a restart never closes them and connections queued on them are simply
+// accepted by the new process.
+//
+// The running server offers its listeners on a Unix socket. A successor
+// connects, receives them (SCM_RIGHTS), starts serving them and then
+// acknowledges, which is the old server's cue to drain. A successor that
+// fails to start never acknowledges, and the old server carries on.
+namespace handoff {
+
+// How long an offer waits for the successor to start serving.
+inline constexpr std::chrono::milliseconds ACK_TIMEOUT{10000};
+
+namespace detail {
+
+inline constexpr char READY = 'R';
+// Descriptors per message; the kernel accepts at most 253.
+inline constexpr size_t BATCH = 250;
+
+inline bool make_address(const std::string &path, sockaddr_un &address) {
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  address = {};
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return true;
+}
+
+inline void close_all(const std::vector<int> &fds) {
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+}
+
+} // namespace detail
+
+// Successor side: the listeners a server offering them at `path` handed
+// over, and the channel to acknowledge on. Empty, with no channel, if
+// nobody offered any.
+struct Inherited {
+  std::vector<int> listeners;
+  int channel = -1;
+};
+
+inline Inherited receive(const std::string &path) {
+  Inherited inherited;
+  sockaddr_un address;
+  if (!detail::make_address(path, address)) {
+    return inherited;
+  }
+  const int channel = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (channel < 0) {
+    return inherited;
+  }
+  timeval timeout{5, 0};
+  setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint32_t count = 0;
+  if (::connect(channel, reinterpret_cast<const sockaddr *>(&address),
+                sizeof(address)) != 0 ||
+      ::recv(channel, &count, sizeof(count), MSG_WAITALL) !=
+          static_cast<ssize_t>(sizeof(count))) {
+    ::close(channel);
+    return inherited;
+  }
+
+  while (inherited.listeners.size() < count) {
+    char byte;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(detail::BATCH * sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    const ssize_t n = ::recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    const cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+      detail::close_all(inherited.listeners);
+      ::close(channel);
+      return {};
+    }
+    const size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const size_t first = inherited.listeners.size();
+    inherited.listeners.resize(first + received);
+    std::memcpy(inherited.listeners.data() + first, CMSG_DATA(cmsg),
+                received * sizeof(int));
+  }
+  inherited.channel = channel;
+  return inherited;
+}
+
+// Tells the previous server that its listeners are being served.
+inline void acknowledge(int &channel) {
+  if (channel >= 0) {
+    (void)!::send(channel, &detail::READY, 1, MSG_NOSIGNAL);
+    ::close(channel);
+    channel = -1;
+  }
+}
+
+// Offering side: a Unix socket at `path` for a successor to connect to,
+// replacing whatever socket file is there; -1 on failure. Only the owner
+// may connect.
+inline int listen(const std::string &path) {
+  sockaddr_un address;
+  if (!detail::make_address(path, address)) {
+    return -1;
+  }
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<const sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+      ::chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 || ::listen(fd, 1) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends `listeners` to the successor on `channel` (accepted from listen())
+// and waits up to `timeout` for it to acknowledge. True once it has; the
+// caller should then stop accepting.
+inline bool offer(int channel, const std::vector<int> &listeners,
+                  std::chrono::milliseconds timeout = ACK_TIMEOUT) {
+  ucred peer{};
+  socklen_t length = sizeof(peer);
+  if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+      (peer.uid != geteuid() && peer.uid != 0)) {
+    return false;
+  }
+
+  const auto count = static_cast<uint32_t>(listeners.size());
+  if (::send(channel, &count, sizeof(count), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(sizeof(count))) {
+    return false;
+  }
+  for (size_t sent = 0; sent < listeners.size();) {
+    const size_t batch = std::min(detail::BATCH, listeners.size() - sent);
+    char byte = 0;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(detail::BATCH * sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), listeners.data() + sent,
+                batch * sizeof(int));
+    if (::sendmsg(channel, &msg, MSG_NOSIGNAL) != 1) {
+      return false;
+    }
+    sent += batch;
+  }
+
+  pollfd ready{channel, POLLIN, 0};
+  char byte = 0;
+  return ::poll(&ready, 1, static_cast<int>(timeout.count())) == 1 &&
+         ::recv(channel, &byte, 1, 0) == 1 && byte == detail::READY;
+}
+
+} // namespace handoff
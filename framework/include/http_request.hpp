@@ -1,18 +1,194 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <charconv>
+#include <cstdint>
 #include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 
+#include "peer_address.hpp"
+#include "simd_scan.hpp"
+#include "small_vector.hpp"
+
 struct ParseResult {
   bool success = false;
   size_t bytes_consumed = 0;
+  // The input can never become a valid request (bad request line or
+  // Content-Length); the connection should be answered with 400.
+  bool malformed = false;
+  // The request body is framed by a Transfer-Encoding, which is not
+  // decoded; the connection should be answered with 501. Sent together with
+  // a Content-Length it is malformed instead (RFC 9112 6.1).
+  bool unsupported_framing = false;
+  // Set once the header block is complete, even if the body is still
+  // missing, so the caller can size its buffer or reject the request early.
+  size_t header_bytes = 0;
+  size_t content_length = 0;
+};
+
+// Headers the parser resolves once so lookups on the hot path are O(1).
+enum class KnownHeader : uint8_t {
+  ContentLength,
+  Connection,
+  Host,
+  ContentType,
+  Count,
+  None = Count
+};
+
+struct HeaderField {
+  std::string_view name;
+  std::string_view value;
+};
+
+using HeaderList = SmallVector<HeaderField, 24>;
+
+enum class HttpMethod : uint8_t {
+  GET,
+  HEAD,
+  POST,
+  PUT,
+  DELETE,
+  PATCH,
+  OPTIONS,
+  CONNECT,
+  TRACE,
+  Count,
+  Unknown = Count
+};
+
+inline HttpMethod parse_method(std::string_view m) noexcept {
+  switch (m.size()) {
+  case 3:
+    return m == "GET" ? HttpMethod::GET
+           : m == "PUT" ? HttpMethod::PUT
+                        : HttpMethod::Unknown;
+  case 4:
+    return m == "POST" ? HttpMethod::POST
+           : m == "HEAD" ? HttpMethod::HEAD
+                         : HttpMethod::Unknown;
+  case 5:
+    return m == "PATCH" ? HttpMethod::PATCH
+           : m == "TRACE" ? HttpMethod::TRACE
+                          : HttpMethod::Unknown;
+  case 6:
+    return m == "DELETE" ? HttpMethod::DELETE : HttpMethod::Unknown;
+  case 7:
+    return m == "OPTIONS" ? HttpMethod::OPTIONS
+           : m == "CONNECT" ? HttpMethod::CONNECT
+                            : HttpMethod::Unknown;
+  default:
+    return HttpMethod::Unknown;
+  }
+}
+
+inline std::string_view method_name(HttpMethod method) noexcept {
+  static constexpr std::string_view kNames[] = {
+      "GET",   "HEAD",    "POST",    "PUT",   "DELETE",
+      "PATCH", "OPTIONS", "CONNECT", "TRACE", "UNKNOWN"};
+  return kNames[static_cast<size_t>(method)];
+}
+
+// A path parameter captured by the router. The name points into the router,
+// the value into the request path.
+struct PathParam {
+  std::string_view name;
+  std::string_view value;
+};
+
+using PathParamList = SmallVector<PathParam, 8>;
+
+namespace http_detail {
+
+struct LowerTable {
+  unsigned char map[256];
+
+  constexpr LowerTable() : map() {
+    for (int c = 0; c < 256; ++c) {
+      map[c] = static_cast<unsigned char>(
+          (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+    }
+  }
 };
 
+inline constexpr LowerTable kLower{};
+
+inline bool iequals(std::string_view a, std::string_view b) noexcept {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (kLower.map[static_cast<unsigned char>(a[i])] !=
+        kLower.map[static_cast<unsigned char>(b[i])]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Case-insensitive substring search; `needle` must already be lowercase.
+inline bool icontains(std::string_view haystack,
+                      std::string_view needle) noexcept {
+  if (needle.size() > haystack.size()) {
+    return false;
+  }
+  for (size_t i = 0; i + needle.size() <= haystack.size(); ++i) {
+    size_t j = 0;
+    while (j < needle.size() &&
+           kLower.map[static_cast<unsigned char>(haystack[i + j])] ==
+               static_cast<unsigned char>(needle[j])) {
+      ++j;
+    }
+    if (j == needle.size()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Known header names indexed by length; each length has at most one entry,
+// so classification is one table load plus one case-insensitive compare.
+struct KnownHeaderTable {
+  std::string_view names[16];
+  KnownHeader ids[16];
+
+  constexpr KnownHeaderTable() : names(), ids() {
+    for (auto &id : ids) {
+      id = KnownHeader::None;
+    }
+    add("host", KnownHeader::Host);
+    add("connection", KnownHeader::Connection);
+    add("content-type", KnownHeader::ContentType);
+    add("content-length", KnownHeader::ContentLength);
+  }
+
+  constexpr void add(std::string_view name, KnownHeader id) {
+    names[name.size()] = name;
+    ids[name.size()] = id;
+  }
+};
+
+inline constexpr KnownHeaderTable kKnownHeaders{};
+
+inline KnownHeader classify_header(std::string_view name) noexcept {
+  if (name.size() >= 16) {
+    return KnownHeader::None;
+  }
+  const KnownHeader id = kKnownHeaders.ids[name.size()];
+  if (id != KnownHeader::None &&
+      iequals(name, kKnownHeaders.names[name.size()])) {
+    return id;
+  }
+  return KnownHeader::None;
+}
+
+} // namespace http_detail
+
 class HttpRequest {
 public:
   std::string method, path, version, body;
@@ -22,38 +198,63 @@ public:
 
   std::string raw_path;
 
+  // Zero-copy view of the request filled by parse_view(). The views point
+  // into the buffer that was parsed (or into this object after parse()) and
+  // are only valid while that buffer is alive and unchanged.
+  std::string_view method_view, raw_path_view, path_view, query_view,
+      version_view, body_view;
+  HttpMethod method_id = HttpMethod::Unknown;
+  HeaderList header_fields;
+  PathParamList path_param_views; // filled by the router
+  const PeerAddress *peer = nullptr; // set by the server for each request
+
+  // Compatibility parse: fills the owning strings and maps above. The views
+  // are re-pointed at the owned copies, so the input may be discarded.
   ParseResult parse(std::string_view raw) {
+    ParseResult result = parse_view(raw);
+    if (result.success) {
+      materialize();
+    }
+    return result;
+  }
+
+  // Zero-copy parse: only the views and header_fields are populated.
+  ParseResult parse_view(std::string_view raw) {
     ParseResult result;
+    reset_views();
     size_t pos = 0;
 
-    const size_t line_end = raw.find("\r\n", pos);
+    const size_t line_end = simd::find_crlf(raw, pos);
     if (line_end == std::string_view::npos) {
       return result;
     }
 
     const std::string_view request_line = raw.substr(pos, line_end - pos);
-    const size_t space1 = request_line.find(' ');
+    const size_t space1 = simd::find_byte(request_line, ' ');
     if (space1 == std::string_view::npos) {
+      result.malformed = true;
       return result;
     }
 
-    method = std::string(request_line.substr(0, space1));
+    method_view = request_line.substr(0, space1);
+    method_id = parse_method(method_view);
 
-    const size_t space2 = request_line.find(' ', space1 + 1);
+    const size_t space2 = simd::find_byte(request_line, ' ', space1 + 1);
     if (space2 == std::string_view::npos) {
+      result.malformed = true;
       return result;
     }
 
-    raw_path =
-        std::string(request_line.substr(space1 + 1, space2 - space1 - 1));
-    parse_path_and_query(raw_path);
-
-    version = std::string(request_line.substr(space2 + 1));
+    raw_path_view = request_line.substr(space1 + 1, space2 - space1 - 1);
+    version_view = request_line.substr(space2 + 1);
 
     pos = line_end + 2;
 
+    bool headers_complete = false;
+    bool transfer_encoding = false;
+    size_t content_length = 0;
     while (pos < raw.size()) {
-      const size_t header_line_end = raw.find("\r\n", pos);
+      const size_t header_line_end = simd::find_crlf(raw, pos);
       if (header_line_end == std::string_view::npos) {
         return result;
       }
@@ -61,94 +262,294 @@ public:
       const std::string_view line = raw.substr(pos, header_line_end - pos);
       if (line.empty()) {
         pos = header_line_end + 2;
+        headers_complete = true;
         break;
       }
 
-      const size_t colon = line.find(':');
-      if (colon != std::string_view::npos && colon + 1 < line.size()) {
-        std::string_view key = line.substr(0, colon);
-        std::string_view value = line.substr(colon + 1);
-        while (!value.empty() &&
-               std::isspace(static_cast<unsigned char>(value[0]))) {
-          value.remove_prefix(1);
+      const size_t colon = simd::find_byte(line, ':');
+      if (colon != std::string_view::npos) {
+        const std::string_view name = line.substr(0, colon);
+        const std::string_view value = trim(line.substr(colon + 1));
+        const KnownHeader id = http_detail::classify_header(name);
+        // A second length, even an equal one, or one that is not a plain
+        // number leaves the body boundary ambiguous (RFC 9112 6.3).
+        if (id == KnownHeader::ContentLength &&
+            (has_header(id) || !parse_length(value, content_length))) {
+          result.malformed = true;
+          return result;
+        }
+        if (id == KnownHeader::None &&
+            http_detail::iequals(name, "Transfer-Encoding")) {
+          transfer_encoding = true;
+        }
+        if (colon + 1 < line.size()) {
+          add_header(name, value, id);
         }
-
-        headers[std::string(key)] = std::string(value);
       }
 
       pos = header_line_end + 2;
     }
 
-    size_t content_length = 0;
-    const auto it = headers.find("Content-Length");
-    if (it != headers.end()) {
-      try {
-        content_length = std::stoul(it->second);
-      } catch (const std::invalid_argument &) {
-        return result;
-      } catch (const std::out_of_range &) {
-        return result;
-      }
+    if (!headers_complete) {
+      return result;
+    }
+    // Left undecoded, a chunked body would be read as the next pipelined
+    // request.
+    if (transfer_encoding) {
+      result.malformed = has_header(KnownHeader::ContentLength);
+      result.unsupported_framing = !result.malformed;
+      return result;
     }
 
+    result.header_bytes = pos;
+    result.content_length = content_length;
+
     if (content_length > 0) {
-      if (pos + content_length > raw.size()) {
+      if (content_length > raw.size() - pos) {
         return result;
       }
 
-      body = std::string(raw.substr(pos, content_length));
+      body_view = raw.substr(pos, content_length);
       pos += content_length;
     }
 
-    result.success = !method.empty();
+    split_target();
+
+    result.success = !method_view.empty();
     result.bytes_consumed = pos;
     return result;
   }
 
+  std::string_view header(KnownHeader id) const noexcept {
+    const int16_t index = known_headers[static_cast<size_t>(id)];
+    return index < 0 ? std::string_view{} : header_fields[index].value;
+  }
+
+  // Case-insensitive lookup; the last occurrence wins, as with `headers`.
+  std::string_view header(std::string_view name) const noexcept {
+    const KnownHeader id = http_detail::classify_header(name);
+    if (id != KnownHeader::None) {
+      return header(id);
+    }
+    for (size_t i = header_fields.size(); i-- > 0;) {
+      if (http_detail::iequals(header_fields[i].name, name)) {
+        return header_fields[i].value;
+      }
+    }
+    return {};
+  }
+
+  bool has_header(KnownHeader id) const noexcept {
+    return known_headers[static_cast<size_t>(id)] >= 0;
+  }
+
+  bool has_header(std::string_view name) const noexcept {
+    const KnownHeader id = http_detail::classify_header(name);
+    if (id != KnownHeader::None) {
+      return has_header(id);
+    }
+    for (const auto &field : header_fields) {
+      if (http_detail::iequals(field.name, name)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   bool wants_keep_alive() const noexcept {
-    auto it = headers.find("Connection");
-    if (it != headers.end()) {
-      std::string conn = it->second;
-      std::transform(conn.begin(), conn.end(), conn.begin(),
-                     [](unsigned char c) { return std::tolower(c); });
-      return conn.find("keep-alive") != std::string::npos;
+    if (known_headers[static_cast<size_t>(KnownHeader::Connection)] >= 0) {
+      return http_detail::icontains(header(KnownHeader::Connection),
+                                    "keep-alive");
     }
-    return version == "HTTP/1.1";
+    return version_view == "HTTP/1.1";
   }
 
   std::string get_query_param(const std::string &name,
                               const std::string &default_value = "") const {
     auto it = query_params.find(name);
-    return (it != query_params.end()) ? it->second : default_value;
+    if (it != query_params.end()) {
+      return it->second;
+    }
+    std::string value;
+    return find_query_view(name, value) ? value : default_value;
   }
 
   bool has_query_param(const std::string &name) const {
-    return query_params.find(name) != query_params.end();
+    if (query_params.find(name) != query_params.end()) {
+      return true;
+    }
+    std::string value;
+    return find_query_view(name, value);
+  }
+
+  // Zero-copy accessor for a path parameter captured by the router.
+  std::string_view path_param(std::string_view name) const noexcept {
+    for (const auto &param : path_param_views) {
+      if (param.name == name) {
+        return param.value;
+      }
+    }
+    return {};
   }
 
   std::string get_path_param(const std::string &name,
                              const std::string &default_value = "") const {
+    for (const auto &param : path_param_views) {
+      if (param.name == name) {
+        return std::string(param.value);
+      }
+    }
     auto it = path_params.find(name);
     return (it != path_params.end()) ? it->second : default_value;
   }
 
   bool has_path_param(const std::string &name) const {
+    for (const auto &param : path_param_views) {
+      if (param.name == name) {
+        return true;
+      }
+    }
     return path_params.find(name) != path_params.end();
   }
 
+  // True once parse() has filled the owning std::string/std::map members.
+  bool is_materialized() const noexcept { return materialized; }
+
+  // Cuts a copy loose from the buffer the original was parsed from: fills
+  // the owning members as parse() does and re-points every view, path
+  // parameters included, at them. The original must still be alive.
+  void own() {
+    const std::string_view parsed_path = path_view;
+    materialize();
+    for (auto &param : path_param_views) {
+      param.value = path_view.substr(
+          static_cast<size_t>(param.value.data() - parsed_path.data()),
+          param.value.size());
+      path_params[std::string(param.name)] = std::string(param.value);
+    }
+  }
+
 private:
-  void parse_path_and_query(const std::string &full_path) {
-    size_t question_mark = full_path.find('?');
+  std::array<int16_t, static_cast<size_t>(KnownHeader::Count)> known_headers{
+      -1, -1, -1, -1};
+  std::string decoded_path;
+  bool materialized = false;
+
+  void reset_views() {
+    method_view = raw_path_view = path_view = query_view = version_view =
+        body_view = {};
+    method_id = HttpMethod::Unknown;
+    header_fields.clear();
+    path_param_views.clear();
+    known_headers.fill(-1);
+    materialized = false;
+  }
 
-    if (question_mark == std::string::npos) {
-      path = url_decode(full_path);
-      return;
+  void add_header(std::string_view name, std::string_view value,
+                  KnownHeader id) {
+    if (id != KnownHeader::None) {
+      known_headers[static_cast<size_t>(id)] =
+          static_cast<int16_t>(header_fields.size());
     }
+    header_fields.push_back({name, value});
+  }
+
+  static bool parse_length(std::string_view value, size_t &length) noexcept {
+    const char *first = value.data();
+    const char *last = first + value.size();
+    auto [ptr, ec] = std::from_chars(first, last, length);
+    return !value.empty() && ec == std::errc() && ptr == last;
+  }
+
+  static std::string_view trim(std::string_view value) noexcept {
+    while (!value.empty() &&
+           std::isspace(static_cast<unsigned char>(value.front()))) {
+      value.remove_prefix(1);
+    }
+    while (!value.empty() &&
+           std::isspace(static_cast<unsigned char>(value.back()))) {
+      value.remove_suffix(1);
+    }
+    return value;
+  }
 
-    path = url_decode(full_path.substr(0, question_mark));
-    std::string query_string = full_path.substr(question_mark + 1);
+  // Splits raw_path_view into path_view/query_view. The path is only decoded
+  // (and therefore copied) when it actually contains escapes.
+  void split_target() {
+    const size_t question_mark = simd::find_byte(raw_path_view, '?');
+    std::string_view raw = raw_path_view;
+    if (question_mark != std::string_view::npos) {
+      raw = raw_path_view.substr(0, question_mark);
+      query_view = raw_path_view.substr(question_mark + 1);
+    }
+
+    if (raw.find_first_of("%+") == std::string_view::npos) {
+      path_view = raw;
+    } else {
+      decoded_path = url_decode(std::string(raw));
+      path_view = decoded_path;
+    }
+  }
 
-    parse_query_string(query_string);
+  void materialize() {
+    method = std::string(method_view);
+    raw_path = std::string(raw_path_view);
+    version = std::string(version_view);
+    body = std::string(body_view);
+    path = std::string(path_view);
+    if (!query_view.empty()) {
+      parse_query_string(std::string(query_view));
+    }
+
+    for (const auto &field : header_fields) {
+      headers[std::string(field.name)] = std::string(field.value);
+    }
+
+    method_view = method;
+    raw_path_view = raw_path;
+    version_view = version;
+    body_view = body;
+    path_view = path;
+    const size_t question_mark = raw_path.find('?');
+    query_view = question_mark == std::string::npos
+                     ? std::string_view{}
+                     : std::string_view(raw_path).substr(question_mark + 1);
+
+    for (auto &field : header_fields) {
+      auto it = headers.find(std::string(field.name));
+      field.name = it->first;
+      field.value = it->second;
+    }
+    materialized = true;
+  }
+
+  bool find_query_view(const std::string &name, std::string &value) const {
+    if (materialized) {
+      return false;
+    }
+
+    size_t pos = 0;
+    bool found = false;
+    while (pos <= query_view.size() && !query_view.empty()) {
+      size_t amp_pos = query_view.find('&', pos);
+      if (amp_pos == std::string_view::npos) {
+        amp_pos = query_view.size();
+      }
+
+      const std::string_view pair = query_view.substr(pos, amp_pos - pos);
+      const size_t eq_pos = pair.find('=');
+      const std::string key =
+          url_decode(std::string(pair.substr(0, eq_pos)));
+      if (!pair.empty() && key == name) {
+        value = eq_pos == std::string_view::npos
+                    ? std::string()
+                    : url_decode(std::string(pair.substr(eq_pos + 1)));
+        found = true;
+      }
+
+      pos = amp_pos + 1;
+    }
+    return found;
   }
 
   void parse_query_string(const std::string &query_string) {
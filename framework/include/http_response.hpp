@@ -1,79 +1,536 @@
 #pragma once
 
-#include <map>
+#include <array>
+#include <charconv>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <memory_resource>
 #include <nlohmann/json.hpp>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "body_writer.hpp"
+#include "http_request.hpp"
+#include "output_buffer.hpp"
+#include "request_arena.hpp"
+
+class AsyncCall;
+struct WebSocketHandler;
 
 static constexpr int KEEPALIVE_TIMEOUT = 5;
 static constexpr int KEEPALIVE_MAX = 100;
 static constexpr int JSON_INDENTATION = -1; // No indentation for production
 
+namespace http_status {
+
+inline constexpr int MIN_CODE = 100;
+inline constexpr int MAX_CODE = 599;
+
+// Reason phrases of every registered status code, indexed by code.
+struct ReasonTable {
+  std::array<std::string_view, MAX_CODE + 1> reasons{};
+
+  constexpr ReasonTable() {
+    reasons[100] = "Continue";
+    reasons[101] = "Switching Protocols";
+    reasons[102] = "Processing";
+    reasons[103] = "Early Hints";
+    reasons[200] = "OK";
+    reasons[201] = "Created";
+    reasons[202] = "Accepted";
+    reasons[203] = "Non-Authoritative Information";
+    reasons[204] = "No Content";
+    reasons[205] = "Reset Content";
+    reasons[206] = "Partial Content";
+    reasons[207] = "Multi-Status";
+    reasons[208] = "Already Reported";
+    reasons[226] = "IM Used";
+    reasons[300] = "Multiple Choices";
+    reasons[301] = "Moved Permanently";
+    reasons[302] = "Found";
+    reasons[303] = "See Other";
+    reasons[304] = "Not Modified";
+    reasons[305] = "Use Proxy";
+    reasons[307] = "Temporary Redirect";
+    reasons[308] = "Permanent Redirect";
+    reasons[400] = "Bad Request";
+    reasons[401] = "Unauthorized";
+    reasons[402] = "Payment Required";
+    reasons[403] = "Forbidden";
+    reasons[404] = "Not Found";
+    reasons[405] = "Method Not Allowed";
+    reasons[406] = "Not Acceptable";
+    reasons[407] = "Proxy Authentication Required";
+    reasons[408] = "Request Timeout";
+    reasons[409] = "Conflict";
+    reasons[410] = "Gone";
+    reasons[411] = "Length Required";
+    reasons[412] = "Precondition Failed";
+    reasons[413] = "Payload Too Large";
+    reasons[414] = "URI Too Long";
+    reasons[415] = "Unsupported Media Type";
+    reasons[416] = "Range Not Satisfiable";
+    reasons[417] = "Expectation Failed";
+    reasons[418] = "I'm a teapot";
+    reasons[421] = "Misdirected Request";
+    reasons[422] = "Unprocessable Content";
+    reasons[423] = "Locked";
+    reasons[424] = "Failed Dependency";
+    reasons[425] = "Too Early";
+    reasons[426] = "Upgrade Required";
+    reasons[428] = "Precondition Required";
+    reasons[429] = "Too Many Requests";
+    reasons[431] = "Request Header Fields Too Large";
+    reasons[451] = "Unavailable For Legal Reasons";
+    reasons[500] = "Internal Server Error";
+    reasons[501] = "Not Implemented";
+    reasons[502] = "Bad Gateway";
+    reasons[503] = "Service Unavailable";
+    reasons[504] = "Gateway Timeout";
+    reasons[505] = "HTTP Version Not Supported";
+    reasons[506] = "Variant Also Negotiates";
+    reasons[507] = "Insufficient Storage";
+    reasons[508] = "Loop Detected";
+    reasons[510] = "Not Extended";
+    reasons[511] = "Network Authentication Required";
+  }
+};
+
+inline constexpr ReasonTable kReasons{};
+
+inline std::string_view reason(int code) noexcept {
+  if (code < MIN_CODE || code > MAX_CODE) {
+    return {};
+  }
+  return kReasons.reasons[static_cast<size_t>(code)];
+}
+
+// Complete "HTTP/1.1 <code> <reason>\r\n" lines, built once on first use.
+inline const std::string &status_line(int code) {
+  static const std::vector<std::string> lines = [] {
+    std::vector<std::string> table(MAX_CODE + 1);
+    for (int c = MIN_CODE; c <= MAX_CODE; ++c) {
+      if (!kReasons.reasons[static_cast<size_t>(c)].empty()) {
+        table[static_cast<size_t>(c)] =
+            "HTTP/1.1 " + std::to_string(c) + " " +
+            std::string(kReasons.reasons[static_cast<size_t>(c)]) + "\r\n";
+      }
+    }
+    return table;
+  }();
+  static const std::string empty;
+  return (code < MIN_CODE || code > MAX_CODE)
+             ? empty
+             : lines[static_cast<size_t>(code)];
+}
+
+} // namespace http_status
+
+// Per-thread cache of the IMF-fixdate used for the Date header, reformatted
+// at most once per second.
+class HttpDate {
+public:
+  static std::string_view now() {
+    thread_local HttpDate cache;
+    const std::time_t t = std::time(nullptr);
+    if (t != cache.second) {
+      cache.second = t;
+      cache.length = format(t, cache.text, sizeof(cache.text));
+    }
+    return {cache.text, cache.length};
+  }
+
+  static size_t format(std::time_t t, char *out, size_t size) {
+    std::tm tm{};
+    gmtime_r(&t, &tm);
+    return std::strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  }
+
+private:
+  std::time_t second = -1;
+  char text[32] = {};
+  size_t length = 0;
+};
+
+// Insertion-ordered header list with case-insensitive keys. A flat vector
+// beats a node-based map for the handful of headers a response carries.
+// While a request is being served the vector lives in the worker's
+// RequestArena; a copy always uses the heap.
+class HeaderMap {
+public:
+  using value_type = std::pair<std::string, std::string>;
+  using iterator = std::pmr::vector<value_type>::iterator;
+  using const_iterator = std::pmr::vector<value_type>::const_iterator;
+
+  HeaderMap() : entries_(RequestArena::current()) {}
+
+  std::string &operator[](std::string_view key) {
+    auto it = find(key);
+    if (it != entries_.end()) {
+      return it->second;
+    }
+    entries_.emplace_back(std::string(key), std::string());
+    return entries_.back().second;
+  }
+
+  // Appends a field even if one of that name exists (e.g. Set-Cookie).
+  void add(std::string_view key, std::string_view value) {
+    entries_.emplace_back(std::string(key), std::string(value));
+  }
+
+  iterator find(std::string_view key) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (http_detail::iequals(it->first, key)) {
+        return it;
+      }
+    }
+    return entries_.end();
+  }
+
+  const_iterator find(std::string_view key) const {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (http_detail::iequals(it->first, key)) {
+        return it;
+      }
+    }
+    return entries_.end();
+  }
+
+  size_t count(std::string_view key) const { return find(key) != end(); }
+
+  size_t erase(std::string_view key) {
+    auto it = find(key);
+    if (it == entries_.end()) {
+      return 0;
+    }
+    entries_.erase(it);
+    return 1;
+  }
+
+  iterator begin() noexcept { return entries_.begin(); }
+  iterator end() noexcept { return entries_.end(); }
+  const_iterator begin() const noexcept { return entries_.begin(); }
+  const_iterator end() const noexcept { return entries_.end(); }
+  size_t size() const noexcept { return entries_.size(); }
+  bool empty() const noexcept { return entries_.empty(); }
+  void clear() noexcept { entries_.clear(); }
+
+private:
+  std::pmr::vector<value_type> entries_;
+};
+
+// Header fields and body of a response serialized ahead of time (e.g. by a
+// cache). Only the status line, Connection and Date are written per request.
+struct PreparedResponse {
+  int status_code = 200;
+  std::string bytes;      // header fields, blank line, body
+  size_t head_length = 0; // bytes before the body
+};
+
 class HttpResponse {
 public:
+  // Bodies up to this size are copied next to the headers; larger ones are
+  // handed to the socket as a separate iovec without copying.
+  static constexpr size_t INLINE_BODY_LIMIT = 2048;
+
   int status_code = 200;
   std::string status_message = "OK";
   std::string body;
-  std::map<std::string, std::string> headers;
+  // Body produced while the response is serialized, straight into the
+  // output buffer, instead of `body` (see set_writer()).
+  std::function<void(BodyWriter &)> writer;
+  // Sends a writer body with chunked transfer coding rather than a
+  // backpatched Content-Length. Ignored for HTTP/1.0 clients.
+  bool chunked = false;
+  // Body streamed from a file instead of `body` (see set_file()).
+  FileRange file;
+  // Pre-serialized fields and body, sent after `headers` (see prepare()).
+  std::shared_ptr<const PreparedResponse> prepared;
+  // Content-Length is derived from the body when the response is serialized.
+  HeaderMap headers;
   bool keep_alive = true;
+  // Keep-Alive field line sent with `keep_alive`; the socket points it at
+  // one rendered from its own idle timeout and request limit. May be empty.
+  std::string_view keep_alive_field = DEFAULT_KEEP_ALIVE_FIELD;
+  // Answer to a HEAD request: the headers describe the body, which is not
+  // sent.
+  bool head_only = false;
+  // Set on a 101 answer to a WebSocket upgrade (see websocket_handshake());
+  // the socket switches the connection over once it is written.
+  std::shared_ptr<const WebSocketHandler> upgrade;
+  // Set on the placeholder a coroutine route answers with (see AsyncCall);
+  // the socket sends the handler's response in its place.
+  std::shared_ptr<AsyncCall> deferred;
 
   HttpResponse() = default;
 
-  void set_body(const std::string &content,
-                const std::string &content_type = "text/plain") {
-    body = content;
+  void set_body(std::string content,
+                std::string_view content_type = "text/plain") {
+    body = std::move(content);
+    headers["Content-Type"] = content_type;
+  }
+
+  void set_file(FileRange range, std::string_view content_type) {
+    body.clear();
+    file = std::move(range);
     headers["Content-Type"] = content_type;
-    headers["Content-Length"] = std::to_string(body.length());
+  }
+
+  // Leaves the body to `write`, called when the response is serialized.
+  // It may write bytes, JSON values and shared pre-serialized fragments.
+  void set_writer(std::function<void(BodyWriter &)> write,
+                  std::string_view content_type) {
+    body.clear();
+    file = {};
+    writer = std::move(write);
+    headers["Content-Type"] = content_type;
+  }
+
+  // Not known for a writer body until render_body() has run.
+  size_t content_length() const noexcept {
+    return file.fd >= 0 ? file.length : body.size();
   }
 
   void set_json(const nlohmann::json &j) {
     set_body(j.dump(JSON_INDENTATION), "application/json");
   }
 
+  // Like set_json(), but `j` is serialized into the output buffer when the
+  // response is written, without an intermediate string.
+  void stream_json(nlohmann::json j) {
+    set_writer(
+        [j = std::move(j)](BodyWriter &out) {
+          out.write_json(j, JSON_INDENTATION);
+        },
+        "application/json");
+  }
+
+  // Runs a writer into `body`, for code that needs the bytes themselves
+  // (compression, caching).
+  void render_body() {
+    if (!writer) {
+      return;
+    }
+    body.clear();
+    BodyWriter out(body);
+    writer(out);
+    writer = nullptr;
+    chunked = false;
+  }
+
   void set_status(int code) {
     status_code = code;
-    switch (code) {
-    case 200:
-      status_message = "OK";
-      break;
-    case 201:
-      status_message = "Created";
-      break;
-    case 400:
-      status_message = "Bad Request";
-      break;
-    case 404:
-      status_message = "Not Found";
-      break;
-    case 500:
-      status_message = "Internal Server Error";
-      break;
-    default:
-      status_message = "Unknown Status";
-      break;
+    const std::string_view text = http_status::reason(code);
+    status_message = text.empty() ? std::string_view("Unknown Status") : text;
+  }
+
+  // Serializes everything after the Date line (header fields, Content-Length
+  // and body) for reuse by later responses. Not for file bodies.
+  std::shared_ptr<const PreparedResponse> prepare() const {
+    if (writer) {
+      HttpResponse rendered = *this;
+      rendered.render_body();
+      return rendered.prepare();
     }
+    auto result = std::make_shared<PreparedResponse>();
+    result->status_code = status_code;
+    OutputBuffer out;
+    write_fields(out);
+    result->bytes = std::move(out.storage());
+    result->head_length = result->bytes.size();
+    result->bytes += body;
+    return result;
+  }
+
+  // Formats the response into `out`. Large bodies are moved into `out`
+  // rather than copied, so the response should not be reused afterwards.
+  void write_to(OutputBuffer &out) {
+    if (prepared) {
+      write_start(out);
+      write_header_lines(out);
+      const std::string_view bytes = prepared->bytes;
+      if (head_only) {
+        out.append(bytes.substr(0, prepared->head_length));
+      } else if (bytes.size() > INLINE_BODY_LIMIT) {
+        out.append_shared(prepared, bytes);
+      } else {
+        out.append(bytes);
+      }
+      return;
+    }
+    if (writer && has_body_status()) {
+      if (head_only) {
+        render_body(); // only for its length
+      } else {
+        write_streamed(out);
+        return;
+      }
+    }
+
+    write_head(out);
+    if (head_only) {
+      return;
+    }
+    if (file.fd >= 0) {
+      out.append_file(std::move(file));
+      file = {};
+    } else if (body.size() > INLINE_BODY_LIMIT) {
+      out.append_body(std::move(body));
+      body.clear();
+    } else {
+      out.append(body);
+    }
+  }
+
+  // Status line and header block, including the terminating blank line.
+  void write_head(OutputBuffer &out) const {
+    write_start(out);
+    write_fields(out);
   }
 
   std::string to_string() const {
-    std::ostringstream oss;
+    if (writer) {
+      HttpResponse rendered = *this;
+      rendered.render_body();
+      return rendered.to_string();
+    }
+    OutputBuffer out;
+    if (prepared) {
+      write_start(out);
+      write_header_lines(out);
+      const std::string_view bytes = prepared->bytes;
+      out.append(head_only ? bytes.substr(0, prepared->head_length) : bytes);
+      return std::move(out.storage());
+    }
+    write_head(out);
+    if (head_only) {
+      return std::move(out.storage());
+    }
+    if (file.fd >= 0) {
+      std::string &text = out.storage();
+      const size_t start = text.size();
+      text.resize(start + file.length);
+      const ssize_t n =
+          pread(file.fd, text.data() + start, file.length, file.offset);
+      text.resize(start + static_cast<size_t>(std::max<ssize_t>(n, 0)));
+    } else {
+      out.append(body);
+    }
+    return std::move(out.storage());
+  }
 
-    oss << "HTTP/1.1 " << status_code << " " << status_message << "\r\n";
+private:
+  static constexpr std::string_view DEFAULT_KEEP_ALIVE_FIELD =
+      "Keep-Alive: timeout=5, max=100\r\n";
+  static_assert(KEEPALIVE_TIMEOUT == 5 && KEEPALIVE_MAX == 100,
+                "the default Keep-Alive field must match the constants");
 
-    if (keep_alive) {
-      oss << "Connection: keep-alive\r\n";
-      oss << "Keep-Alive: timeout=" << KEEPALIVE_TIMEOUT
-          << ", max=" << KEEPALIVE_MAX << "\r\n";
+  static constexpr size_t LENGTH_DIGITS = 20; // any size_t
+  static constexpr char LENGTH_PADDING[] = "                    ";
+  static_assert(sizeof(LENGTH_PADDING) == LENGTH_DIGITS + 1);
+
+  // Status line, Connection and Date: the per-request part of the head.
+  void write_start(OutputBuffer &out) const {
+    const std::string &line = http_status::status_line(status_code);
+    if (!line.empty() && status_message == http_status::reason(status_code)) {
+      out.append(line);
     } else {
-      oss << "Connection: close\r\n";
+      out.append("HTTP/1.1 ");
+      append_number(out, static_cast<size_t>(status_code));
+      out.append(' ');
+      out.append(status_message);
+      out.append("\r\n");
     }
 
-    for (const auto &[key, val] : headers) {
-      oss << key << ": " << val << "\r\n";
+    if (status_code == 101) {
+      // Connection: Upgrade is one of the header fields.
+    } else if (keep_alive) {
+      out.append("Connection: keep-alive\r\n");
+      out.append(keep_alive_field);
+    } else {
+      out.append("Connection: close\r\n");
+    }
+
+    out.append("Date: ");
+    out.append(HttpDate::now());
+    out.append("\r\n");
+  }
+
+  // Header fields, Content-Length and the blank line ending the head.
+  void write_fields(OutputBuffer &out) const {
+    write_header_lines(out);
+
+    if (has_body_status()) {
+      out.append("Content-Length: ");
+      // A HEAD answer with no body of its own (one relayed from another
+      // server, say) may state the length in the field instead.
+      const auto declared = head_only && content_length() == 0
+                                ? headers.find("Content-Length")
+                                : headers.end();
+      if (declared != headers.end()) {
+        out.append(declared->second);
+      } else {
+        append_number(out, content_length());
+      }
+      out.append("\r\n");
+    }
+    out.append("\r\n");
+  }
+
+  // 1xx, 204 and 304 responses carry no body and no Content-Length.
+  bool has_body_status() const noexcept {
+    return status_code >= 200 && status_code != 204 && status_code != 304;
+  }
+
+  // Head and writer body. Content-Length gets a blank field that is filled
+  // in once the body is complete; trailing whitespace is optional
+  // whitespace, so the padding is harmless.
+  void write_streamed(OutputBuffer &out) {
+    write_start(out);
+    write_header_lines(out);
+    std::string &text = out.storage();
+    size_t length_field = 0;
+    if (chunked) {
+      out.append("Transfer-Encoding: chunked\r\n\r\n");
+    } else {
+      out.append("Content-Length: ");
+      length_field = text.size();
+      out.append(std::string_view(LENGTH_PADDING, LENGTH_DIGITS));
+      out.append("\r\n\r\n");
+    }
+
+    BodyWriter sink(out, chunked);
+    writer(sink);
+    sink.finish();
+    writer = nullptr;
+
+    if (!chunked) {
+      char *field = text.data() + length_field;
+      std::to_chars(field, field + LENGTH_DIGITS, sink.size());
     }
+  }
 
-    oss << "\r\n";
-    oss << body;
+  void write_header_lines(OutputBuffer &out) const {
+    for (const auto &[key, val] : headers) {
+      if (http_detail::iequals(key, "Content-Length") ||
+          (writer && http_detail::iequals(key, "Transfer-Encoding"))) {
+        continue;
+      }
+      out.append(key);
+      out.append(": ");
+      out.append(val);
+      out.append("\r\n");
+    }
+  }
 
-    return oss.str();
+  static void append_number(OutputBuffer &out, size_t value) {
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    (void)ec;
+    out.append(std::string_view(digits, static_cast<size_t>(end - digits)));
   }
 };
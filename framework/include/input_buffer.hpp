@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+// Per-connection accumulating input buffer. Reads are appended after the
+// unconsumed bytes; consumed bytes are dropped by moving the read cursor and
+// the storage is compacted lazily, only when a read needs the room. Storage
+// grows geometrically up to a fixed limit and is allocated on first use.
+class InputBuffer {
+public:
+  static constexpr size_t DEFAULT_INITIAL_SIZE = 4096;
+  static constexpr size_t DEFAULT_LIMIT = 1 << 20;
+
+  struct Span {
+    char *data;
+    size_t size;
+  };
+
+  explicit InputBuffer(size_t limit = DEFAULT_LIMIT,
+                       size_t initial_size = DEFAULT_INITIAL_SIZE)
+      : limit_(std::max(limit, size_t{1})),
+        initial_size_(std::min(initial_size, limit_)) {}
+
+  std::string_view data() const noexcept {
+    return {storage_.get() + head_, tail_ - head_};
+  }
+
+  // The buffered bytes, writable (e.g. for unmasking WebSocket payloads in
+  // place).
+  char *mutable_data() noexcept { return storage_.get() + head_; }
+
+  size_t size() const noexcept { return tail_ - head_; }
+  bool empty() const noexcept { return head_ == tail_; }
+  size_t capacity() const noexcept { return capacity_; }
+  size_t limit() const noexcept { return limit_; }
+  bool full() const noexcept { return size() >= limit_; }
+
+  void set_limit(size_t limit) noexcept {
+    limit_ = std::max(limit, size_t{1});
+    initial_size_ = std::min(initial_size_, limit_);
+  }
+
+  void consume(size_t n) noexcept {
+    head_ += std::min(n, size());
+    if (head_ == tail_) {
+      head_ = tail_ = 0;
+    }
+  }
+
+  // Makes sure `total` readable bytes fit without reallocation (clamped to the
+  // limit), e.g. once a request's Content-Length is known.
+  void reserve(size_t total) {
+    total = std::min(total, limit_);
+    if (total > capacity_) {
+      grow(total);
+    } else if (head_ + total > capacity_) {
+      compact();
+    }
+  }
+
+  // Writable space after the buffered bytes, at least `want` bytes when the
+  // limit allows it. Returns an empty span once the buffer is at its limit.
+  Span prepare(size_t want = DEFAULT_INITIAL_SIZE) {
+    want = std::min(want, limit_ - std::min(limit_, size()));
+    if (want == 0) {
+      return {nullptr, 0};
+    }
+
+    if (capacity_ - tail_ < want) {
+      if (capacity_ - size() >= want) {
+        compact();
+      } else {
+        grow(size() + want);
+      }
+    }
+    return {storage_.get() + tail_, capacity_ - tail_};
+  }
+
+  void commit(size_t n) noexcept { tail_ = std::min(tail_ + n, capacity_); }
+
+  // Copies `bytes` after the buffered data; false if that would exceed the
+  // limit, in which case nothing is appended.
+  bool append(std::string_view bytes) {
+    if (bytes.size() > limit_ - std::min(limit_, size())) {
+      return false;
+    }
+    if (!bytes.empty()) {
+      const Span span = prepare(bytes.size());
+      std::memcpy(span.data, bytes.data(), bytes.size());
+      commit(bytes.size());
+    }
+    return true;
+  }
+
+  // Frees the storage of an empty buffer, e.g. for an idle connection.
+  void release() noexcept {
+    if (empty()) {
+      storage_.reset();
+      capacity_ = head_ = tail_ = 0;
+    }
+  }
+
+private:
+  std::unique_ptr<char[]> storage_;
+  size_t capacity_ = 0;
+  size_t head_ = 0;
+  size_t tail_ = 0;
+  size_t limit_;
+  size_t initial_size_;
+
+  void compact() noexcept {
+    if (head_ > 0) {
+      std::memmove(storage_.get(), storage_.get() + head_, size());
+      tail_ -= head_;
+      head_ = 0;
+    }
+  }
+
+  void grow(size_t needed) {
+    size_t new_capacity = std::max(capacity_, initial_size_);
+    while (new_capacity < needed) {
+      new_capacity *= 2;
+    }
+    new_capacity = std::min(new_capacity, limit_);
+
+    auto block = std::make_unique<char[]>(new_capacity);
+    if (!empty()) {
+      std::memcpy(block.get(), storage_.get() + head_, size());
+    }
+    tail_ = size();
+    head_ = 0;
+    storage_ = std::move(block);
+    capacity_ = new_capacity;
+  }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_request.hpp"
+
+namespace json_body {
+
+// SAX consumer that builds values only for the wanted top-level members of
+// an object; everything else is tokenized and dropped. Once every wanted
+// member has been seen it stops the parse, so the rest of the body is not
+// read (or validated) at all.
+class FieldSelector : public nlohmann::json_sax<nlohmann::json> {
+public:
+  FieldSelector(std::initializer_list<std::string_view> names,
+                nlohmann::json &out)
+      : names_(names), out_(out) {
+    out_ = nlohmann::json::object();
+  }
+
+  // The parse was cut short because every wanted member was found.
+  bool complete() const noexcept {
+    return names_.size() > 0 && remaining_ == 0;
+  }
+
+  bool null() override { return value(nullptr); }
+  bool boolean(bool v) override { return value(v); }
+  bool number_integer(number_integer_t v) override { return value(v); }
+  bool number_unsigned(number_unsigned_t v) override { return value(v); }
+  bool number_float(number_float_t v, const string_t &) override {
+    return value(v);
+  }
+  bool string(string_t &v) override { return value(std::move(v)); }
+  bool binary(binary_t &v) override {
+    return value(nlohmann::json::binary(std::move(v)));
+  }
+
+  bool start_object(std::size_t) override {
+    return open(nlohmann::json::value_t::object);
+  }
+  bool end_object() override { return close(); }
+  bool start_array(std::size_t) override {
+    return open(nlohmann::json::value_t::array);
+  }
+  bool end_array() override { return close(); }
+
+  bool key(string_t &name) override {
+    if (depth_ == 1) {
+      auto it = std::find(names_.begin(), names_.end(), name);
+      selected_ = it != names_.end() && !out_.contains(name);
+      top_key_ = std::move(name);
+    } else if (!stack_.empty()) {
+      member_ = std::move(name);
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &) override {
+    return false;
+  }
+
+private:
+  std::initializer_list<std::string_view> names_;
+  nlohmann::json &out_;
+  size_t remaining_ = names_.size();
+  int depth_ = 0;
+  bool selected_ = false;
+  std::string top_key_;
+  std::string member_;
+  std::vector<nlohmann::json *> stack_; // containers being captured
+
+  nlohmann::json &insert(nlohmann::json &&v) {
+    nlohmann::json &parent = *stack_.back();
+    if (parent.is_array()) {
+      parent.push_back(std::move(v));
+      return parent.back();
+    }
+    nlohmann::json &slot = parent[member_];
+    slot = std::move(v);
+    return slot;
+  }
+
+  // Records a finished top-level member; false stops the parse.
+  bool captured() {
+    selected_ = false;
+    return --remaining_ > 0;
+  }
+
+  bool value(nlohmann::json &&v) {
+    if (depth_ == 0) {
+      return false; // not an object
+    }
+    if (!stack_.empty()) {
+      insert(std::move(v));
+      return true;
+    }
+    if (depth_ == 1 && selected_) {
+      out_[top_key_] = std::move(v);
+      return captured();
+    }
+    return true;
+  }
+
+  bool open(nlohmann::json::value_t type) {
+    ++depth_;
+    if (depth_ == 1) {
+      return type == nlohmann::json::value_t::object;
+    }
+    if (!stack_.empty()) {
+      stack_.push_back(&insert(nlohmann::json(type)));
+    } else if (depth_ == 2 && selected_) {
+      nlohmann::json &slot = out_[top_key_];
+      slot = nlohmann::json(type);
+      stack_.push_back(&slot);
+    }
+    return true;
+  }
+
+  bool close() {
+    --depth_;
+    if (!stack_.empty()) {
+      stack_.pop_back();
+      if (stack_.empty()) {
+        return captured();
+      }
+    }
+    return true;
+  }
+};
+
+// Copies the top-level members `names` of the JSON object in `text` into
+// `out` (an object; absent members are left out). Values of other members
+// are never built. False if `text` is not a JSON object, as far as it was
+// read.
+inline bool select(std::string_view text,
+                   std::initializer_list<std::string_view> names,
+                   nlohmann::json &out) {
+  FieldSelector selector(names, out);
+  const bool parsed = nlohmann::json::sax_parse(text.begin(), text.end(),
+                                                &selector);
+  return parsed || selector.complete();
+}
+
+} // namespace json_body
+
+// Lazily parsed JSON request body. Handlers that read a few members use
+// select() or get(), which skip building the rest of the document; the full
+// document is parsed only if document() is called, and then only once.
+class JsonBody {
+public:
+  explicit JsonBody(std::string_view text) : text_(text) {}
+
+  explicit JsonBody(const HttpRequest &req) : text_(req.body_view) {}
+
+  bool select(std::initializer_list<std::string_view> names,
+              nlohmann::json &out) const {
+    return json_body::select(text_, names, out);
+  }
+
+  // One top-level member, or null when it is absent or the body is invalid.
+  nlohmann::json get(std::string_view name) const {
+    nlohmann::json fields;
+    if (!select({name}, fields) || !fields.contains(name)) {
+      return nullptr;
+    }
+    return std::move(fields[std::string(name)]);
+  }
+
+  // The whole body; discarded (see is_discarded()) when it is not JSON.
+  const nlohmann::json &document() const {
+    if (!document_) {
+      document_ = nlohmann::json::parse(text_.begin(), text_.end(), nullptr,
+                                        false);
+    }
+    return *document_;
+  }
+
+private:
+  std::string_view text_;
+  mutable std::optional<nlohmann::json> document_;
+};
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+
+// A counter with a single writer. The relaxed load and store compile to a
+// plain add (no lock prefix, no contention), while readers on other threads
+// still see a well-defined, if slightly stale, value.
+class Counter {
+public:
+  void add(uint64_t n = 1) noexcept {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  uint64_t get() const noexcept {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear (HDR-style) latency histogram in nanoseconds: exact below 32,
+// then 16 sub-buckets per power of two, i.e. within ~6% of the recorded
+// value up to ~18 minutes. Written by one thread; see Counter.
+class LatencyHistogram {
+public:
+  static constexpr unsigned LINEAR = 32;
+  static constexpr unsigned SUB_BUCKETS = 16;
+  static constexpr unsigned MAX_EXPONENT = 40;
+  static constexpr size_t BUCKET_COUNT =
+      LINEAR + (MAX_EXPONENT - 5 + 1) * SUB_BUCKETS;
+
+  void record(uint64_t ns) noexcept {
+    buckets_[bucket_of(ns)].add();
+    sum_.add(ns);
+    count_.add();
+  }
+
+  static size_t bucket_of(uint64_t value) noexcept {
+    if (value < LINEAR) {
+      return static_cast<size_t>(value);
+    }
+    const unsigned exponent =
+        63u - static_cast<unsigned>(__builtin_clzll(value));
+    if (exponent > MAX_EXPONENT) {
+      return BUCKET_COUNT - 1;
+    }
+    const uint64_t mantissa = value >> (exponent - 4); // 16..31
+    return LINEAR + (exponent - 5) * SUB_BUCKETS +
+           static_cast<size_t>(mantissa - SUB_BUCKETS);
+  }
+
+  // Largest value that lands in `bucket`.
+  static uint64_t highest(size_t bucket) noexcept {
+    if (bucket < LINEAR) {
+      return bucket;
+    }
+    const size_t k = bucket - LINEAR;
+    const unsigned exponent = 5 + static_cast<unsigned>(k / SUB_BUCKETS);
+    const uint64_t mantissa = SUB_BUCKETS + k % SUB_BUCKETS;
+    return ((mantissa + 1) << (exponent - 4)) - 1;
+  }
+
+  struct Snapshot {
+    std::array<uint64_t, BUCKET_COUNT> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // Upper bound of the bucket holding the q-quantile, in nanoseconds.
+    uint64_t quantile(double q) const noexcept {
+      if (count == 0) {
+        return 0;
+      }
+      const uint64_t rank = std::max<uint64_t>(
+          static_cast<uint64_t>(std::ceil(q * static_cast<double>(count))),
+          1);
+      uint64_t seen = 0;
+      for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+          return highest(i);
+        }
+      }
+      return highest(BUCKET_COUNT - 1);
+    }
+
+    // Recorded values up to `bound` ns (buckets straddling it excluded).
+    uint64_t count_below(uint64_t bound) const noexcept {
+      uint64_t total = 0;
+      for (size_t i = 0; i < BUCKET_COUNT && highest(i) <= bound; ++i) {
+        total += buckets[i];
+      }
+      return total;
+    }
+  };
+
+  void merge_into(Snapshot &snapshot) const noexcept {
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+      snapshot.buckets[i] += buckets_[i].get();
+    }
+    snapshot.count += count_.get();
+    snapshot.sum += sum_.get();
+  }
+
+private:
+  Counter buckets_[BUCKET_COUNT];
+  Counter sum_;
+  Counter count_;
+};
+
+// One thread's counters and per-route histograms. Aligned so that no two
+// workers ever write to the same cache line.
+struct alignas(64) WorkerMetrics {
+  static constexpr size_t MAX_ROUTES = 1024;
+
+  Counter accepts;
+  Counter closes; // active connections = accepts - closes
+  Counter bytes_in;
+  Counter bytes_out;
+  Counter parse_failures;
+  Counter responses[5]; // by status class, 1xx .. 5xx
+
+  void count_status(int status) noexcept {
+    if (status >= 100 && status < 600) {
+      responses[status / 100 - 1].add();
+    }
+  }
+
+  void record_route(uint32_t route, uint64_t ns) {
+    if (route >= MAX_ROUTES) {
+      return;
+    }
+    LatencyHistogram *histogram =
+        routes[route].load(std::memory_order_relaxed);
+    if (!histogram) {
+      histogram = new LatencyHistogram();
+      routes[route].store(histogram, std::memory_order_release);
+    }
+    histogram->record(ns);
+  }
+
+  // Allocated by the owning thread on first use, read by the exporter.
+  std::atomic<LatencyHistogram *> routes[MAX_ROUTES] = {};
+
+  WorkerMetrics() = default;
+  WorkerMetrics(const WorkerMetrics &) = delete;
+  WorkerMetrics &operator=(const WorkerMetrics &) = delete;
+
+  ~WorkerMetrics() {
+    for (auto &route : routes) {
+      delete route.load(std::memory_order_relaxed);
+    }
+  }
+};
+
+// Process-wide registry. Every thread that records gets its own
+// WorkerMetrics (created on first use); render() merges them on demand, so
+// the request path never shares a line with another worker.
+class Metrics {
+public:
+  static Metrics &global() {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  WorkerMetrics &local() {
+    thread_local WorkerMetrics *slot = nullptr;
+    if (!slot) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      workers_.push_back(std::make_unique<WorkerMetrics>());
+      slot = workers_.back().get();
+    }
+    return *slot;
+  }
+
+  // Called by Router for every route; returns the route's histogram index.
+  uint32_t register_route(HttpMethod method, std::string_view pattern) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (routes_.size() >= WorkerMetrics::MAX_ROUTES) {
+      return UINT32_MAX;
+    }
+    std::string name(method_name(method));
+    name += ' ';
+    name.append(pattern);
+    routes_.push_back(std::move(name));
+    return static_cast<uint32_t>(routes_.size() - 1);
+  }
+
+  // Prometheus text exposition (version 0.0.4) of all workers combined.
+  std::string render() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    out.reserve(4096);
+
+    auto total = [this](const Counter WorkerMetrics::*field) {
+      uint64_t sum = 0;
+      for (const auto &worker : workers_) {
+        sum += ((*worker).*field).get();
+      }
+      return sum;
+    };
+
+    const uint64_t accepts = total(&WorkerMetrics::accepts);
+    const uint64_t closes = total(&WorkerMetrics::closes);
+    metric(out, "wscpp_connections_accepted_total", "counter",
+           "Connections accepted.", accepts);
+    metric(out, "wscpp_connections_active", "gauge",
+           "Connections currently open.",
+           accepts >= closes ? accepts - closes : 0);
+    metric(out, "wscpp_received_bytes_total", "counter",
+           "Bytes read from clients.", total(&WorkerMetrics::bytes_in));
+    metric(out, "wscpp_sent_bytes_total", "counter",
+           "Bytes written to clients.", total(&WorkerMetrics::bytes_out));
+    metric(out, "wscpp_parse_failures_total", "counter",
+           "Requests rejected as malformed or oversized.",
+           total(&WorkerMetrics::parse_failures));
+
+    out += "# HELP wscpp_responses_total Responses by status class.\n"
+           "# TYPE wscpp_responses_total counter\n";
+    for (int i = 0; i < 5; ++i) {
+      uint64_t sum = 0;
+      for (const auto &worker : workers_) {
+        sum += worker->responses[i].get();
+      }
+      out += "wscpp_responses_total{class=\"";
+      out += static_cast<char>('1' + i);
+      out += "xx\"} ";
+      append_number(out, sum);
+      out += '\n';
+    }
+
+    render_routes(out);
+    return out;
+  }
+
+  // Route handler for GET /metrics.
+  static HttpResponse handle(const HttpRequest &req) {
+    HttpResponse res;
+    res.set_body(global().render(), "text/plain; version=0.0.4");
+    res.keep_alive = req.wants_keep_alive();
+    return res;
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<WorkerMetrics>> workers_;
+  std::vector<std::string> routes_;
+
+  void render_routes(std::string &out) const {
+    static constexpr double kBounds[] = {0.0001, 0.00025, 0.0005, 0.001,
+                                         0.0025, 0.005,   0.01,   0.025,
+                                         0.05,   0.1,     0.25,   0.5,
+                                         1,      2.5,     5,      10};
+    static constexpr std::pair<double, std::string_view> kQuantiles[] = {
+        {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}};
+
+    out += "# HELP wscpp_route_duration_seconds Handler latency by route.\n"
+           "# TYPE wscpp_route_duration_seconds histogram\n";
+    std::vector<LatencyHistogram::Snapshot> snapshots(routes_.size());
+    for (size_t r = 0; r < routes_.size(); ++r) {
+      for (const auto &worker : workers_) {
+        if (const LatencyHistogram *histogram =
+                worker->routes[r].load(std::memory_order_acquire)) {
+          histogram->merge_into(snapshots[r]);
+        }
+      }
+      const auto &snapshot = snapshots[r];
+      if (snapshot.count == 0) {
+        continue;
+      }
+      for (double bound : kBounds) {
+        char le[16];
+        const int n = std::snprintf(le, sizeof(le), "%g", bound);
+        series(out, "wscpp_route_duration_seconds_bucket", routes_[r], "le",
+               std::string_view(le, static_cast<size_t>(std::max(n, 0))));
+        append_number(
+            out, snapshot.count_below(static_cast<uint64_t>(bound * 1e9)));
+        out += '\n';
+      }
+      series(out, "wscpp_route_duration_seconds_bucket", routes_[r], "le",
+             "+Inf");
+      append_number(out, snapshot.count);
+      out += '\n';
+      series(out, "wscpp_route_duration_seconds_sum", routes_[r]);
+      append_seconds(out, snapshot.sum);
+      out += '\n';
+      series(out, "wscpp_route_duration_seconds_count", routes_[r]);
+      append_number(out, snapshot.count);
+      out += '\n';
+    }
+
+    out += "# HELP wscpp_route_duration_quantile_seconds Handler latency "
+           "quantiles by route.\n"
+           "# TYPE wscpp_route_duration_quantile_seconds gauge\n";
+    for (size_t r = 0; r < routes_.size(); ++r) {
+      if (snapshots[r].count == 0) {
+        continue;
+      }
+      for (const auto &[q, label] : kQuantiles) {
+        series(out, "wscpp_route_duration_quantile_seconds", routes_[r],
+               "quantile", label);
+        append_seconds(out, snapshots[r].quantile(q));
+        out += '\n';
+      }
+    }
+  }
+
+  static void metric(std::string &out, std::string_view name,
+                     std::string_view type, std::string_view help,
+                     uint64_t value) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+    out += name;
+    out += ' ';
+    append_number(out, value);
+    out += '\n';
+  }
+
+  // `name{route="..."[,label="value"]} `
+  static void series(std::string &out, std::string_view name,
+                     std::string_view route, std::string_view label = {},
+                     std::string_view value = {}) {
+    out += name;
+    out += "{route=\"";
+    for (char c : route) {
+      if (c == '\\' || c == '"') {
+        out += '\\';
+      } else if (c == '\n') {
+        out += "\\n";
+        continue;
+      }
+      out += c;
+    }
+    out += '"';
+    if (!label.empty()) {
+      out += ',';
+      out += label;
+      out += "=\"";
+      out += value;
+      out += '"';
+    }
+    out += "} ";
+  }
+
+  static void append_number(std::string &out, uint64_t value) {
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    (void)ec;
+    out.append(digits, end);
+  }
+
+  static void append_seconds(std::string &out, uint64_t ns) {
+    char text[32];
+    const int n = std::snprintf(text, sizeof(text), "%.9f",
+                                static_cast<double>(ns) / 1e9);
+    out.append(text, static_cast<size_t>(std::max(n, 0)));
+  }
+};
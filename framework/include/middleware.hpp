@@ -3,12 +3,49 @@
 #include "http_request.hpp"
 #include "http_response.hpp"
 #include <functional>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-using Next = std::function<HttpResponse()>;
+// Non-owning reference to a callable, two pointers wide. Unlike std::function
+// it never allocates, so it is cheap to build per request; the referenced
+// callable must outlive it.
+template <typename Signature> class FunctionRef;
+
+template <typename R, typename... Args> class FunctionRef<R(Args...)> {
+public:
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, FunctionRef> &&
+                std::is_invocable_r_v<R, F &, Args...>>>
+  FunctionRef(F &&callable) noexcept
+      : object_(const_cast<void *>(
+            static_cast<const void *>(std::addressof(callable)))),
+        invoke_([](void *object, Args... args) -> R {
+          return (*static_cast<std::remove_reference_t<F> *>(object))(
+              std::forward<Args>(args)...);
+        }) {}
+
+  R operator()(Args... args) const {
+    return invoke_(object_, std::forward<Args>(args)...);
+  }
+
+private:
+  void *object_;
+  R (*invoke_)(void *, Args...);
+};
+
+using Next = FunctionRef<HttpResponse()>;
 
 using Middleware = std::function<HttpResponse(HttpRequest &, Next)>;
 
+using ChainHandler = FunctionRef<HttpResponse(HttpRequest &)>;
+
+// Runtime-composed middleware list. Each stage receives a Next that refers to
+// a stack-allocated continuation, so running the chain costs one indirect
+// call per stage and no allocation.
 class MiddlewareChain {
 public:
   MiddlewareChain &use(Middleware mw) {
@@ -16,26 +53,67 @@ public:
     return *this;
   }
 
-  HttpResponse
-  execute(HttpRequest &req,
-          std::function<HttpResponse(HttpRequest &)> handler) const {
+  bool empty() const noexcept { return middlewares_.empty(); }
+
+  HttpResponse execute(HttpRequest &req, ChainHandler handler) const {
     return dispatch(req, 0, handler);
   }
 
 private:
   std::vector<Middleware> middlewares_;
 
-  HttpResponse
-  dispatch(HttpRequest &req, size_t index,
-           const std::function<HttpResponse(HttpRequest &)> &handler) const {
+  HttpResponse dispatch(HttpRequest &req, size_t index,
+                        ChainHandler handler) const {
     if (index >= middlewares_.size()) {
       return handler(req);
     }
 
-    Next next = [this, &req, index, &handler]() {
+    auto next = [this, &req, index, handler]() {
       return dispatch(req, index + 1, handler);
     };
+    return middlewares_[index](req, next);
+  }
+};
 
-    return middlewares_[index](req, std::move(next));
+// Compile-time middleware pipeline. Stages are plain objects with a
+//
+//   template <typename NextFn>
+//   HttpResponse operator()(HttpRequest &, NextFn &&next) const;
+//
+// call operator; the composition is resolved by the compiler, so a pipeline
+// of such stages inlines into a single call. A Pipeline is itself a stage and
+// converts to a Middleware, so it can be nested or added to a chain.
+template <typename... Stages> class Pipeline {
+public:
+  explicit Pipeline(Stages... stages) : stages_(std::move(stages)...) {}
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &req, NextFn &&next) const {
+    return call<0>(req, next);
+  }
+
+  // Binds the pipeline in front of a route handler.
+  template <typename H> auto wrap(H handler) const {
+    return [pipeline = *this, handler = std::move(handler)](HttpRequest &req) {
+      return pipeline(req, [&]() { return handler(req); });
+    };
+  }
+
+private:
+  std::tuple<Stages...> stages_;
+
+  template <size_t I, typename NextFn>
+  HttpResponse call(HttpRequest &req, NextFn &next) const {
+    if constexpr (I == sizeof...(Stages)) {
+      return next();
+    } else {
+      return std::get<I>(stages_)(
+          req, [&]() { return call<I + 1>(req, next); });
+    }
   }
 };
+
+template <typename... Stages>
+Pipeline<Stages...> make_pipeline(Stages... stages) {
+  return Pipeline<Stages...>(std::move(stages)...);
+}
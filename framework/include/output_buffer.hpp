@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+// A byte range of an open file, sent with splice(2) instead of being copied
+// through user space. `owner` keeps `fd` open until the range has been sent.
+// A negative offset marks a pipe or socket, read from where it stands.
+struct FileRange {
+  std::shared_ptr<const void> owner;
+  int fd = -1;
+  off_t offset = 0;
+  size_t length = 0;
+};
+
+// Per-connection output staging area for one batch of responses. Status
+// lines, headers and small bodies are formatted into one contiguous buffer;
+// large bodies are moved in whole (or referenced, when shared) and sent as
+// their own iovec, file bodies are queued as ranges. clear() keeps every
+// allocation (short of a contiguous buffer inflated by a streamed body), so
+// a connection serializes without touching the heap once its buffers have
+// warmed up.
+//
+// A send cursor tracks how much has been written, so the socket can send the
+// memory segments up to the next file range with one sendmsg, splice the
+// file range, and resume after partial writes.
+class OutputBuffer {
+public:
+  // Bytes held apart from the contiguous storage, with what keeps them alive.
+  struct SharedBytes {
+    std::shared_ptr<const void> owner;
+    std::string_view bytes;
+  };
+
+  // Contiguous storage kept across clear(); writer bodies serialized in
+  // place can grow it well past what headers need.
+  static constexpr size_t RETAINED_STORAGE = 64 * 1024;
+
+  void append(std::string_view bytes) { storage_.append(bytes); }
+
+  void append(char c) { storage_.push_back(c); }
+
+  // Takes ownership of `body` and schedules it as a separate iovec after
+  // everything appended so far.
+  void append_body(std::string &&body) {
+    seal();
+    bodies_.push_back(std::move(body));
+    segments_.push_back(
+        {bodies_.size() - 1, bodies_.back().size(), Kind::Body});
+  }
+
+  // Schedules `bytes` as a separate iovec without copying them; `owner` keeps
+  // them alive until the buffer is cleared.
+  void append_shared(std::shared_ptr<const void> owner,
+                     std::string_view bytes) {
+    seal();
+    if (bytes.empty()) {
+      return;
+    }
+    shared_.push_back({std::move(owner), bytes});
+    segments_.push_back({shared_.size() - 1, bytes.size(), Kind::Shared});
+  }
+
+  // Schedules a file range after everything appended so far.
+  void append_file(FileRange range) {
+    seal();
+    if (range.length == 0) {
+      return;
+    }
+    files_.push_back(std::move(range));
+    segments_.push_back({files_.size() - 1, files_.back().length, Kind::File});
+  }
+
+  // Contiguous storage for in-place formatting (e.g. backpatching).
+  std::string &storage() noexcept { return storage_; }
+
+  bool empty() const noexcept {
+    return storage_.size() == sealed_ && segments_.empty();
+  }
+
+  size_t size() const noexcept {
+    size_t total = storage_.size();
+    for (const auto &segment : segments_) {
+      if (segment.kind != Kind::Storage) {
+        total += segment.length;
+      }
+    }
+    return total;
+  }
+
+  // Everything has been sent (or nothing was queued).
+  bool done() {
+    seal();
+    return cursor_segment_ >= segments_.size();
+  }
+
+  // The unsent file range at the cursor, or null when the next bytes come
+  // from memory.
+  const FileRange *pending_file() {
+    seal();
+    if (cursor_segment_ >= segments_.size() ||
+        segments_[cursor_segment_].kind != Kind::File) {
+      return nullptr;
+    }
+    const Segment &segment = segments_[cursor_segment_];
+    cursor_file_ = files_[segment.offset];
+    if (cursor_file_.offset >= 0) {
+      cursor_file_.offset += static_cast<off_t>(cursor_offset_);
+    }
+    cursor_file_.length -= cursor_offset_;
+    return &cursor_file_;
+  }
+
+  // The unsent rest of the segment at the cursor if it is a body of at
+  // least `min_bytes` kept apart from the contiguous storage, or null. Its
+  // owner keeps the bytes alive past clear(); a moved-in body is made shared
+  // for that. Valid until the next append, advance or clear.
+  const SharedBytes *pending_shared(size_t min_bytes) {
+    seal();
+    if (cursor_segment_ >= segments_.size()) {
+      return nullptr;
+    }
+    Segment &segment = segments_[cursor_segment_];
+    if (segment.kind == Kind::Storage || segment.kind == Kind::File ||
+        segment.length < min_bytes) {
+      return nullptr;
+    }
+    if (segment.kind == Kind::Body) {
+      auto body = std::make_shared<const std::string>(
+          std::move(bodies_[segment.offset]));
+      shared_.push_back({body, *body});
+      segment.offset = shared_.size() - 1;
+      segment.kind = Kind::Shared;
+    }
+    cursor_shared_ = shared_[segment.offset];
+    cursor_shared_.bytes.remove_prefix(cursor_offset_);
+    return &cursor_shared_;
+  }
+
+  // iovecs for the unsent memory segments from the cursor up to the next
+  // file range, or up to the next body of `split_at` bytes or more (to be
+  // sent on its own); valid until the next append, advance or clear.
+  const std::vector<iovec> &pending_iovecs(size_t split_at = SIZE_MAX) {
+    seal();
+    iov_.clear();
+    for (size_t i = cursor_segment_;
+         i < segments_.size() && iov_.size() < IOV_MAX; ++i) {
+      const Segment &segment = segments_[i];
+      if (segment.kind == Kind::File ||
+          (i != cursor_segment_ && segment.kind != Kind::Storage &&
+           segment.length >= split_at)) {
+        break;
+      }
+      const size_t skip = i == cursor_segment_ ? cursor_offset_ : 0;
+      iov_.push_back({segment_data(segment) + skip, segment.length - skip});
+    }
+    return iov_;
+  }
+
+  // Moves the send cursor past `bytes` written bytes.
+  void advance(size_t bytes) noexcept {
+    while (bytes > 0 && cursor_segment_ < segments_.size()) {
+      const size_t left = segments_[cursor_segment_].length - cursor_offset_;
+      const size_t step = std::min(left, bytes);
+      cursor_offset_ += step;
+      bytes -= step;
+      if (cursor_offset_ == segments_[cursor_segment_].length) {
+        ++cursor_segment_;
+        cursor_offset_ = 0;
+      }
+    }
+  }
+
+  void clear() noexcept {
+    if (storage_.capacity() > RETAINED_STORAGE) {
+      std::string().swap(storage_);
+    }
+    storage_.clear();
+    bodies_.clear();
+    shared_.clear();
+    files_.clear();
+    segments_.clear();
+    iov_.clear();
+    cursor_file_ = {};
+    cursor_shared_ = {};
+    sealed_ = 0;
+    cursor_segment_ = 0;
+    cursor_offset_ = 0;
+  }
+
+private:
+  enum class Kind : unsigned char { Storage, Body, Shared, File };
+
+  struct Segment {
+    size_t offset; // into storage_, or index into bodies_ / shared_ / files_
+    size_t length;
+    Kind kind;
+  };
+
+  std::string storage_;
+  std::vector<std::string> bodies_;
+  std::vector<SharedBytes> shared_;
+  std::vector<FileRange> files_;
+  std::vector<Segment> segments_;
+  std::vector<iovec> iov_;
+  FileRange cursor_file_;
+  SharedBytes cursor_shared_;
+  size_t sealed_ = 0; // storage_ bytes already covered by a segment
+  size_t cursor_segment_ = 0;
+  size_t cursor_offset_ = 0;
+
+  char *segment_data(const Segment &segment) {
+    switch (segment.kind) {
+    case Kind::Body:
+      return bodies_[segment.offset].data();
+    case Kind::Shared:
+      // sendmsg never writes through iov_base.
+      return const_cast<char *>(shared_[segment.offset].bytes.data());
+    default:
+      return storage_.data() + segment.offset;
+    }
+  }
+
+  void seal() {
+    if (storage_.size() > sealed_) {
+      segments_.push_back({sealed_, storage_.size() - sealed_, Kind::Storage});
+      sealed_ = storage_.size();
+    }
+  }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+// Remote address of a connection, looked up with getpeername() the first
+// time a request asks for it and cached for the rest of the connection.
+// Unknown for connections accepted as direct descriptors, which have no
+// regular fd to query.
+class PeerAddress {
+public:
+  void reset(int fd) noexcept {
+    fd_ = fd;
+    resolved_ = false;
+    length_ = 0;
+  }
+
+  // The IP address in network byte order (4 or 16 bytes, no port); empty if
+  // it cannot be determined.
+  std::string_view ip() const noexcept {
+    resolve();
+    if (address_.ss_family == AF_INET && length_ > 0) {
+      const auto *in = reinterpret_cast<const sockaddr_in *>(&address_);
+      return {reinterpret_cast<const char *>(&in->sin_addr),
+              sizeof(in->sin_addr)};
+    }
+    if (address_.ss_family == AF_INET6 && length_ > 0) {
+      const auto *in6 = reinterpret_cast<const sockaddr_in6 *>(&address_);
+      return {reinterpret_cast<const char *>(&in6->sin6_addr),
+              sizeof(in6->sin6_addr)};
+    }
+    return {};
+  }
+
+  std::string to_string() const {
+    const std::string_view bytes = ip();
+    if (bytes.empty()) {
+      return {};
+    }
+    char text[INET6_ADDRSTRLEN] = {};
+    inet_ntop(bytes.size() == 4 ? AF_INET : AF_INET6, bytes.data(), text,
+              sizeof(text));
+    return text;
+  }
+
+private:
+  int fd_ = -1;
+  mutable bool resolved_ = false;
+  mutable socklen_t length_ = 0;
+  mutable sockaddr_storage address_{};
+
+  void resolve() const noexcept {
+    if (resolved_) {
+      return;
+    }
+    resolved_ = true;
+    length_ = sizeof(address_);
+    if (fd_ < 0 ||
+        getpeername(fd_, reinterpret_cast<sockaddr *>(&address_), &length_) !=
+            0) {
+      length_ = 0;
+      address_.ss_family = AF_UNSPEC;
+    }
+  }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+// GCRA (generic cell rate algorithm) limiter: each key holds a single
+// "theoretical arrival time", so the state per key is 16 bytes regardless of
+// the limit. Keys live in fixed-size open-addressed tables split into
+// cache-line aligned shards, each guarded by a spinlock held for a few
+// instructions; workers only contend when they hit the same shard at the
+// same time.
+//
+// An entry whose arrival time has passed carries no information (its bucket
+// is full again), so it is simply overwritten by the next key that probes
+// it. When every slot in a probe window is still active, the one closest to
+// expiring is evicted. Memory is therefore fixed at construction however
+// many distinct keys are seen.
+//
+// Keys are stored as 64-bit hashes; two keys with the same hash share one
+// budget.
+class RateLimiter {
+public:
+  static constexpr size_t SHARD_COUNT = 64;
+  static constexpr size_t PROBE_LIMIT = 8;
+  static constexpr size_t DEFAULT_MAX_KEYS = 1 << 16;
+
+  struct Decision {
+    bool allowed;
+    std::chrono::nanoseconds retry_after; // zero when allowed
+  };
+
+  // Allows bursts of `burst` requests and a sustained rate of `burst` per
+  // `period`.
+  RateLimiter(uint32_t burst, std::chrono::nanoseconds period,
+              size_t max_keys = DEFAULT_MAX_KEYS)
+      : interval_(std::max<int64_t>(period.count() / std::max(burst, 1u), 1)),
+        tolerance_(interval_ *
+                   (static_cast<int64_t>(std::max(burst, 1u)) - 1)) {
+    size_t per_shard = PROBE_LIMIT;
+    while (per_shard * SHARD_COUNT < max_keys) {
+      per_shard *= 2;
+    }
+    slot_mask_ = per_shard - 1;
+    shards_ = std::make_unique<Shard[]>(SHARD_COUNT);
+    for (size_t i = 0; i < SHARD_COUNT; ++i) {
+      shards_[i].entries = std::make_unique<Entry[]>(per_shard);
+    }
+  }
+
+  Decision acquire(std::string_view key) {
+    return acquire(key, std::chrono::steady_clock::now());
+  }
+
+  Decision acquire(std::string_view key,
+                   std::chrono::steady_clock::time_point now) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    hash = hash ? hash : 1; // 0 marks an empty slot
+    const int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now.time_since_epoch())
+                          .count();
+
+    Shard &shard = shards_[(hash >> 58) % SHARD_COUNT];
+    SpinGuard guard(shard.lock);
+
+    Entry *victim = nullptr;
+    Entry *found = nullptr;
+    for (size_t i = 0; i < PROBE_LIMIT; ++i) {
+      Entry &entry = shard.entries[(hash + i) & slot_mask_];
+      if (entry.key == hash) {
+        found = &entry;
+        break;
+      }
+      if (!victim || entry.tat < victim->tat) {
+        victim = &entry;
+      }
+    }
+
+    // New keys (and reclaimed idle ones) start with a full bucket.
+    const int64_t tat = found ? std::max(found->tat, t) : t;
+    if (tat - t > tolerance_) {
+      return {false, std::chrono::nanoseconds(tat - tolerance_ - t)};
+    }
+
+    Entry &entry = found ? *found : *victim;
+    entry.key = hash;
+    entry.tat = tat + interval_;
+    return {true, std::chrono::nanoseconds(0)};
+  }
+
+private:
+  struct Entry {
+    uint64_t key = 0;
+    int64_t tat = 0; // nanoseconds; <= now means the bucket is full
+  };
+
+  struct alignas(64) Shard {
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    std::unique_ptr<Entry[]> entries;
+  };
+
+  struct SpinGuard {
+    std::atomic_flag &flag;
+
+    explicit SpinGuard(std::atomic_flag &f) : flag(f) {
+      while (flag.test_and_set(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+    ~SpinGuard() { flag.clear(std::memory_order_release); }
+  };
+
+  int64_t interval_;  // emission interval: one request's worth of time
+  int64_t tolerance_; // how far ahead of now the arrival time may run
+  size_t slot_mask_;
+  std::unique_ptr<Shard[]> shards_;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+
+// Per-worker bump allocator for storage that only lives while a batch of
+// requests is being served. Allocating is a pointer bump inside one reused
+// block and nothing is freed individually; reset() rewinds the block in one
+// step. A batch that outgrows the block spills onto the heap, and the next
+// reset() enlarges the block to the high-water mark, so steady state does
+// not touch the heap at all.
+//
+// The socket installs its arena for the duration of a batch (see Scope);
+// framework containers created meanwhile, such as a response's HeaderMap,
+// take their storage from current(). Copies of those containers fall back to
+// the heap, so only an object moved out of the batch can outlive its memory.
+class RequestArena {
+public:
+  static constexpr size_t DEFAULT_BLOCK = 16 * 1024;
+  static constexpr size_t MAX_BLOCK = 1 << 20;
+
+  explicit RequestArena(size_t block = DEFAULT_BLOCK) { rebuild(block); }
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  std::pmr::memory_resource *resource() noexcept { return &*resource_; }
+
+  // Frees everything allocated since the last reset.
+  void reset() {
+    if (spill_.bytes == 0) {
+      resource_->release();
+      return;
+    }
+    const size_t wanted = std::min(block_size_ + spill_.bytes, MAX_BLOCK);
+    spill_.bytes = 0;
+    resource_.reset();
+    rebuild(wanted);
+  }
+
+  size_t block_size() const noexcept { return block_size_; }
+
+  // Resource for allocations that belong to the batch being served on this
+  // thread, or the heap outside of one.
+  static std::pmr::memory_resource *current() noexcept {
+    return active_ ? active_ : std::pmr::new_delete_resource();
+  }
+
+  // Makes `arena` current on this thread until the scope ends, then resets
+  // it (unless an outer scope still uses it). Nothing allocated from it may
+  // be used after that.
+  class Scope {
+  public:
+    explicit Scope(RequestArena &arena)
+        : arena_(arena), previous_(active_) {
+      active_ = arena.resource();
+    }
+
+    ~Scope() {
+      active_ = previous_;
+      if (previous_ != arena_.resource()) {
+        arena_.reset();
+      }
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    RequestArena &arena_;
+    std::pmr::memory_resource *previous_;
+  };
+
+  // Sends allocations on this thread to the heap until the scope ends, for
+  // objects created during a batch that outlive it (a suspended coroutine
+  // handler's frame, say).
+  class Bypass {
+  public:
+    Bypass() : previous_(active_) { active_ = nullptr; }
+    ~Bypass() { active_ = previous_; }
+
+    Bypass(const Bypass &) = delete;
+    Bypass &operator=(const Bypass &) = delete;
+
+  private:
+    std::pmr::memory_resource *previous_;
+  };
+
+private:
+  // Heap upstream that remembers how much a batch spilled.
+  struct Spill : std::pmr::memory_resource {
+    size_t bytes = 0;
+
+    void *do_allocate(size_t size, size_t alignment) override {
+      bytes += size;
+      return std::pmr::new_delete_resource()->allocate(size, alignment);
+    }
+
+    void do_deallocate(void *p, size_t size, size_t alignment) override {
+      std::pmr::new_delete_resource()->deallocate(p, size, alignment);
+    }
+
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+      return this == &other;
+    }
+  };
+
+  static inline thread_local std::pmr::memory_resource *active_ = nullptr;
+
+  size_t block_size_ = 0;
+  std::unique_ptr<std::byte[]> block_;
+  Spill spill_;
+  std::optional<std::pmr::monotonic_buffer_resource> resource_;
+
+  void rebuild(size_t size) {
+    block_size_ = size;
+    block_ = std::make_unique<std::byte[]>(size);
+    resource_.emplace(block_.get(), size, &spill_);
+  }
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+
+struct ResponseCacheOptions {
+  std::chrono::milliseconds ttl{1000};
+  size_t max_bytes = 64 << 20; // serialized bytes kept across all entries
+  // Request headers whose values are part of the key (e.g. Accept-Encoding
+  // when a compressing middleware runs inside the cache). Requests carrying
+  // a Cookie bypass the cache unless Cookie is listed here.
+  std::vector<std::string> vary;
+};
+
+// Caches serialized GET responses keyed by path, query and the `vary`
+// headers. A hit returns a response that only points at the stored bytes,
+// so neither the handler nor header serialization runs; the status line,
+// Connection and Date are still written per request.
+//
+// Concurrent misses on a key are coalesced without blocking a worker: an
+// expired entry stays in place while the first request to find it runs the
+// handler to refresh it, and requests arriving meanwhile are served the
+// expired copy. Only a key with no entry at all, on its first fill, has
+// concurrent misses run the handler themselves; they do not store the
+// result.
+//
+// Entries expire after `ttl` and are evicted least-recently-used once a
+// shard exceeds its share of `max_bytes`. Only responses that are cacheable
+// by default (RFC 9110 15.1) and carry neither Set-Cookie nor a
+// Cache-Control of no-store, no-cache or private are stored, and not those
+// of coroutine routes (see AsyncCall). Requests with Authorization are
+// never cached (RFC 9111 3.5), nor ones with a Cookie unless it is a `vary`
+// header. A Vary field in the response is not honoured: list the headers it
+// names in `vary`.
+class ResponseCache {
+public:
+  static constexpr size_t SHARD_COUNT = 16;
+
+  explicit ResponseCache(ResponseCacheOptions options = {})
+      : store_(std::make_shared<Store>(std::move(options))) {}
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &req, NextFn &&next) const {
+    Store &store = *store_;
+    if (req.method_id != HttpMethod::GET || req.has_header("Authorization") ||
+        (!store.varies_on_cookie && req.has_header("Cookie"))) {
+      return next();
+    }
+
+    thread_local std::string key;
+    build_key(req, key);
+    Shard &shard = store.shards[std::hash<std::string>{}(key) % SHARD_COUNT];
+    const auto now = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && it->second.expires > now) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second.position);
+      Prepared response = it->second.response;
+      lock.unlock();
+      store.hits.fetch_add(1, std::memory_order_relaxed);
+      return hit(req, std::move(response));
+    }
+
+    const bool fills = shard.filling.insert(key).second;
+    if (!fills && it != shard.entries.end()) {
+      // Expired, and another request is refreshing it: serve it meanwhile.
+      Prepared response = it->second.response;
+      lock.unlock();
+      store.hits.fetch_add(1, std::memory_order_relaxed);
+      return hit(req, std::move(response));
+    }
+    store.misses.fetch_add(1, std::memory_order_relaxed);
+    if (!fills) {
+      lock.unlock();
+      return next(); // another request is filling this entry
+    }
+    const std::string owned_key = key;
+    lock.unlock();
+
+    HttpResponse res;
+    try {
+      res = next();
+    } catch (...) {
+      store.publish(shard, owned_key, nullptr);
+      throw;
+    }
+
+    Prepared response = res.prepared;
+    if (!response && cacheable(res)) {
+      response = res.prepare();
+    }
+    store.publish(shard, owned_key, std::move(response));
+    return res;
+  }
+
+  uint64_t hits() const noexcept {
+    return store_->hits.load(std::memory_order_relaxed);
+  }
+
+  uint64_t misses() const noexcept {
+    return store_->misses.load(std::memory_order_relaxed);
+  }
+
+private:
+  using Prepared = std::shared_ptr<const PreparedResponse>;
+
+  struct Entry {
+    Prepared response;
+    std::chrono::steady_clock::time_point expires;
+    size_t bytes;
+    std::list<std::string>::iterator position;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; // keys, most recently used first
+    std::unordered_set<std::string> filling; // keys whose handler runs
+    size_t bytes = 0;
+
+    void erase(std::unordered_map<std::string, Entry>::iterator it) {
+      bytes -= it->second.bytes;
+      lru.erase(it->second.position);
+      entries.erase(it);
+    }
+  };
+
+  struct Store {
+    explicit Store(ResponseCacheOptions o)
+        : options(std::move(o)),
+          shard_budget(options.max_bytes / SHARD_COUNT) {
+      for (const std::string &name : options.vary) {
+        if (http_detail::iequals(name, "Cookie")) {
+          varies_on_cookie = true;
+        }
+      }
+    }
+
+    ResponseCacheOptions options;
+    size_t shard_budget;
+    bool varies_on_cookie = false;
+    Shard shards[SHARD_COUNT];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    // Replaces the expired entry the filling request found, if any, with
+    // its result if that is cacheable.
+    void publish(Shard &shard, const std::string &key, Prepared response) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.filling.erase(key);
+      auto it = shard.entries.find(key);
+      if (it != shard.entries.end()) {
+        shard.erase(it);
+      }
+      const size_t bytes =
+          response ? response->bytes.size() + 2 * key.size() + 128 : 0;
+      if (response && bytes <= shard_budget) {
+        shard.lru.push_front(key);
+        shard.entries.emplace(
+            key, Entry{response,
+                       std::chrono::steady_clock::now() + options.ttl, bytes,
+                       shard.lru.begin()});
+        shard.bytes += bytes;
+        while (shard.bytes > shard_budget) {
+          shard.erase(shard.entries.find(shard.lru.back()));
+        }
+      }
+    }
+  };
+
+  std::shared_ptr<Store> store_;
+
+  void build_key(const HttpRequest &req, std::string &key) const {
+    key.assign(req.raw_path_view);
+    for (const std::string &name : store_->options.vary) {
+      key += '\0';
+      key.append(req.header(name));
+    }
+  }
+
+  static HttpResponse hit(const HttpRequest &req, Prepared response) {
+    HttpResponse res;
+    res.set_status(response->status_code);
+    res.prepared = std::move(response);
+    res.keep_alive = req.wants_keep_alive();
+    return res;
+  }
+
+  static bool cacheable(const HttpResponse &res) {
+    switch (res.status_code) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 410:
+      break;
+    default:
+      return false;
+    }
+    if (res.deferred || res.file.fd >= 0 || res.headers.count("Set-Cookie")) {
+      return false;
+    }
+    auto control = res.headers.find("Cache-Control");
+    if (control != res.headers.end()) {
+      const std::string &value = control->second;
+      for (std::string_view directive : {"no-store", "no-cache", "private"}) {
+        if (http_detail::icontains(value, directive)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+};
@@ -0,0 +1,649 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "async_io.hpp"
+#include "http_request.hpp"
+#include "http_response.hpp"
+#include "output_buffer.hpp"
+#include "task.hpp"
+
+struct Upstream {
+  std::string host; // numeric IPv4 or IPv6 address
+  uint16_t port = 80;
+};
+
+enum class ProxyBalance {
+  RoundRobin,
+  LeastOutstanding // fewest requests in flight from this worker
+};
+
+struct ProxyOptions {
+  std::vector<Upstream> upstreams;
+  ProxyBalance balance = ProxyBalance::RoundRobin;
+  // Idle keep-alive connections kept per upstream on each worker.
+  size_t max_idle = 32;
+  std::chrono::milliseconds connect_timeout{1000};
+  // Longest the upstream may take over any single read or write.
+  std::chrono::milliseconds io_timeout{30000};
+  // Response bodies with a Content-Length above this are spliced from the
+  // upstream socket to the client; smaller, chunked and close-delimited ones
+  // are read into memory first.
+  size_t splice_threshold = 64 * 1024;
+  // Largest body read into memory; an upstream sending more gets 502.
+  size_t max_buffered_body = 8 << 20;
+  // Removed from the front of forwarded paths (e.g. the route prefix).
+  std::string strip_prefix;
+};
+
+// Route handler forwarding requests to upstream HTTP/1.1 servers (see
+// Router::proxy()). Each worker keeps its own pool of keep-alive connections
+// per upstream, so a request normally reuses one instead of connecting, and
+// picks an upstream round-robin or by fewest requests in flight. All I/O
+// goes through the worker's ring (see AsyncCall), never a thread.
+//
+// Hop-by-hop header fields are dropped in both directions and the client
+// address is appended to X-Forwarded-For. A pooled connection that fails
+// before the upstream answered anything was most likely closed while idle,
+// so an idempotent request is retried once on a fresh one (RFC 9110 9.2.2);
+// others may already have been executed and get 502. An upstream that
+// cannot be connected to is skipped for the next. Otherwise a failed
+// exchange is answered with 502, or 504 when the upstream timed out.
+class ReverseProxy {
+public:
+  explicit ReverseProxy(ProxyOptions options)
+      : store_(std::make_shared<Store>(std::move(options))) {}
+
+  Task<HttpResponse> operator()(HttpRequest &req) const {
+    return forward(store_, req);
+  }
+
+private:
+  static constexpr size_t READ_CHUNK = 16 * 1024;
+  static constexpr size_t MAX_HEAD_BYTES = 64 * 1024;
+  static constexpr size_t SPLICE_CHUNK = 64 * 1024; // the default pipe size
+  static constexpr size_t INLINE_REQUEST_BODY = 16 * 1024;
+  static constexpr size_t MALFORMED = static_cast<size_t>(-1);
+
+  // One upstream as seen by one worker.
+  struct Backend {
+    std::vector<int> idle; // most recently used last
+    unsigned outstanding = 0;
+  };
+
+  struct Pool {
+    explicit Pool(size_t upstreams) : backends(upstreams) {}
+
+    ~Pool() {
+      for (const Backend &backend : backends) {
+        for (const int fd : backend.idle) {
+          ::close(fd);
+        }
+      }
+    }
+
+    std::vector<Backend> backends;
+    size_t next = 0; // round-robin cursor
+  };
+
+  struct Store {
+    explicit Store(ProxyOptions options) : options(std::move(options)) {}
+
+    // The calling worker's pool, created on its first request.
+    Pool &local() {
+      thread_local std::unordered_map<uint64_t, Pool *> pools_by_store;
+      Pool *&pool = pools_by_store[id];
+      if (!pool) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pools.push_back(std::make_unique<Pool>(options.upstreams.size()));
+        pool = pools.back().get();
+      }
+      return *pool;
+    }
+
+    const ProxyOptions options;
+    const uint64_t id = next_id();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Pool>> pools;
+  };
+
+  // A request's hold on a connection to one upstream. It counts as
+  // outstanding there until released; dropping it closes the connection.
+  class Lease {
+  public:
+    Lease(Pool &pool, size_t backend) : pool_(&pool), backend_(backend) {
+      ++pool.backends[backend].outstanding;
+    }
+
+    Lease(Lease &&other) noexcept
+        : fd(std::exchange(other.fd, -1)),
+          pool_(std::exchange(other.pool_, nullptr)),
+          backend_(other.backend_) {}
+
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+    Lease &operator=(Lease &&) = delete;
+
+    ~Lease() { release(false, 0); }
+
+    bool take_idle() {
+      std::vector<int> &idle = pool_->backends[backend_].idle;
+      if (idle.empty()) {
+        return false;
+      }
+      fd = idle.back();
+      idle.pop_back();
+      return true;
+    }
+
+    void discard() {
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+
+    // Pools the connection if it can carry another request, else closes it.
+    void release(bool reusable, size_t max_idle) {
+      if (!pool_) {
+        return;
+      }
+      Backend &backend = pool_->backends[backend_];
+      if (reusable && fd >= 0 && backend.idle.size() < max_idle) {
+        backend.idle.push_back(fd);
+        fd = -1;
+      }
+      discard();
+      --backend.outstanding;
+      pool_ = nullptr;
+    }
+
+    int fd = -1;
+
+  private:
+    Pool *pool_;
+    size_t backend_;
+  };
+
+  enum class Framing { None, Length, Chunked, Close };
+
+  struct ResponseHead {
+    int status = 0;
+    std::string reason;
+    std::vector<std::pair<std::string, std::string>> fields;
+    Framing framing = Framing::Close;
+    size_t length = 0;
+    bool keep_alive = true;
+  };
+
+  // Incremental decoder of a chunked body; trailer fields are dropped.
+  struct ChunkedDecoder {
+    enum class State { Size, Data, DataEnd, Trailer, Done };
+
+    State state = State::Size;
+    size_t pos = 0;       // next undecoded byte of the input
+    size_t remaining = 0; // data bytes left in the current chunk
+
+    bool done() const noexcept { return state == State::Done; }
+
+    // Decodes what it can of `data` into `body`; false if it is malformed.
+    bool feed(std::string_view data, std::string &body) {
+      while (state != State::Done) {
+        if (state == State::Data) {
+          const size_t n = std::min(remaining, data.size() - pos);
+          body.append(data.substr(pos, n));
+          pos += n;
+          remaining -= n;
+          if (remaining > 0) {
+            return true;
+          }
+          state = State::DataEnd;
+        }
+        const size_t eol = data.find("\r\n", pos);
+        if (eol == std::string_view::npos) {
+          return data.size() - pos < MAX_HEAD_BYTES;
+        }
+        const std::string_view line = data.substr(pos, eol - pos);
+        pos = eol + 2;
+        if (state == State::Size) {
+          const std::string_view digits = line.substr(0, line.find(';'));
+          size_t size = 0;
+          const auto [end, ec] = std::from_chars(
+              digits.data(), digits.data() + digits.size(), size, 16);
+          if (ec != std::errc() || end == digits.data()) {
+            return false;
+          }
+          remaining = size;
+          state = size == 0 ? State::Trailer : State::Data;
+        } else if (state == State::DataEnd) {
+          if (!line.empty()) {
+            return false;
+          }
+          state = State::Size;
+        } else if (line.empty()) {
+          state = State::Done;
+        }
+      }
+      return true;
+    }
+  };
+
+  std::shared_ptr<Store> store_;
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> counter{0};
+    return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  static size_t pick(Pool &pool, ProxyBalance balance) {
+    const size_t count = pool.backends.size();
+    const size_t first = pool.next++ % count;
+    if (balance == ProxyBalance::RoundRobin) {
+      return first;
+    }
+    // Scanning from the round-robin cursor spreads ties.
+    size_t best = first;
+    for (size_t i = 1; i < count; ++i) {
+      const size_t candidate = (first + i) % count;
+      if (pool.backends[candidate].outstanding <
+          pool.backends[best].outstanding) {
+        best = candidate;
+      }
+    }
+    return best;
+  }
+
+  static bool hop_by_hop(std::string_view name) {
+    for (std::string_view hop :
+         {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+          "Transfer-Encoding", "Upgrade"}) {
+      if (http_detail::iequals(name, hop)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static std::string request_head(const HttpRequest &req,
+                                  const ProxyOptions &options) {
+    std::string_view target = req.raw_path_view;
+    const std::string_view strip = options.strip_prefix;
+    if (!strip.empty() && target.substr(0, strip.size()) == strip) {
+      target.remove_prefix(strip.size());
+    }
+
+    std::string head;
+    head.reserve(512);
+    head.append(req.method_view);
+    head += ' ';
+    if (target.empty() || target.front() != '/') {
+      head += '/';
+    }
+    head.append(target);
+    head.append(" HTTP/1.1\r\n");
+
+    std::string forwarded_for;
+    for (const auto &field : req.header_fields) {
+      if (http_detail::iequals(field.name, "X-Forwarded-For")) {
+        forwarded_for.assign(field.value);
+        continue;
+      }
+      if (hop_by_hop(field.name) ||
+          http_detail::iequals(field.name, "Content-Length") ||
+          http_detail::iequals(field.name, "Expect")) {
+        continue;
+      }
+      head.append(field.name);
+      head.append(": ");
+      head.append(field.value);
+      head.append("\r\n");
+    }
+
+    const std::string client = req.peer ? req.peer->to_string() : "";
+    if (!client.empty()) {
+      forwarded_for += forwarded_for.empty() ? "" : ", ";
+      forwarded_for += client;
+    }
+    if (!forwarded_for.empty()) {
+      head.append("X-Forwarded-For: ");
+      head.append(forwarded_for);
+      head.append("\r\n");
+    }
+
+    const HttpMethod method = req.method_id;
+    if (!req.body_view.empty() || method == HttpMethod::POST ||
+        method == HttpMethod::PUT || method == HttpMethod::PATCH) {
+      head.append("Content-Length: ");
+      head.append(std::to_string(req.body_view.size()));
+      head.append("\r\n");
+    }
+    head.append("\r\n");
+    return head;
+  }
+
+  // Parses the response head at the front of `data`: its length, 0 if it
+  // is incomplete, or MALFORMED.
+  static size_t parse_head(std::string_view data, bool head_request,
+                           ResponseHead &head) {
+    const size_t end = data.find("\r\n\r\n");
+    if (end == std::string_view::npos) {
+      return data.size() < MAX_HEAD_BYTES ? 0 : MALFORMED;
+    }
+
+    size_t line_end = data.find("\r\n");
+    const std::string_view status_line = data.substr(0, line_end);
+    if (status_line.size() < 12 || status_line.substr(0, 7) != "HTTP/1." ||
+        status_line[8] != ' ') {
+      return MALFORMED;
+    }
+    const auto [code_end, ec] = std::from_chars(
+        status_line.data() + 9, status_line.data() + 12, head.status);
+    if (ec != std::errc() || code_end != status_line.data() + 12 ||
+        head.status < 100) {
+      return MALFORMED;
+    }
+    head.reason.assign(status_line.size() > 13 ? status_line.substr(13)
+                                               : std::string_view());
+    head.keep_alive = status_line[7] == '1';
+    head.fields.clear();
+
+    bool chunked = false;
+    bool has_length = false;
+    size_t pos = line_end + 2;
+    while (pos < end) {
+      line_end = data.find("\r\n", pos);
+      const std::string_view line = data.substr(pos, line_end - pos);
+      pos = line_end + 2;
+      const size_t colon = line.find(':');
+      if (colon == std::string_view::npos || colon == 0) {
+        return MALFORMED;
+      }
+      const std::string_view name = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      const size_t first = value.find_first_not_of(" \t");
+      value = first == std::string_view::npos
+                  ? std::string_view()
+                  : value.substr(first, value.find_last_not_of(" \t") -
+                                            first + 1);
+
+      if (http_detail::iequals(name, "Connection")) {
+        if (http_detail::icontains(value, "close")) {
+          head.keep_alive = false;
+        } else if (http_detail::icontains(value, "keep-alive")) {
+          head.keep_alive = true;
+        }
+      } else if (http_detail::iequals(name, "Transfer-Encoding")) {
+        chunked = http_detail::icontains(value, "chunked");
+      } else if (http_detail::iequals(name, "Content-Length")) {
+        const auto [length_end, length_ec] = std::from_chars(
+            value.data(), value.data() + value.size(), head.length);
+        if (length_ec != std::errc() ||
+            length_end != value.data() + value.size()) {
+          return MALFORMED;
+        }
+        has_length = true;
+      }
+      if (!hop_by_hop(name) && !http_detail::iequals(name, "Date")) {
+        head.fields.emplace_back(name, value);
+      }
+    }
+
+    if (head_request || head.status < 200 || head.status == 204 ||
+        head.status == 304) {
+      head.framing = Framing::None;
+    } else if (chunked) {
+      head.framing = Framing::Chunked;
+    } else if (has_length) {
+      head.framing = Framing::Length;
+    } else {
+      head.framing = Framing::Close;
+      head.keep_alive = false;
+    }
+    return end + 4;
+  }
+
+  // Reads more of the upstream's answer onto `buffer`: the byte count, 0 at
+  // end of stream, or -errno.
+  static Task<int> fill(int fd, std::string &buffer,
+                        std::chrono::nanoseconds limit) {
+    const size_t used = buffer.size();
+    buffer.resize(used + READ_CHUNK);
+    const int n = co_await async::recv(fd, buffer.data() + used, READ_CHUNK)
+                      .timeout(limit);
+    buffer.resize(used + static_cast<size_t>(std::max(n, 0)));
+    co_return n;
+  }
+
+  static HttpResponse error(const HttpRequest &req, int status) {
+    HttpResponse res;
+    res.set_status(status);
+    res.set_body(status == 504 ? "Gateway Timeout" : "Bad Gateway");
+    res.keep_alive = req.wants_keep_alive();
+    return res;
+  }
+
+  // Methods whose request may be sent twice (RFC 9110 9.2.2).
+  static bool idempotent(HttpMethod method) {
+    switch (method) {
+    case HttpMethod::GET:
+    case HttpMethod::HEAD:
+    case HttpMethod::PUT:
+    case HttpMethod::DELETE:
+    case HttpMethod::OPTIONS:
+    case HttpMethod::TRACE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static int failure_status(int result) {
+    return result == -ECANCELED || result == -ETIME ? 504 : 502;
+  }
+
+  // Closes a pipe's read end once the client connection has sent the range.
+  struct PipeReader {
+    explicit PipeReader(int fd) : fd(fd) {}
+    ~PipeReader() { ::close(fd); }
+
+    PipeReader(const PipeReader &) = delete;
+    PipeReader &operator=(const PipeReader &) = delete;
+
+    int fd;
+  };
+
+  // Moves the rest of a spliced body from the upstream into the pipe the
+  // client connection splices from, then gives the connection back. If the
+  // client goes away first, the pipe breaks and the connection is closed.
+  static DetachedTask pump(std::shared_ptr<Store> store, Lease lease,
+                           int pipe_in, size_t remaining, bool reusable) {
+    const auto limit = store->options.io_timeout;
+    while (remaining > 0) {
+      const int n = co_await async::splice(
+                        lease.fd, async::CURRENT_POSITION, pipe_in,
+                        async::CURRENT_POSITION,
+                        std::min(remaining, SPLICE_CHUNK))
+                        .timeout(limit);
+      if (n <= 0) {
+        break;
+      }
+      remaining -= static_cast<size_t>(n);
+    }
+    ::close(pipe_in);
+    lease.release(reusable && remaining == 0, store->options.max_idle);
+  }
+
+  static Task<HttpResponse> forward(std::shared_ptr<Store> store,
+                                    HttpRequest &req) {
+    const ProxyOptions &options = store->options;
+    if (options.upstreams.empty()) {
+      co_return error(req, 502);
+    }
+    Pool &pool = store->local();
+    const bool head_request = req.method_id == HttpMethod::HEAD;
+
+    std::string head = request_head(req, options);
+    const bool inline_body = req.body_view.size() <= INLINE_REQUEST_BODY;
+    if (inline_body) {
+      head.append(req.body_view);
+    }
+
+    size_t backend = pick(pool, options.balance);
+    for (size_t tried = 0; tried < pool.backends.size();
+         ++tried, backend = (backend + 1) % pool.backends.size()) {
+      Lease lease(pool, backend);
+      bool fresh = !lease.take_idle();
+      if (fresh) {
+        const Upstream &upstream = options.upstreams[backend];
+        lease.fd = co_await async::connect_tcp(upstream.host, upstream.port,
+                                               options.connect_timeout);
+        if (lease.fd < 0) {
+          continue; // nothing was sent; try the next upstream
+        }
+      }
+
+      std::string buffer;
+      ResponseHead response;
+      size_t head_bytes = 0;
+      int result = 0;
+      while (true) {
+        result = co_await async::send_all(lease.fd, head, options.io_timeout);
+        if (result > 0 && !inline_body) {
+          result = co_await async::send_all(lease.fd, req.body_view,
+                                            options.io_timeout);
+        }
+        buffer.clear();
+        head_bytes = 0;
+        while (result > 0 && head_bytes == 0) {
+          result = co_await fill(lease.fd, buffer, options.io_timeout);
+          if (result > 0) {
+            head_bytes = parse_head(buffer, head_request, response);
+            // Interim 1xx answers are skipped.
+            while (head_bytes != 0 && head_bytes != MALFORMED &&
+                   response.status < 200) {
+              buffer.erase(0, head_bytes);
+              head_bytes = parse_head(buffer, head_request, response);
+            }
+          }
+        }
+        if (head_bytes == 0 && buffer.empty() && !fresh &&
+            result != -ECANCELED && idempotent(req.method_id)) {
+          // A stale pooled connection: retry once on a new one.
+          lease.discard();
+          fresh = true;
+          const Upstream &upstream = options.upstreams[backend];
+          lease.fd = co_await async::connect_tcp(
+              upstream.host, upstream.port, options.connect_timeout);
+          if (lease.fd < 0) {
+            co_return error(req, 502);
+          }
+          continue;
+        }
+        break;
+      }
+      if (head_bytes == 0 || head_bytes == MALFORMED) {
+        co_return error(req, head_bytes == 0 ? failure_status(result) : 502);
+      }
+
+      HttpResponse res;
+      res.set_status(response.status);
+      res.status_message = std::move(response.reason);
+      for (const auto &[name, value] : response.fields) {
+        res.headers.add(name, value);
+      }
+      res.keep_alive = req.wants_keep_alive();
+
+      const std::string_view early =
+          std::string_view(buffer).substr(head_bytes);
+      if (response.framing == Framing::None) {
+        lease.release(response.keep_alive && early.empty(), options.max_idle);
+        co_return res;
+      }
+
+      if (response.framing == Framing::Length &&
+          response.length > options.splice_threshold &&
+          early.size() <= response.length) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+          co_return error(req, 502);
+        }
+        FileRange range;
+        range.owner = std::make_shared<PipeReader>(fds[0]);
+        range.fd = fds[0];
+        range.offset = -1;
+        range.length = response.length;
+        // Fits: it came with the head, in one read of at most READ_CHUNK.
+        if (::write(fds[1], early.data(), early.size()) !=
+            static_cast<ssize_t>(early.size())) {
+          ::close(fds[1]);
+          co_return error(req, 502);
+        }
+        res.file = std::move(range);
+        pump(store, std::move(lease), fds[1], response.length - early.size(),
+             response.keep_alive);
+        co_return res;
+      }
+
+      // Bodies read into memory.
+      std::string body;
+      if (response.framing == Framing::Length) {
+        body.reserve(response.length);
+      }
+      ChunkedDecoder chunks;
+      buffer.erase(0, head_bytes);
+      bool extra = false; // bytes beyond the response
+      while (true) {
+        bool complete = false;
+        if (response.framing == Framing::Length) {
+          const size_t wanted = response.length - body.size();
+          body.append(buffer, 0, std::min(wanted, buffer.size()));
+          extra = buffer.size() > wanted;
+          complete = body.size() == response.length;
+          buffer.clear();
+        } else if (response.framing == Framing::Chunked) {
+          if (!chunks.feed(buffer, body)) {
+            co_return error(req, 502);
+          }
+          complete = chunks.done();
+          extra = complete && chunks.pos < buffer.size();
+          buffer.erase(0, chunks.pos); // keeps a partial size line
+          chunks.pos = 0;
+        } else {
+          body.append(buffer);
+          buffer.clear();
+        }
+        if (complete) {
+          break;
+        }
+        if (body.size() > options.max_buffered_body) {
+          co_return error(req, 502);
+        }
+        result = co_await fill(lease.fd, buffer, options.io_timeout);
+        if (result == 0 && response.framing == Framing::Close) {
+          break;
+        }
+        if (result <= 0) {
+          co_return error(req, failure_status(result));
+        }
+      }
+      lease.release(response.keep_alive && !extra, options.max_idle);
+      res.body = std::move(body);
+      co_return res;
+    }
+    co_return error(req, 502);
+  }
+};
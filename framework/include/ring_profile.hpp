@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <liburing.h>
+#include <optional>
+#include <string_view>
+
+// How an io_uring is set up. Which one wins depends on the kernel and the
+// load, so it is a deployment choice (and a benchmark axis) rather than a
+// fixed default.
+enum class RingProfile : uint8_t {
+  // No setup flags: the kernel runs completion work (task_work) whenever it
+  // interrupts the thread.
+  Default,
+  // IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN: completion work
+  // is deferred until the owning thread waits for completions, so it runs in
+  // one batch together with submission instead of interrupting request
+  // processing. Needs Linux 6.1; only the thread that created the ring may
+  // submit to it.
+  DeferTaskrun,
+  // IORING_SETUP_SQPOLL: a kernel thread polls the submission queue, so
+  // submitting takes no syscall while it is awake. It spins on a core of its
+  // own; pin it (RingOptions::sqpoll_cpu) away from the workers.
+  SqPoll,
+};
+
+struct RingOptions {
+  RingProfile profile = RingProfile::Default;
+  // SqPoll: CPU the poller thread is bound to (-1 lets it float), and how
+  // long it spins without submissions before going to sleep.
+  int sqpoll_cpu = -1;
+  std::chrono::milliseconds sqpoll_idle{1000};
+};
+
+inline const char *ring_profile_name(RingProfile profile) {
+  switch (profile) {
+  case RingProfile::DeferTaskrun:
+    return "defer-taskrun";
+  case RingProfile::SqPoll:
+    return "sqpoll";
+  default:
+    return "default";
+  }
+}
+
+inline std::optional<RingProfile> parse_ring_profile(std::string_view name) {
+  for (const RingProfile profile :
+       {RingProfile::Default, RingProfile::DeferTaskrun, RingProfile::SqPoll}) {
+    if (name == ring_profile_name(profile)) {
+      return profile;
+    }
+  }
+  return std::nullopt;
+}
+
+// Creates `ring` with the setup flags of `options.profile`, falling back to
+// the default profile when the kernel rejects them. The profile in effect,
+// or nothing if no ring could be created at all.
+inline std::optional<RingProfile> init_ring(io_uring &ring, unsigned entries,
+                                            const RingOptions &options) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  switch (options.profile) {
+  case RingProfile::DeferTaskrun:
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    break;
+  case RingProfile::SqPoll:
+    params.flags = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle =
+        static_cast<uint32_t>(options.sqpoll_idle.count());
+    if (options.sqpoll_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = static_cast<uint32_t>(options.sqpoll_cpu);
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (io_uring_queue_init_params(entries, &ring, &params) == 0) {
+    return options.profile;
+  }
+  if (options.profile != RingProfile::Default &&
+      io_uring_queue_init(entries, &ring, 0) == 0) {
+    return RingProfile::Default;
+  }
+  return std::nullopt;
+}
@@ -1,130 +1,433 @@
 #pragma once
 
+#include "async_handler.hpp"
 #include "http_request.hpp"
 #include "http_response.hpp"
+#include "metrics.hpp"
+#include "middleware.hpp"
+#include "reverse_proxy.hpp"
+#include "static_files.hpp"
+#include "websocket.hpp"
+#include <array>
+#include <chrono>
+#include <deque>
 #include <functional>
-#include <regex>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 using Handler = std::function<HttpResponse(const HttpRequest &)>;
 
-struct RoutePattern {
-  std::string method;
-  std::string pattern;
-  std::regex regex_pattern;
-  std::vector<std::string> param_names;
-  Handler handler;
+// What a route stores: either a plain Handler or a handler with a compile-time
+// pipeline in front of it (see Pipeline::wrap), which needs a mutable request.
+using RouteHandler = std::function<HttpResponse(HttpRequest &)>;
 
-  RoutePattern(std::string_view m, std::string_view p, Handler h)
-      : method(m), pattern(p), handler(std::move(h)) {
-    compile_pattern();
+class Router;
+
+// Routes registered through a group share a path prefix and a middleware
+// chain; requests to other routes never run it. Groups are owned by the
+// router that created them and must be filled in before it is moved.
+class RouteGroup {
+public:
+  RouteGroup(Router &router, std::string prefix)
+      : router_(router), prefix_(std::move(prefix)) {}
+
+  RouteGroup &use(Middleware mw) {
+    chain_.use(std::move(mw));
+    return *this;
   }
 
-private:
-  void compile_pattern() {
-    std::string regex_str;
-    regex_str.reserve(pattern.length() * 2);
-    regex_str = "^";
-    param_names.clear();
-
-    size_t pos = 0;
-    while (pos < pattern.length()) {
-      size_t param_start = pattern.find(':', pos);
-
-      if (param_start == std::string::npos) {
-        std::string literal = pattern.substr(pos);
-        regex_str += regex_escape(literal);
-        break;
-      }
+  void get(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::GET, path, std::move(handler));
+  }
 
-      if (param_start > pos) {
-        std::string literal = pattern.substr(pos, param_start - pos);
-        regex_str += regex_escape(literal);
-      }
+  void post(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::POST, path, std::move(handler));
+  }
 
-      size_t param_end = param_start + 1;
-      while (param_end < pattern.length() &&
-             (std::isalnum(pattern[param_end]) || pattern[param_end] == '_')) {
-        param_end++;
-      }
+  void put(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::PUT, path, std::move(handler));
+  }
 
-      std::string param_name =
-          pattern.substr(param_start + 1, param_end - param_start - 1);
-      param_names.push_back(param_name);
+  void del(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::DELETE, path, std::move(handler));
+  }
 
-      regex_str += "([^/]+)";
+  void patch(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::PATCH, path, std::move(handler));
+  }
 
-      pos = param_end;
-    }
+  void get(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::GET, path, std::move(handler));
+  }
 
-    regex_str += "$";
-    regex_pattern = std::regex(regex_str, std::regex::optimize);
+  void post(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::POST, path, std::move(handler));
   }
 
-  static std::string regex_escape(const std::string &str) {
-    static const std::string special_chars = "\\^$.|?*+()[]{}";
-    std::string result;
-    result.reserve(str.length() * 2);
+  void put(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::PUT, path, std::move(handler));
+  }
 
-    for (char c : str) {
-      if (special_chars.find(c) != std::string::npos) {
-        result += '\\';
-      }
-      result += c;
-    }
-    return result;
+  void del(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::DELETE, path, std::move(handler));
   }
+
+  void patch(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::PATCH, path, std::move(handler));
+  }
+
+  inline void add(HttpMethod method, std::string_view path,
+                  RouteHandler handler);
+
+  inline void add(HttpMethod method, std::string_view path,
+                  AsyncHandler handler);
+
+private:
+  Router &router_;
+  std::string prefix_;
+  MiddlewareChain chain_;
 };
 
+// Routes are stored in one compressed radix tree per method. A pattern is a
+// sequence of literal bytes, ":name" parameters (one path segment, up to the
+// next '/') and an optional trailing "*name" catch-all. Lookups walk the
+// request path once; when several routes could match, a literal edge wins
+// over a parameter, and a parameter over a catch-all.
+//
+// Middleware added with use() runs for every request, matched or not (so
+// that e.g. CORS preflights and 404s are seen); group middleware only for the
+// group's routes.
 class Router {
 public:
-  void get(std::string_view path, Handler handler) {
-    routes.emplace_back("GET", path, std::move(handler));
+  Router() = default;
+  Router(Router &&) = default;
+  Router &operator=(Router &&) = default;
+
+  Router &use(Middleware mw) {
+    global_.use(std::move(mw));
+    return *this;
+  }
+
+  RouteGroup &group(std::string prefix) {
+    return groups_.emplace_back(*this, std::move(prefix));
   }
 
-  void post(std::string_view path, Handler handler) {
-    routes.emplace_back("POST", path, std::move(handler));
+  void get(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::GET, path, std::move(handler));
   }
 
-  void put(std::string_view path, Handler handler) {
-    routes.emplace_back("PUT", path, std::move(handler));
+  void post(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::POST, path, std::move(handler));
   }
 
-  void del(std::string_view path, Handler handler) {
-    routes.emplace_back("DELETE", path, std::move(handler));
+  void put(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::PUT, path, std::move(handler));
   }
 
-  void patch(std::string_view path, Handler handler) {
-    routes.emplace_back("PATCH", path, std::move(handler));
+  void del(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::DELETE, path, std::move(handler));
+  }
+
+  void patch(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::PATCH, path, std::move(handler));
+  }
+
+  void head(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::HEAD, path, std::move(handler));
+  }
+
+  void options(std::string_view path, RouteHandler handler) {
+    add(HttpMethod::OPTIONS, path, std::move(handler));
+  }
+
+  // Coroutine routes: the handler returns a Task<HttpResponse> and may
+  // suspend on ring operations without holding up the worker (see
+  // AsyncCall for how middleware applies).
+  void get(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::GET, path, std::move(handler));
+  }
+
+  void post(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::POST, path, std::move(handler));
+  }
+
+  void put(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::PUT, path, std::move(handler));
+  }
+
+  void del(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::DELETE, path, std::move(handler));
+  }
+
+  void patch(std::string_view path, AsyncHandler handler) {
+    add(HttpMethod::PATCH, path, std::move(handler));
+  }
+
+  // Serves the files below `root` at GET/HEAD `prefix`/...
+  void static_dir(std::string_view prefix, std::string root,
+                  StaticDirOptions options = {}) {
+    const StaticDir handler(std::move(root), std::move(options));
+    std::string pattern(prefix);
+    if (pattern.empty() || pattern.back() != '/') {
+      pattern += '/';
+    }
+    pattern += "*path";
+    get(pattern, handler);
+    head(pattern, handler);
+  }
+
+  // Forwards every request below `prefix` to the upstreams in `options`
+  // (see ReverseProxy).
+  void proxy(std::string_view prefix, ProxyOptions options) {
+    const ReverseProxy handler(std::move(options));
+    std::string pattern(prefix);
+    if (pattern.empty() || pattern.back() != '/') {
+      pattern += '/';
+    }
+    pattern += "*path";
+    for (const HttpMethod method :
+         {HttpMethod::GET, HttpMethod::HEAD, HttpMethod::POST, HttpMethod::PUT,
+          HttpMethod::DELETE, HttpMethod::PATCH, HttpMethod::OPTIONS}) {
+      add(method, pattern, AsyncHandler(handler));
+    }
+  }
+
+  // Accepts WebSocket upgrades at GET `path`; global middleware runs on the
+  // handshake request like on any other.
+  void websocket(std::string_view path, WebSocketHandler handler) {
+    auto shared = std::make_shared<const WebSocketHandler>(std::move(handler));
+    add(HttpMethod::GET, path, [shared](HttpRequest &req) {
+      return websocket_handshake(req, shared);
+    });
+  }
+
+  // Exposes Metrics::global() in Prometheus text format.
+  void metrics(std::string_view path = "/metrics") {
+    get(path, Metrics::handle);
+  }
+
+  void add(HttpMethod method, std::string_view path, RouteHandler handler,
+           const MiddlewareChain *chain = nullptr) {
+    if (method == HttpMethod::Unknown) {
+      throw std::invalid_argument("unsupported method for route");
+    }
+    Node &root = roots[static_cast<size_t>(method)];
+    insert(root, path, path,
+           Route{std::move(handler), chain,
+                 Metrics::global().register_route(method, path)});
+  }
+
+  void add(HttpMethod method, std::string_view path, AsyncHandler handler,
+           const MiddlewareChain *chain = nullptr) {
+    auto shared = std::make_shared<const AsyncHandler>(std::move(handler));
+    add(method, path,
+        RouteHandler([shared](HttpRequest &req) {
+          return AsyncCall::defer(req, shared);
+        }),
+        chain);
   }
 
   HttpResponse handle(HttpRequest &req) const {
-    for (const auto &route : routes) {
-      if (route.method != req.method) {
-        continue;
-      }
+    if (global_.empty()) {
+      return dispatch(req);
+    }
+    return global_.execute(
+        req, [this](HttpRequest &r) { return dispatch(r); });
+  }
 
-      std::smatch match;
-      if (std::regex_match(req.path, match, route.regex_pattern)) {
-        req.path_params.clear();
-        for (size_t i = 0; i < route.param_names.size() && i + 1 < match.size();
-             ++i) {
-          req.path_params[route.param_names[i]] = match[i + 1].str();
-        }
+private:
+  struct Route {
+    RouteHandler handler;
+    const MiddlewareChain *chain; // group middleware, if any
+    uint32_t metric_id;           // latency histogram slot
+  };
+
+  MiddlewareChain global_;
+  std::deque<RouteGroup> groups_;
 
-        return route.handler(req);
+  HttpResponse dispatch(HttpRequest &req) const {
+    req.path_param_views.clear();
+    if (req.method_id != HttpMethod::Unknown) {
+      const Node &root = roots[static_cast<size_t>(req.method_id)];
+      if (const Route *route =
+              match(root, req.path_view, req.path_param_views)) {
+        if (req.is_materialized()) {
+          req.path_params.clear();
+          for (const auto &param : req.path_param_views) {
+            req.path_params[std::string(param.name)] = std::string(param.value);
+          }
+        }
+        const auto start = std::chrono::steady_clock::now();
+        HttpResponse res = route->chain && !route->chain->empty()
+                               ? route->chain->execute(req, route->handler)
+                               : route->handler(req);
+        if (res.deferred) {
+          res.deferred->measure(route->metric_id, start);
+          return res;
+        }
+        Metrics::global().local().record_route(
+            route->metric_id,
+            static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count()));
+        return res;
       }
     }
 
     HttpResponse res;
     res.set_status(404);
-    res.status_message = "Not Found";
     res.set_body("Page not found");
     res.keep_alive = req.wants_keep_alive();
     return res;
   }
 
-private:
-  std::vector<RoutePattern> routes;
+  struct Node {
+    std::string prefix; // literal bytes matched on the edge into this node
+    std::string indices; // first byte of each static child, same order
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param_child;
+    std::string param_name;
+    std::string catch_all_name;
+    std::unique_ptr<Route> route;
+    std::unique_ptr<Route> catch_all;
+  };
+
+  std::array<Node, static_cast<size_t>(HttpMethod::Count)> roots;
+
+  static bool is_name_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  }
+
+  // Adds `rest` (the unmatched tail of `pattern`) below `node`.
+  static void insert(Node &node, std::string_view rest,
+                     std::string_view pattern, Route route) {
+    if (rest.empty()) {
+      if (node.route) {
+        throw std::invalid_argument("duplicate route: " +
+                                    std::string(pattern));
+      }
+      node.route = std::make_unique<Route>(std::move(route));
+      return;
+    }
+
+    if (rest.front() == ':') {
+      size_t end = 1;
+      while (end < rest.size() && is_name_char(rest[end])) {
+        ++end;
+      }
+      const std::string_view name = rest.substr(1, end - 1);
+      if (name.empty() || (end < rest.size() && rest[end] != '/')) {
+        throw std::invalid_argument("parameter must span a whole segment: " +
+                                    std::string(pattern));
+      }
+      if (!node.param_child) {
+        node.param_child = std::make_unique<Node>();
+        node.param_name = name;
+      } else if (node.param_name != name) {
+        throw std::invalid_argument("conflicting parameter name in route: " +
+                                    std::string(pattern));
+      }
+      insert(*node.param_child, rest.substr(end), pattern, std::move(route));
+      return;
+    }
+
+    if (rest.front() == '*') {
+      const std::string_view name = rest.substr(1);
+      for (char c : name) {
+        if (!is_name_char(c)) {
+          throw std::invalid_argument("catch-all must end the route: " +
+                                      std::string(pattern));
+        }
+      }
+      if (node.catch_all) {
+        throw std::invalid_argument("duplicate route: " +
+                                    std::string(pattern));
+      }
+      node.catch_all_name = name;
+      node.catch_all = std::make_unique<Route>(std::move(route));
+      return;
+    }
+
+    const std::string_view literal = rest.substr(0, rest.find_first_of(":*"));
+    const size_t slot = node.indices.find(literal.front());
+    if (slot == std::string::npos) {
+      node.indices.push_back(literal.front());
+      node.children.push_back(std::make_unique<Node>());
+      node.children.back()->prefix = literal;
+      insert(*node.children.back(), rest.substr(literal.size()), pattern,
+             std::move(route));
+      return;
+    }
+
+    std::unique_ptr<Node> &child = node.children[slot];
+    size_t common = 0;
+    while (common < literal.size() && common < child->prefix.size() &&
+           literal[common] == child->prefix[common]) {
+      ++common;
+    }
+
+    if (common < child->prefix.size()) {
+      // Split the edge: the shared bytes move into a new intermediate node.
+      auto split = std::make_unique<Node>();
+      split->prefix = child->prefix.substr(0, common);
+      child->prefix.erase(0, common);
+      split->indices.push_back(child->prefix.front());
+      split->children.push_back(std::move(child));
+      child = std::move(split);
+    }
+    insert(*child, rest.substr(common), pattern, std::move(route));
+  }
+
+  static const Route *match(const Node &node, std::string_view path,
+                              PathParamList &params) {
+    if (path.empty()) {
+      if (node.route) {
+        return node.route.get();
+      }
+    } else {
+      const size_t slot = node.indices.find(path.front());
+      if (slot != std::string::npos) {
+        const Node &child = *node.children[slot];
+        if (path.compare(0, child.prefix.size(), child.prefix) == 0) {
+          if (const Route *found =
+                  match(child, path.substr(child.prefix.size()), params)) {
+            return found;
+          }
+        }
+      }
+
+      if (node.param_child) {
+        const size_t end = std::min(path.find('/'), path.size());
+        if (end > 0) {
+          params.push_back({node.param_name, path.substr(0, end)});
+          if (const Route *found =
+                  match(*node.param_child, path.substr(end), params)) {
+            return found;
+          }
+          params.pop_back();
+        }
+      }
+    }
+
+    if (node.catch_all) {
+      params.push_back({node.catch_all_name, path});
+      return node.catch_all.get();
+    }
+    return nullptr;
+  }
 };
+
+inline void RouteGroup::add(HttpMethod method, std::string_view path,
+                            RouteHandler handler) {
+  router_.add(method, prefix_ + std::string(path), std::move(handler),
+              &chain_);
+}
+
+inline void RouteGroup::add(HttpMethod method, std::string_view path,
+                            AsyncHandler handler) {
+  router_.add(method, prefix_ + std::string(path), std::move(handler),
+              &chain_);
+}
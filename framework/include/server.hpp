@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <memory>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/signalfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "handoff.hpp"
+#include "socket.hpp"
+
+struct ServerConfig {
+  SocketConfig socket;  // applied to every worker; reuse_port is forced on
+  unsigned workers = 0; // 0 = one worker per available core
+  bool pin_workers = false;
+  // CPUs for the poller threads of SqPoll rings, handed to the workers in
+  // turn; empty leaves them unbound. Keep them off the workers' CPUs.
+  std::vector<int> sqpoll_cpus;
+  // On SIGTERM or SIGINT, or once a successor has taken the listeners over,
+  // the workers stop accepting and let their connections finish; whatever
+  // is still open after `drain_timeout` is cut.
+  std::chrono::milliseconds drain_timeout{30000};
+  // Unix socket for restarts without a closed listener (see handoff.hpp).
+  // At start-up the server takes over the listeners of the server offering
+  // them there, if any, and tells it to drain once its own workers are up;
+  // from then on it offers its listeners there itself. Unset, a restart can
+  // still overlap the two processes on SO_REUSEPORT, but connections queued
+  // on the old listeners are reset when they close unless the kernel
+  // migrates them (net.ipv4.tcp_migrate_req, Linux 5.14).
+  std::string handoff_path;
+};
+
+// Shard-per-core front end: every worker thread owns a Socket with its own
+// SO_REUSEPORT listener, io_uring ring and fd_table, so workers share nothing
+// on the request path.
+class Server {
+public:
+  explicit Server(const ServerConfig &config = {}) : config(config) {}
+
+  ~Server() { stop_workers(); }
+
+  bool init() {
+    // Splicing into a peer or pipe that has gone away raises SIGPIPE (there
+    // is no MSG_NOSIGNAL for it); the EPIPE result is handled instead.
+    std::signal(SIGPIPE, SIG_IGN);
+    // Shutdown signals are taken by run() (through a signalfd); every worker
+    // inherits the mask.
+    const sigset_t signals = shutdown_signals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    handoff::Inherited inherited;
+    if (!config.handoff_path.empty()) {
+      inherited = handoff::receive(config.handoff_path);
+    }
+
+    const std::vector<int> cpus = available_cpus();
+    unsigned count = config.workers > 0
+                         ? config.workers
+                         : static_cast<unsigned>(
+                               std::max<size_t>(cpus.size(), 1));
+    // Every inherited listener gets a worker; more workers bind their own.
+    count = std::max(count, static_cast<unsigned>(inherited.listeners.size()));
+
+    std::vector<std::future<bool>> ready;
+    ready.reserve(count);
+    go = start.get_future().share();
+
+    for (unsigned i = 0; i < count; ++i) {
+      auto worker = std::make_unique<Worker>();
+      worker->cpu = config.pin_workers && !cpus.empty()
+                        ? cpus[i % cpus.size()]
+                        : -1;
+      ready.push_back(worker->ready.get_future());
+
+      Worker *w = worker.get();
+      SocketConfig socket_config = config.socket;
+      socket_config.reuse_port = true;
+      socket_config.listen_fd =
+          i < inherited.listeners.size() ? inherited.listeners[i] : -1;
+      if (!config.sqpoll_cpus.empty()) {
+        socket_config.ring.sqpoll_cpu =
+            config.sqpoll_cpus[i % config.sqpoll_cpus.size()];
+      }
+      w->thread = std::thread(
+          [w, socket_config, go = go] { run_worker(*w, socket_config, go); });
+
+      workers.push_back(std::move(worker));
+    }
+
+    bool ok = true;
+    for (auto &f : ready) {
+      ok = f.get() && ok;
+    }
+
+    if (!ok) {
+      // The previous server sees the channel close unacknowledged and keeps
+      // serving; it still holds the listeners.
+      stop_workers();
+      if (inherited.channel >= 0) {
+        close(inherited.channel);
+      }
+      return false;
+    }
+    handoff::acknowledge(inherited.channel);
+    return true;
+  }
+
+  // Serves until a shutdown signal arrives or a successor takes over, then
+  // drains the workers (see ServerConfig::drain_timeout).
+  void run() {
+    if (workers.empty()) {
+      return;
+    }
+
+    start.set_value(true);
+    started = true;
+    wait_for_shutdown();
+
+    const auto deadline = std::chrono::steady_clock::now() +
+                          config.drain_timeout;
+    for (auto &w : workers) {
+      w->socket->drain(deadline);
+    }
+    for (auto &w : workers) {
+      if (w->thread.joinable()) {
+        w->thread.join();
+      }
+    }
+  }
+
+  size_t worker_count() const noexcept { return workers.size(); }
+
+private:
+  struct Worker {
+    std::thread thread;
+    std::promise<bool> ready;
+    int cpu = -1;
+    Socket *socket = nullptr; // set before `ready`, valid until it drains
+  };
+
+  ServerConfig config;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::promise<bool> start;
+  std::shared_future<bool> go;
+  bool started = false;
+
+  static void run_worker(Worker &w, const SocketConfig &socket_config,
+                         std::shared_future<bool> go) {
+    if (w.cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(w.cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // The ring is created on the thread that drives it so that every
+    // allocation (fd_table, buffers) lands on the worker's local NUMA node.
+    Socket socket(socket_config);
+    const bool ok = socket.init();
+    w.socket = &socket;
+    w.ready.set_value(ok);
+
+    if (!ok || !go.get()) {
+      return;
+    }
+
+    socket.run();
+  }
+
+  static sigset_t shutdown_signals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    return signals;
+  }
+
+  // Blocks until SIGTERM or SIGINT, or until a successor connecting to
+  // handoff_path has acknowledged the listeners.
+  void wait_for_shutdown() {
+    const sigset_t signals = shutdown_signals();
+    const int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    const int offer_fd = config.handoff_path.empty()
+                             ? -1
+                             : handoff::listen(config.handoff_path);
+
+    std::vector<int> listeners;
+    for (const auto &w : workers) {
+      listeners.push_back(w->socket->listener());
+    }
+
+    while (true) {
+      pollfd fds[2] = {{signal_fd, POLLIN, 0}, {offer_fd, POLLIN, 0}};
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      if (fds[0].revents & POLLIN) {
+        signalfd_siginfo info;
+        (void)!read(signal_fd, &info, sizeof(info));
+        break;
+      }
+      if (fds[1].revents & POLLIN) {
+        const int channel = accept4(offer_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        const bool taken_over =
+            channel >= 0 && handoff::offer(channel, listeners);
+        if (channel >= 0) {
+          close(channel);
+        }
+        if (taken_over) {
+          // The socket file now belongs to the successor.
+          break;
+        }
+      }
+    }
+
+    if (signal_fd >= 0) {
+      close(signal_fd);
+    }
+    if (offer_fd >= 0) {
+      close(offer_fd);
+    }
+  }
+
+  void stop_workers() {
+    if (!started) {
+      start.set_value(false);
+      started = true;
+    }
+    for (auto &w : workers) {
+      if (w->thread.joinable()) {
+        w->thread.join();
+      }
+    }
+    workers.clear();
+  }
+
+  static std::vector<int> available_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+
+    if (cpus.empty()) {
+      const unsigned n = std::thread::hardware_concurrency();
+      for (unsigned cpu = 0; cpu < n; ++cpu) {
+        cpus.push_back(static_cast<int>(cpu));
+      }
+    }
+    return cpus;
+  }
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Byte scanners used by the HTTP parser. AVX2 is used when the build enables
+// it (-march=native / -mavx2), SSE2 otherwise on x86-64, and memchr elsewhere.
+namespace simd {
+
+inline size_t find_byte(const char *data, size_t len, char needle) noexcept {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i pattern = _mm256_set1_epi8(needle);
+  for (; i + 32 <= len; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    const unsigned mask = static_cast<unsigned>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)));
+    if (mask != 0) {
+      return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i pattern16 = _mm_set1_epi8(needle);
+  for (; i + 16 <= len; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    const unsigned mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern16)));
+    if (mask != 0) {
+      return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+
+  if (i < len) {
+    const void *hit = std::memchr(data + i, needle, len - i);
+    if (hit) {
+      return static_cast<size_t>(static_cast<const char *>(hit) - data);
+    }
+  }
+  return std::string_view::npos;
+}
+
+inline size_t find_byte(std::string_view s, char needle,
+                        size_t from = 0) noexcept {
+  if (from >= s.size()) {
+    return std::string_view::npos;
+  }
+  const size_t hit = find_byte(s.data() + from, s.size() - from, needle);
+  return hit == std::string_view::npos ? hit : hit + from;
+}
+
+// Position of the next "\r\n" at or after `from`, or npos.
+inline size_t find_crlf(std::string_view s, size_t from = 0) noexcept {
+  while (true) {
+    const size_t cr = find_byte(s, '\r', from);
+    if (cr == std::string_view::npos || cr + 1 >= s.size()) {
+      return std::string_view::npos;
+    }
+    if (s[cr + 1] == '\n') {
+      return cr;
+    }
+    from = cr + 1;
+  }
+}
+
+} // namespace simd
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Single-threaded object pool. Objects are constructed a slab at a time and
+// never destroyed until the pool is; release() only pushes them onto a free
+// list, so whatever capacity they built up (buffers, vectors) is kept for the
+// next user. The free list is LIFO: the most recently released object, the
+// one most likely still in cache, is handed out first.
+//
+// Owners are expected to reset released objects themselves.
+template <typename T, size_t PerSlab = 64> class SlabPool {
+public:
+  SlabPool() = default;
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  T *acquire() {
+    if (free_.empty()) {
+      grow();
+    }
+    T *object = free_.back();
+    free_.pop_back();
+    ++in_use_;
+    return object;
+  }
+
+  void release(T *object) noexcept {
+    // Capacity for every object is reserved in grow(), so this cannot throw.
+    free_.push_back(object);
+    --in_use_;
+  }
+
+  size_t in_use() const noexcept { return in_use_; }
+
+  size_t capacity() const noexcept { return slabs_.size() * PerSlab; }
+
+private:
+  std::vector<std::unique_ptr<T[]>> slabs_;
+  std::vector<T *> free_;
+  size_t in_use_ = 0;
+
+  void grow() {
+    slabs_.push_back(std::make_unique<T[]>(PerSlab));
+    free_.reserve(capacity());
+    T *slab = slabs_.back().get();
+    // Pushed in reverse so the slab is handed out front to back.
+    for (size_t i = PerSlab; i-- > 0;) {
+      free_.push_back(&slab[i]);
+    }
+  }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+// Flat vector that keeps the first N elements inline and only touches the heap
+// once it outgrows them. Restricted to trivially copyable element types, which
+// is all the parser needs (views and small PODs).
+template <typename T, size_t N> class SmallVector {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SmallVector only holds trivially copyable types");
+
+public:
+  SmallVector() = default;
+
+  SmallVector(const SmallVector &other) { assign(other); }
+
+  SmallVector &operator=(const SmallVector &other) {
+    if (this != &other) {
+      clear();
+      assign(other);
+    }
+    return *this;
+  }
+
+  void push_back(const T &value) {
+    if (size_ == capacity_) {
+      grow(capacity_ * 2);
+    }
+    data_[size_++] = value;
+  }
+
+  template <typename... Args> T &emplace_back(Args &&...args) {
+    push_back(T{std::forward<Args>(args)...});
+    return data_[size_ - 1];
+  }
+
+  void pop_back() noexcept { --size_; }
+
+  // Keeps any heap block so a reused vector stays allocation-free.
+  void clear() noexcept { size_ = 0; }
+
+  size_t size() const noexcept { return size_; }
+  size_t capacity() const noexcept { return capacity_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  T *data() noexcept { return data_; }
+  const T *data() const noexcept { return data_; }
+
+  T &operator[](size_t i) noexcept { return data_[i]; }
+  const T &operator[](size_t i) const noexcept { return data_[i]; }
+
+  T &back() noexcept { return data_[size_ - 1]; }
+  const T &back() const noexcept { return data_[size_ - 1]; }
+
+  T *begin() noexcept { return data_; }
+  T *end() noexcept { return data_ + size_; }
+  const T *begin() const noexcept { return data_; }
+  const T *end() const noexcept { return data_ + size_; }
+
+private:
+  T inline_[N];
+  std::unique_ptr<T[]> heap_;
+  T *data_ = inline_;
+  size_t size_ = 0;
+  size_t capacity_ = N;
+
+  void grow(size_t new_capacity) {
+    auto block = std::make_unique<T[]>(new_capacity);
+    std::copy(data_, data_ + size_, block.get());
+    heap_ = std::move(block);
+    data_ = heap_.get();
+    capacity_ = new_capacity;
+  }
+
+  void assign(const SmallVector &other) {
+    if (other.size_ > capacity_) {
+      grow(other.size_);
+    }
+    std::copy(other.begin(), other.end(), data_);
+    size_ = other.size_;
+  }
+};
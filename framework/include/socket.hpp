@@ -1,43 +1,476 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <cstring>
 #include <liburing.h>
 #include <memory>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
+#include "async_handler.hpp"
+#include "async_io.hpp"
 #include "http_request.hpp"
 #include "http_response.hpp"
+#include "input_buffer.hpp"
+#include "metrics.hpp"
+#include "output_buffer.hpp"
+#include "peer_address.hpp"
+#include "request_arena.hpp"
+#include "ring_profile.hpp"
 #include "routes.hpp"
+#include "slab_pool.hpp"
+#include "timer_wheel.hpp"
+#include "websocket.hpp"
 
-enum class EventType { ACCEPT, READ, WRITE };
+// Operation tag carried in the low bits of every SQE's user_data, next to the
+// ConnectionContext pointer, since a connection can have several operations
+// in flight at once (a multishot recv plus a send). DETACHED marks
+// fire-and-forget operations (cancel, shutdown, close) whose result is unused;
+// SPLICE is the file-to-pipe half of sending a file range; TIMER is the
+// worker's periodic tick driving connection deadlines; WAKE signals frames
+// published to the worker's WebSocket hub from another thread. ASYNC
+// completions belong to an operation a coroutine handler awaits; their
+// pointer is the async::Operation rather than a connection. A zero-copy
+// send completes twice as WRITE: once sent, and again (IORING_CQE_F_NOTIF)
+// when the kernel no longer needs its buffer.
+enum class EventType : uint64_t {
+  ACCEPT,
+  READ,
+  WRITE,
+  DETACHED,
+  SPLICE,
+  TIMER,
+  WAKE,
+  ASYNC
+};
+
+struct SocketConfig {
+  static constexpr int DEFAULT_PORT = 8080;
+
+  int port = DEFAULT_PORT;
+  // Lets several workers bind their own listener to the same port; the kernel
+  // then load-balances incoming connections across them.
+  bool reuse_port = false;
+  // Zero-copy requests only carry views into the read buffer; compatibility
+  // mode also fills the owning std::string/std::map members of HttpRequest.
+  bool zero_copy_parse = true;
+  // A request whose header block grows past this is answered with 431.
+  size_t max_header_bytes = 8192;
+  // Per-connection input limit: requests (headers plus body) larger than this
+  // are answered with 413. The input buffer never grows beyond it.
+  size_t max_request_bytes = InputBuffer::DEFAULT_LIMIT;
+  // Input buffered behind a response that is still being sent (pipelined
+  // requests, an early body) past which the connection stops reading until
+  // the response is out, instead of buffering up to max_request_bytes.
+  size_t read_pause_bytes = 64 * 1024;
+  // Shared pool of kernel-selected receive buffers (rounded up to a power of
+  // two). Connections only hold their own input storage while a request is
+  // split across reads.
+  unsigned recv_buffer_count = 1024;
+  size_t recv_buffer_size = 4096;
+  int accept_backlog = SOMAXCONN;
+  // An already listening socket to serve instead of binding one, such as a
+  // listener inherited from the process being replaced (see handoff.hpp).
+  // The socket takes it over; `port` and `reuse_port` are then unused.
+  int listen_fd = -1;
+  // Accept straight into the ring's registered file table
+  // (IORING_FILE_INDEX_ALLOC) so recv/send skip the per-call fd lookup.
+  // Client sockets then have no regular file descriptor.
+  bool direct_descriptors = false;
+  // Ring setup flags and submission mode (see RingProfile).
+  RingOptions ring;
+  // Registered send buffers; 0 disables them. Output held in memory that fits
+  // in one is copied into a buffer and sent with a zero-copy send from it, so
+  // the kernel neither copies nor pins the bytes on each send. A connection
+  // keeps its buffer until the kernel's notification says the data has left
+  // it, and falls back to a plain send meanwhile. Needs Linux 6.0.
+  unsigned send_buffer_count = 0;
+  size_t send_buffer_size = 16 * 1024;
+  // Response bodies of at least this many bytes are sent zero-copy straight
+  // from their own memory, which stays referenced until the kernel's
+  // notification; 0 disables it. Needs Linux 6.0.
+  size_t zero_copy_threshold = 64 * 1024;
+
+  // Connection deadlines; zero disables one. A keep-alive connection waiting
+  // for its next request is closed after `idle_timeout`. Once the first byte
+  // of a request arrives its header block has `header_timeout` to complete,
+  // and the body then has `body_timeout`; more bytes do not extend either,
+  // so a client trickling a request cannot hold the slot. A response that
+  // makes no progress for `idle_timeout` also closes the connection.
+  std::chrono::milliseconds idle_timeout{KEEPALIVE_TIMEOUT * 1000};
+  std::chrono::milliseconds header_timeout{10000};
+  std::chrono::milliseconds body_timeout{30000};
+  // Granularity of the deadlines above; one io_uring timeout per tick.
+  std::chrono::milliseconds timer_tick{250};
+  // Requests served per connection before it is closed; 0 = unlimited.
+  unsigned max_keepalive_requests = KEEPALIVE_MAX;
+  // Silence allowed on an upgraded WebSocket connection; 0 = unlimited.
+  // A closing handshake the peer does not answer is cut after idle_timeout.
+  std::chrono::milliseconds websocket_idle_timeout{0};
+};
 
-struct ConnectionContext {
+// What a connection's timer is currently guarding.
+enum class Deadline : uint8_t { Idle, Header, Body, Send, Close };
+
+// The TimerNode base links the connection into its worker's TimerWheel.
+struct alignas(8) ConnectionContext : TimerNode {
   int fd;
-  EventType event_type;
-  std::vector<char> read_buffer;
-  std::string write_data;
+  InputBuffer input;
+
+  // Responses of one pipelined batch, sent together with a single sendmsg.
+  OutputBuffer output;
+  msghdr write_msg{};
+  bool close_after_write = false;
+
+  // Pipe borrowed from the worker while a file range is being spliced, and
+  // the bytes moved into it that have not reached the socket yet.
+  std::array<int, 2> pipe{-1, -1};
+  size_t pipe_bytes = 0;
+
+  // Registered send buffer holding the head of the output (-1 = none); bytes
+  // [send_offset, send_length) are still to be sent from it. It stays taken
+  // until every zero-copy send has been notified.
+  int send_buffer = -1;
+  uint32_t send_offset = 0;
+  uint32_t send_length = 0;
+
+  // Zero-copy sends whose notification has not arrived yet, and the owners
+  // of the bodies they were sent from, kept alive until then.
+  unsigned send_notifications = 0;
+  std::vector<std::shared_ptr<const void>> zero_copy_owners;
+
+  bool recv_armed = false;
+  bool reads_paused = false; // recv cancelled while output is backed up
+  bool write_in_flight = false;
+  bool closing = false;
+  unsigned pending_ops = 0; // SQEs whose final CQE has not been reaped yet
 
-  static constexpr size_t DEFAULT_BUFFER_SIZE = 4096;
+  Deadline deadline = Deadline::Idle;
+  unsigned requests = 0; // served on this connection so far
 
-  ConnectionContext()
-      : fd(-1), event_type(EventType::READ), read_buffer(DEFAULT_BUFFER_SIZE) {}
+  PeerAddress peer;
+
+  // Set once the connection has been upgraded; frames replace requests.
+  std::unique_ptr<WebSocket> ws;
+
+  // Coroutine handler whose response is next in line. Pipelined requests
+  // behind it wait in `input` until it has been queued.
+  std::shared_ptr<AsyncCall> call;
+
+  static constexpr size_t DEFAULT_BUFFER_SIZE =
+      InputBuffer::DEFAULT_INITIAL_SIZE;
+
+  ConnectionContext() : fd(-1) {}
+
+  // Readies a released context for its next connection, keeping container
+  // capacity so accepts do not allocate.
+  void reset() {
+    fd = -1;
+    input.consume(input.size());
+    input.release();
+    output.clear();
+    write_msg = {};
+    close_after_write = false;
+    pipe = {-1, -1};
+    pipe_bytes = 0;
+    send_buffer = -1;
+    send_offset = 0;
+    send_length = 0;
+    send_notifications = 0;
+    zero_copy_owners.clear();
+    recv_armed = false;
+    reads_paused = false;
+    write_in_flight = false;
+    closing = false;
+    pending_ops = 0;
+    deadline = Deadline::Idle;
+    requests = 0;
+    peer.reset(-1);
+    ws.reset();
+    call.reset();
+  }
 };
 
 class Socket {
 public:
-  static constexpr int DEFAULT_PORT = 8080;
+  static constexpr int DEFAULT_PORT = SocketConfig::DEFAULT_PORT;
   static constexpr int QUEUE_DEPTH = 4096;
   static constexpr int MAX_FDS = 32768;
+  // Upper bound on responses gathered into one sendmsg (well below IOV_MAX).
+  static constexpr size_t MAX_PIPELINE_BATCH = 64;
+  // Bytes of a file range moved per splice round (the default pipe size).
+  static constexpr size_t SPLICE_CHUNK = 64 * 1024;
+  // Largest single send; an SQE's length is 32 bits.
+  static constexpr size_t MAX_SEND = size_t(1) << 30;
 
-  Socket() : server_fd(-1) { fd_table.resize(MAX_FDS); }
+  explicit Socket(const SocketConfig &config = {})
+      : config(config), server_fd(-1), timers(config.timer_tick),
+        keep_alive_field(render_keep_alive(config)) {
+    fd_table.resize(MAX_FDS);
+  }
 
   ~Socket() { cleanup(); }
 
   bool init() {
+    server_fd = config.listen_fd;
+    if (server_fd < 0 && !open_listener()) {
+      return false;
+    }
+
+    if (!init_ring(ring, QUEUE_DEPTH, config.ring)) {
+      close(server_fd);
+      server_fd = -1;
+      return false;
+    }
+    ring_initialized = true;
+
+    setup_buffer_ring();
+    zero_copy = probe_zero_copy();
+    setup_send_buffers();
+    direct_fds = config.direct_descriptors &&
+                 io_uring_register_files_sparse(&ring, MAX_FDS) == 0;
+
+    return true;
+  }
+
+  void run() {
+    stats = &Metrics::global().local();
+    const AsyncIo::Scope bound(io);
+    submit_accept();
+    submit_tick();
+    submit_wake();
+    io_uring_submit(&ring);
+
+    struct io_uring_cqe *cqe;
+    while (!stopped) {
+      // Everything queued while handling the last batch goes to the kernel
+      // in the same io_uring_enter that waits for the next one (which is
+      // also where a DeferTaskrun ring runs its completion work).
+      io_uring_submit_and_wait(&ring, 1);
+
+      unsigned head;
+      unsigned count = 0;
+
+      io_uring_for_each_cqe(&ring, head, cqe) {
+        handle_completion(cqe);
+        count++;
+      }
+
+      if (count > 0) {
+        io_uring_cq_advance(&ring, count);
+        flush_websockets();
+      }
+    }
+  }
+
+  // The listening socket, until run() has drained.
+  int listener() const noexcept { return server_fd; }
+
+  // Asks run() to wind down; callable from any thread. The worker stops
+  // accepting, lets the requests in flight finish with `Connection: close`
+  // and returns once its connections are gone, or at `deadline` cutting
+  // those still open. It notices the request on its next timer tick.
+  void drain(TimerWheel::Clock::time_point deadline) noexcept {
+    drain_deadline.store(deadline.time_since_epoch().count(),
+                         std::memory_order_release);
+  }
+
+private:
+  static constexpr uint64_t TAG_MASK = 0x7;
+  static constexpr int BUFFER_GROUP = 0;
+
+  SocketConfig config;
+  struct io_uring ring;
+  bool ring_initialized = false;
+  int server_fd;
+  WebSocketHub hub; // outlives the connections in fd_table
+  // Every context this worker has allocated; fd_table points at the live ones.
+  SlabPool<ConnectionContext> contexts;
+  std::vector<ConnectionContext *> fd_table;
+  // Scratch storage for the requests of one batch, rewound after each.
+  RequestArena arena;
+  // Where coroutine handlers on this worker submit their operations.
+  AsyncIo io{ring, static_cast<uint64_t>(EventType::ASYNC),
+             make_user_data(nullptr, EventType::DETACHED)};
+  uint64_t wake_count = 0;
+
+  // Set by drain(): a TimerWheel::Clock count, 0 while serving normally.
+  std::atomic<TimerWheel::Clock::rep> drain_deadline{0};
+  bool draining = false;
+  bool stopped = false; // run() returns
+
+  bool direct_fds = false;
+  bool zero_copy = false; // the kernel has IORING_OP_SEND_ZC
+
+  struct io_uring_buf_ring *buf_ring = nullptr;
+  std::unique_ptr<char[]> buf_pool;
+  unsigned buf_count = 0;
+
+  // Registered send buffers no connection holds (see
+  // SocketConfig::send_buffer_count).
+  std::unique_ptr<char[]> send_pool;
+  std::vector<unsigned> free_send_buffers;
+
+  // Empty pipes for splicing file bodies, handed out per connection.
+  std::vector<std::array<int, 2>> pipe_pool;
+
+  // This worker's counters; set by run() on the thread driving the ring.
+  WorkerMetrics *stats = nullptr;
+
+  // Connection deadlines, advanced by a single re-armed ring timeout.
+  TimerWheel timers;
+  __kernel_timespec tick_spec{};
+
+  // Sent with every persistent response (see render_keep_alive()).
+  std::string keep_alive_field;
+
+  static uint64_t make_user_data(ConnectionContext *ctx, EventType type) {
+    return reinterpret_cast<uintptr_t>(ctx) | static_cast<uint64_t>(type);
+  }
+
+  // Falls back to per-connection recv buffers when the kernel lacks provided
+  // buffer rings (< 5.19) or multishot recv (< 6.0).
+  void setup_buffer_ring() {
+    unsigned count = 1;
+    while (count < config.recv_buffer_count && count < 32768) {
+      count <<= 1;
+    }
+
+    int ret = 0;
+    buf_ring = io_uring_setup_buf_ring(&ring, count, BUFFER_GROUP, 0, &ret);
+    if (!buf_ring) {
+      return;
+    }
+
+    buf_count = count;
+    buf_pool = std::make_unique<char[]>(count * config.recv_buffer_size);
+    for (unsigned bid = 0; bid < count; ++bid) {
+      io_uring_buf_ring_add(buf_ring, buffer_at(bid),
+                            static_cast<unsigned>(config.recv_buffer_size),
+                            static_cast<unsigned short>(bid),
+                            io_uring_buf_ring_mask(count), static_cast<int>(bid));
+    }
+    io_uring_buf_ring_advance(buf_ring, static_cast<int>(count));
+  }
+
+  char *buffer_at(unsigned bid) const {
+    return buf_pool.get() + static_cast<size_t>(bid) * config.recv_buffer_size;
+  }
+
+  void recycle_buffer(unsigned bid) {
+    io_uring_buf_ring_add(buf_ring, buffer_at(bid),
+                          static_cast<unsigned>(config.recv_buffer_size),
+                          static_cast<unsigned short>(bid),
+                          io_uring_buf_ring_mask(buf_count), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+  }
+
+  bool probe_zero_copy() {
+    io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    const bool supported =
+        probe && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+    io_uring_free_probe(probe);
+    return supported;
+  }
+
+  // Size from which a body is sent zero-copy, if ever.
+  size_t zero_copy_split() const {
+    return zero_copy && config.zero_copy_threshold > 0
+               ? config.zero_copy_threshold
+               : SIZE_MAX;
+  }
+
+  // Registers the send buffer pool, unless the kernel has no zero-copy send
+  // to use it with.
+  void setup_send_buffers() {
+    if (!zero_copy || config.send_buffer_count == 0 ||
+        config.send_buffer_size == 0) {
+      return;
+    }
+
+    const unsigned count = std::min(config.send_buffer_count, 16384u);
+    send_pool = std::make_unique<char[]>(count * config.send_buffer_size);
+    std::vector<iovec> iov(count);
+    for (unsigned i = 0; i < count; ++i) {
+      iov[i] = {send_buffer_at(i), config.send_buffer_size};
+    }
+    if (io_uring_register_buffers(&ring, iov.data(), count) != 0) {
+      send_pool.reset();
+      return;
+    }
+    free_send_buffers.reserve(count);
+    for (unsigned i = count; i > 0; --i) {
+      free_send_buffers.push_back(i - 1);
+    }
+  }
+
+  char *send_buffer_at(unsigned index) const {
+    return send_pool.get() +
+           static_cast<size_t>(index) * config.send_buffer_size;
+  }
+
+  // Copies the output's memory segments at the cursor into a free send
+  // buffer, if the connection holds none and they fit.
+  bool fill_send_buffer(ConnectionContext *ctx) {
+    if (free_send_buffers.empty() || ctx->send_buffer >= 0) {
+      return false;
+    }
+    const std::vector<iovec> &iov =
+        ctx->output.pending_iovecs(zero_copy_split());
+    size_t total = 0;
+    for (const iovec &segment : iov) {
+      total += segment.iov_len;
+    }
+    if (total == 0 || total > config.send_buffer_size) {
+      return false;
+    }
+
+    const unsigned index = free_send_buffers.back();
+    free_send_buffers.pop_back();
+    char *out = send_buffer_at(index);
+    for (const iovec &segment : iov) {
+      std::memcpy(out, segment.iov_base, segment.iov_len);
+      out += segment.iov_len;
+    }
+    ctx->send_buffer = static_cast<int>(index);
+    ctx->send_offset = 0;
+    ctx->send_length = static_cast<uint32_t>(total);
+    return true;
+  }
+
+  // Returns the connection's send buffer to the pool once nothing is left to
+  // send from it and the kernel has released it.
+  void release_send_buffer(ConnectionContext *ctx) {
+    if (ctx->send_buffer < 0 || ctx->send_length > 0 ||
+        ctx->send_notifications > 0) {
+      return;
+    }
+    free_send_buffers.push_back(static_cast<unsigned>(ctx->send_buffer));
+    ctx->send_buffer = -1;
+    ctx->send_offset = 0;
+  }
+
+  // Never drops a submission: flushes the SQ to the kernel when it is full.
+  struct io_uring_sqe *get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    while (!sqe) {
+      io_uring_submit(&ring);
+      sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+  }
+
+  bool open_listener() {
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
       return false;
@@ -51,6 +484,14 @@ public:
       return false;
     }
 
+    if (config.reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT,
+                                        &opt, sizeof(opt)) < 0) {
+      close(server_fd);
+      server_fd = -1;
+      return false;
+    }
+
+    // Accepted sockets inherit TCP_NODELAY from the listener.
     if (setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) <
         0) {
       close(server_fd);
@@ -61,7 +502,7 @@ public:
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(DEFAULT_PORT);
+    addr.sin_port = htons(config.port);
 
     if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
       close(server_fd);
@@ -69,14 +510,7 @@ public:
       return false;
     }
 
-    if (listen(server_fd, SOMAXCONN) < 0) {
-      close(server_fd);
-      server_fd = -1;
-      return false;
-    }
-
-    int ret = io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
-    if (ret != 0) {
+    if (listen(server_fd, config.accept_backlog) < 0) {
       close(server_fd);
       server_fd = -1;
       return false;
@@ -85,94 +519,433 @@ public:
     return true;
   }
 
-  void run() {
-    submit_accept();
-    io_uring_submit(&ring);
+  // Client sockets are ring-registered descriptors in direct mode.
+  void use_client_fd(struct io_uring_sqe *sqe) const {
+    if (direct_fds) {
+      sqe->flags |= IOSQE_FIXED_FILE;
+    }
+  }
 
-    struct io_uring_cqe *cqe;
-    while (true) {
-      int ret = io_uring_wait_cqe(&ring, &cqe);
-      if (ret < 0)
-        continue;
+  // One multishot accept stays armed for the lifetime of the listener.
+  void submit_accept() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (direct_fds) {
+      io_uring_prep_multishot_accept_direct(sqe, server_fd, nullptr, nullptr,
+                                            0);
+    } else {
+      io_uring_prep_multishot_accept(sqe, server_fd, nullptr, nullptr, 0);
+    }
+    io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::ACCEPT));
+  }
 
-      unsigned head;
-      int count = 0;
+  void submit_tick() {
+    const auto tick = timers.tick();
+    tick_spec.tv_sec = tick.count() / 1000;
+    tick_spec.tv_nsec = (tick.count() % 1000) * 1000000;
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &tick_spec, 0, 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::TIMER));
+  }
 
-      io_uring_for_each_cqe(&ring, head, cqe) {
-        handle_completion(cqe);
-        count++;
-      }
+  // Closes every connection whose deadline has passed, then re-arms.
+  void handle_tick() {
+    const auto now = TimerWheel::Clock::now();
+    timers.advance(now, [this](TimerNode &node) {
+      clean_conn(static_cast<ConnectionContext *>(&node));
+    });
+    if (drain_deadline.load(std::memory_order_acquire) != 0) {
+      check_drain(now);
+    }
+    submit_tick();
+  }
 
-      if (count > 0) {
-        io_uring_cq_advance(&ring, count);
-        io_uring_submit(&ring);
+  // Runs a drain requested through drain(), from the first tick that sees
+  // it until no connection is left or the deadline has passed.
+  void check_drain(TimerWheel::Clock::time_point now) {
+    if (!draining) {
+      start_drain();
+    }
+    const TimerWheel::Clock::time_point deadline(
+        TimerWheel::Clock::duration(drain_deadline.load()));
+    if (now >= deadline) {
+      for (ConnectionContext *ctx : fd_table) {
+        clean_conn(ctx);
       }
     }
+    stopped = now >= deadline || contexts.in_use() == 0;
   }
 
-private:
-  struct io_uring ring;
-  int server_fd;
-  std::vector<std::unique_ptr<ConnectionContext>> fd_table;
+  // Cancels the accept; the listener is closed when that completes. Every
+  // connection closes after its next response (see queue_response()), so a
+  // client is never cut off while sending a request on it; those that send
+  // none go at their idle deadline. WebSockets are sent a 1001 close.
+  void start_drain() {
+    draining = true;
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_cancel64(sqe, make_user_data(nullptr, EventType::ACCEPT), 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::DETACHED));
 
-  void submit_accept() {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    if (!sqe)
+    for (ConnectionContext *ctx : fd_table) {
+      if (ctx && ctx->ws && !ctx->closing) {
+        ctx->ws->close(websocket::close_code::GOING_AWAY);
+      }
+    }
+  }
+
+  // Points the connection's timer at `kind`. Header and body deadlines run
+  // from the moment they are first armed; the others restart every call.
+  void arm_deadline(ConnectionContext *ctx, Deadline kind) {
+    if ((kind == Deadline::Header || kind == Deadline::Body) &&
+        ctx->deadline == kind && ctx->scheduled()) {
       return;
+    }
+    ctx->deadline = kind;
+    std::chrono::milliseconds timeout = config.idle_timeout;
+    if (kind == Deadline::Header) {
+      timeout = config.header_timeout;
+    } else if (kind == Deadline::Body) {
+      timeout = config.body_timeout;
+    } else if (kind == Deadline::Idle && ctx->ws) {
+      timeout = config.websocket_idle_timeout;
+    }
+    if (timeout.count() > 0) {
+      timers.schedule(*ctx, timeout);
+    } else {
+      timers.cancel(*ctx);
+    }
+  }
 
-    ConnectionContext *ctx = new ConnectionContext();
-    ctx->event_type = EventType::ACCEPT;
+  void submit_wake() {
+    if (hub.event_fd() < 0) {
+      return;
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_read(sqe, hub.event_fd(), &wake_count, sizeof(wake_count),
+                       0);
+    io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::WAKE));
+  }
 
-    io_uring_prep_accept(sqe, server_fd, nullptr, nullptr, 0);
-    io_uring_sqe_set_data(sqe, ctx);
+  void handle_wake() {
+    hub.drain();
+    submit_wake();
   }
 
+  // Arms a multishot recv on the shared buffer pool, or a single recv into
+  // the connection's own input storage when the kernel has no pool support.
   void submit_read(ConnectionContext *ctx) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    if (!sqe)
-      return;
-    ctx->event_type = EventType::READ;
-    io_uring_prep_recv(sqe, ctx->fd, ctx->read_buffer.data(),
-                       ctx->read_buffer.size(), 0);
-    io_uring_sqe_set_data(sqe, ctx);
+    if (ctx->reads_paused) {
+      ctx->reads_paused = false;
+      ctx->input.set_limit(config.max_request_bytes);
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (buf_ring) {
+      io_uring_prep_recv_multishot(sqe, ctx->fd, nullptr, 0, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+    } else {
+      const InputBuffer::Span span =
+          ctx->input.prepare(ConnectionContext::DEFAULT_BUFFER_SIZE);
+      io_uring_prep_recv(sqe, ctx->fd, span.data, span.size, 0);
+    }
+    use_client_fd(sqe);
+
+    io_uring_sqe_set_data64(sqe, make_user_data(ctx, EventType::READ));
+    ctx->recv_armed = true;
+    ctx->pending_ops++;
   }
 
+  // Sends the next part of the output: the memory segments up to the next
+  // file range or large body with one sendmsg (or from a send buffer), a
+  // large body zero-copy, or a file range through a pipe.
   void submit_write(ConnectionContext *ctx) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    if (!sqe)
+    if (ctx->pipe_bytes > 0 || ctx->output.pending_file()) {
+      submit_splice(ctx);
       return;
-    ctx->event_type = EventType::WRITE;
-    io_uring_prep_send(sqe, ctx->fd, ctx->write_data.data(),
-                       ctx->write_data.size(), MSG_NOSIGNAL);
-    io_uring_sqe_set_data(sqe, ctx);
+    }
+
+    struct io_uring_sqe *sqe = get_sqe();
+
+    const size_t split = zero_copy_split();
+    const OutputBuffer::SharedBytes *body = nullptr;
+    if (ctx->send_length > 0) {
+      const auto index = static_cast<unsigned>(ctx->send_buffer);
+      io_uring_prep_send_zc_fixed(
+          sqe, ctx->fd, send_buffer_at(index) + ctx->send_offset,
+          ctx->send_length - ctx->send_offset, MSG_NOSIGNAL, 0, index);
+    } else if ((body = ctx->output.pending_shared(split))) {
+      io_uring_prep_send_zc(sqe, ctx->fd, body->bytes.data(),
+                            std::min(body->bytes.size(), MAX_SEND),
+                            MSG_NOSIGNAL, 0);
+      if (ctx->zero_copy_owners.empty() ||
+          ctx->zero_copy_owners.back() != body->owner) {
+        ctx->zero_copy_owners.push_back(body->owner);
+      }
+    } else if (fill_send_buffer(ctx)) {
+      const auto index = static_cast<unsigned>(ctx->send_buffer);
+      io_uring_prep_send_zc_fixed(sqe, ctx->fd, send_buffer_at(index),
+                                  ctx->send_length, MSG_NOSIGNAL, 0, index);
+    } else {
+      const std::vector<iovec> &iov = ctx->output.pending_iovecs(split);
+      ctx->write_msg = {};
+      ctx->write_msg.msg_iov = const_cast<iovec *>(iov.data());
+      ctx->write_msg.msg_iovlen = iov.size();
+      io_uring_prep_sendmsg(sqe, ctx->fd, &ctx->write_msg, MSG_NOSIGNAL);
+    }
+    arm_deadline(ctx, Deadline::Send);
+    use_client_fd(sqe);
+    io_uring_sqe_set_data64(sqe, make_user_data(ctx, EventType::WRITE));
+    ctx->write_in_flight = true;
+    ctx->pending_ops++;
+  }
+
+  // file -> pipe, then (on completion) pipe -> socket. Bytes already in the
+  // pipe are flushed to the socket before more of the file is read.
+  void submit_splice(ConnectionContext *ctx) {
+    if (ctx->pipe[0] < 0 && !acquire_pipe(ctx)) {
+      clean_conn(ctx);
+      return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe();
+    if (ctx->pipe_bytes > 0) {
+      io_uring_prep_splice(sqe, ctx->pipe[0], -1, ctx->fd, -1,
+                           static_cast<unsigned>(ctx->pipe_bytes), 0);
+      use_client_fd(sqe);
+      io_uring_sqe_set_data64(sqe, make_user_data(ctx, EventType::WRITE));
+    } else {
+      const FileRange *range = ctx->output.pending_file();
+      io_uring_prep_splice(
+          sqe, range->fd, range->offset, ctx->pipe[1], -1,
+          static_cast<unsigned>(std::min(range->length, SPLICE_CHUNK)), 0);
+      io_uring_sqe_set_data64(sqe, make_user_data(ctx, EventType::SPLICE));
+    }
+    arm_deadline(ctx, Deadline::Send);
+    ctx->write_in_flight = true;
+    ctx->pending_ops++;
+  }
+
+  bool acquire_pipe(ConnectionContext *ctx) {
+    if (!pipe_pool.empty()) {
+      ctx->pipe = pipe_pool.back();
+      pipe_pool.pop_back();
+      return true;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      return false;
+    }
+    ctx->pipe = {fds[0], fds[1]};
+    return true;
+  }
+
+  // Returns a drained pipe to the pool; one still holding bytes is closed.
+  void release_pipe(ConnectionContext *ctx) {
+    if (ctx->pipe[0] < 0) {
+      return;
+    }
+    if (ctx->pipe_bytes == 0) {
+      pipe_pool.push_back(ctx->pipe);
+    } else {
+      close(ctx->pipe[0]);
+      close(ctx->pipe[1]);
+    }
+    ctx->pipe = {-1, -1};
+    ctx->pipe_bytes = 0;
   }
 
   void handle_completion(struct io_uring_cqe *cqe) {
-    auto *ctx = static_cast<ConnectionContext *>(io_uring_cqe_get_data(cqe));
-    int res = cqe->res;
+    const uint64_t user_data = io_uring_cqe_get_data64(cqe);
+    auto *ctx = reinterpret_cast<ConnectionContext *>(user_data & ~TAG_MASK);
+    const auto type = static_cast<EventType>(user_data & TAG_MASK);
+
+    switch (type) {
+    case EventType::ACCEPT:
+      handle_accept(cqe->res, cqe->flags);
+      break;
+    case EventType::READ:
+      handle_read(ctx, cqe->res, cqe->flags);
+      break;
+    case EventType::WRITE:
+      if (cqe->flags & IORING_CQE_F_NOTIF) {
+        handle_send_notification(ctx);
+        break;
+      }
+      if (cqe->flags & IORING_CQE_F_MORE) {
+        // A zero-copy send; its notification keeps the context alive.
+        ctx->send_notifications++;
+        ctx->pending_ops++;
+      }
+      handle_write(ctx, cqe->res);
+      break;
+    case EventType::SPLICE:
+      handle_splice(ctx, cqe->res);
+      break;
+    case EventType::TIMER:
+      handle_tick();
+      break;
+    case EventType::WAKE:
+      handle_wake();
+      break;
+    case EventType::ASYNC:
+      AsyncIo::resume(
+          reinterpret_cast<async::Operation *>(user_data & ~TAG_MASK),
+          cqe->res);
+      break;
+    case EventType::DETACHED:
+      break;
+    }
+  }
+
+  void handle_accept(int res, unsigned flags) {
+    if (res >= 0) {
+      const int client_fd = res;
+
+      if (client_fd < MAX_FDS) {
+        // Released contexts go back to the worker's slab with their buffers,
+        // so steady state accepts reuse one instead of allocating.
+        ConnectionContext *ctx = contexts.acquire();
+        fd_table[client_fd] = ctx;
+        stats->accepts.add();
+        ctx->fd = client_fd;
+        ctx->peer.reset(direct_fds ? -1 : client_fd);
+        ctx->input.set_limit(config.max_request_bytes);
+        arm_deadline(ctx, Deadline::Idle);
+        submit_read(ctx);
+      } else {
+        close(client_fd);
+      }
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+      if (!draining) {
+        submit_accept();
+      } else if (server_fd >= 0) {
+        close(server_fd);
+        server_fd = -1;
+      }
+    }
+  }
+
+  void handle_read(ConnectionContext *ctx, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+      ctx->recv_armed = false;
+      ctx->pending_ops--;
+    }
+
+    std::string_view chunk;
+    int bid = -1;
+    if (flags & IORING_CQE_F_BUFFER) {
+      bid = static_cast<int>(flags >> IORING_CQE_BUFFER_SHIFT);
+      chunk = std::string_view(buffer_at(static_cast<unsigned>(bid)),
+                               res > 0 ? static_cast<size_t>(res) : 0);
+    }
 
-    if (!ctx)
+    if (ctx->closing) {
+      if (bid >= 0) {
+        recycle_buffer(static_cast<unsigned>(bid));
+      }
+      release_conn(ctx);
       return;
+    }
 
-    if (ctx->event_type == EventType::ACCEPT) {
-      if (res >= 0) {
-        int client_fd = res;
+    if (res == -ENOBUFS || res == -ECANCELED) {
+      // The multishot recv has ended: the pool was momentarily exhausted
+      // (buffers are recycled as soon as their completion is handled), or
+      // pause_reads() stopped it. Re-arm unless output is still backed up.
+      if (!ctx->reads_paused || !busy(ctx)) {
+        submit_read(ctx);
+      }
+      return;
+    }
 
-        int opt = 1;
-        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (res <= 0) {
+      if (bid >= 0) {
+        recycle_buffer(static_cast<unsigned>(bid));
+      }
+      clean_conn(ctx);
+      return;
+    }
+    stats->bytes_in.add(static_cast<uint64_t>(res));
 
-        if (client_fd < MAX_FDS) {
-          auto conn = std::make_unique<ConnectionContext>();
-          conn->fd = client_fd;
-          ConnectionContext *ptr = conn.get();
-          fd_table[client_fd] = std::move(conn);
-          submit_read(ptr);
-        } else {
-          close(client_fd);
+    if (ctx->ws) {
+      // Frames are read and answered independently of writes in flight.
+      if (bid < 0) {
+        ctx->input.commit(static_cast<size_t>(res));
+        serve_websocket(ctx, ctx->input.mutable_data(), ctx->input.size(),
+                        true);
+      } else if (!ctx->input.empty()) {
+        const bool stored = ctx->input.append(chunk);
+        recycle_buffer(static_cast<unsigned>(bid));
+        if (!stored) {
+          clean_conn(ctx);
+          return;
         }
+        serve_websocket(ctx, ctx->input.mutable_data(), ctx->input.size(),
+                        true);
+      } else {
+        serve_websocket(ctx, buffer_at(static_cast<unsigned>(bid)),
+                        chunk.size(), false);
+        recycle_buffer(static_cast<unsigned>(bid));
+      }
+      if (!ctx->closing && !ctx->recv_armed) {
+        submit_read(ctx);
       }
-      delete ctx;
-      submit_accept();
+      return;
+    }
+
+    if (bid < 0) {
+      ctx->input.commit(static_cast<size_t>(res));
+      if (!busy(ctx)) {
+        serve_buffered(ctx, ctx->input.data(), true);
+      }
+    } else if (busy(ctx) || !ctx->input.empty()) {
+      // Keep ordering behind queued bytes or a response not yet sent.
+      const bool stored = ctx->input.append(chunk);
+      recycle_buffer(static_cast<unsigned>(bid));
+      if (!stored) {
+        clean_conn(ctx);
+        return;
+      }
+      if (!busy(ctx)) {
+        serve_buffered(ctx, ctx->input.data(), true);
+      } else if (ctx->input.size() >= config.read_pause_bytes) {
+        pause_reads(ctx);
+      }
+    } else {
+      // Common case: parse straight out of the kernel buffer; only an
+      // incomplete tail is copied into the connection's own storage.
+      serve_buffered(ctx, chunk, false);
+      recycle_buffer(static_cast<unsigned>(bid));
+    }
+
+    if (!ctx->closing && !ctx->recv_armed && !busy(ctx)) {
+      submit_read(ctx);
+    }
+  }
+
+  // Stops the multishot recv of a connection whose responses are backed
+  // up; submit_read() resumes once they have been sent. What the kernel has
+  // already received into the buffer pool by the time the cancel lands
+  // still arrives, so the input limit is lifted by the pool's size meanwhile.
+  void pause_reads(ConnectionContext *ctx) {
+    if (!ctx->recv_armed || ctx->reads_paused) {
+      return;
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_cancel64(sqe, make_user_data(ctx, EventType::READ), 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::DETACHED));
+    ctx->reads_paused = true;
+    ctx->input.set_limit(config.max_request_bytes +
+                         buf_count * config.recv_buffer_size);
+  }
+
+  void handle_write(ConnectionContext *ctx, int res) {
+    ctx->pending_ops--;
+    ctx->write_in_flight = false;
+
+    if (ctx->closing) {
+      release_conn(ctx);
       return;
     }
 
@@ -180,33 +953,414 @@ private:
       clean_conn(ctx);
       return;
     }
+    stats->bytes_out.add(static_cast<uint64_t>(res));
 
-    if (ctx->event_type == EventType::READ) {
-      HttpRequest req;
-      std::string_view data(ctx->read_buffer.data(), res);
+    if (ctx->pipe_bytes > 0) {
+      ctx->pipe_bytes -= static_cast<size_t>(res);
+    } else if (ctx->send_length > 0) {
+      ctx->send_offset += static_cast<uint32_t>(res);
+      if (ctx->send_offset == ctx->send_length) {
+        ctx->send_length = 0;
+        release_send_buffer(ctx);
+      }
+    }
+    ctx->output.advance(static_cast<size_t>(res));
+    if (ctx->pipe_bytes > 0 || !ctx->output.done()) {
+      submit_write(ctx);
+      return;
+    }
 
-      auto [ok, consumed] = req.parse(data);
+    ctx->output.clear();
+    release_pipe(ctx);
 
-      if (ok) {
-        HttpResponse resp = setup_router(req);
-        ctx->write_data = resp.to_string();
-        submit_write(ctx);
-      } else {
+    if (ctx->close_after_write) {
+      clean_conn(ctx);
+      return;
+    }
+
+    if (ctx->ws) {
+      // Frames that arrived with the upgrade request or during the 101.
+      if (!ctx->input.empty()) {
+        serve_websocket(ctx, ctx->input.mutable_data(), ctx->input.size(),
+                        true);
+      }
+      write_websocket(ctx);
+      if (!ctx->closing && !ctx->recv_armed) {
         submit_read(ctx);
       }
-    } else if (ctx->event_type == EventType::WRITE) {
+      return;
+    }
+
+    if (ctx->call) {
+      deliver_call(ctx);
+    } else if (!ctx->input.empty()) {
+      serve_buffered(ctx, ctx->input.data(), true);
+    } else {
+      arm_deadline(ctx, Deadline::Idle);
+    }
+
+    if (!ctx->closing && !ctx->recv_armed && !busy(ctx)) {
       submit_read(ctx);
     }
   }
 
+  // The kernel is done with the memory of a zero-copy send.
+  void handle_send_notification(ConnectionContext *ctx) {
+    ctx->pending_ops--;
+    if (--ctx->send_notifications == 0) {
+      ctx->zero_copy_owners.clear();
+    }
+    if (ctx->closing) {
+      release_conn(ctx);
+      return;
+    }
+    release_send_buffer(ctx);
+  }
+
+  void handle_splice(ConnectionContext *ctx, int res) {
+    ctx->pending_ops--;
+    ctx->write_in_flight = false;
+
+    if (ctx->closing) {
+      release_conn(ctx);
+      return;
+    }
+
+    if (res <= 0) {
+      // The file shrank under us; the promised Content-Length cannot be met.
+      clean_conn(ctx);
+      return;
+    }
+
+    ctx->pipe_bytes = static_cast<size_t>(res);
+    submit_splice(ctx);
+  }
+
+  // Serves every complete request in `buffered` (up to one batch) and sends
+  // all responses at once. `from_input` tells whether `buffered` is the
+  // connection's input buffer or a transient kernel buffer, whose unparsed
+  // tail has to be copied before the buffer goes back to the ring.
+  void serve_buffered(ConnectionContext *ctx, std::string_view buffered,
+                      bool from_input) {
+    RequestArena::Scope batch_scope(arena);
+    size_t offset = 0;
+    size_t batch = 0;
+    ParseResult pending;
+
+    while (offset < buffered.size() && batch < MAX_PIPELINE_BATCH) {
+      HttpRequest req;
+      req.peer = &ctx->peer;
+      const std::string_view data = buffered.substr(offset);
+
+      pending = config.zero_copy_parse ? req.parse_view(data) : req.parse(data);
+      if (!pending.success) {
+        break;
+      }
+      offset += pending.bytes_consumed;
+
+      HttpResponse resp = setup_router(req);
+      if (resp.upgrade && resp.status_code == 101) {
+        // Whatever follows the handshake is WebSocket frames.
+        stats->count_status(resp.status_code);
+        resp.write_to(ctx->output);
+        upgrade(ctx, std::move(resp.upgrade));
+        break;
+      }
+      ++batch;
+      if (resp.deferred) {
+        if (!start_call(ctx, resp)) {
+          break; // the rest waits for the handler
+        }
+      } else {
+        queue_response(ctx, req, resp);
+      }
+
+      if (ctx->close_after_write) {
+        offset = buffered.size();
+        break;
+      }
+    }
+
+    if (from_input) {
+      ctx->input.consume(offset);
+    } else if (offset < buffered.size() &&
+               !ctx->input.append(buffered.substr(offset))) {
+      queue_error(ctx, 413, "Payload Too Large");
+    }
+
+    if (!ctx->ws && !ctx->call && !ctx->close_after_write &&
+        !pending.success && !ctx->input.empty()) {
+      reject_oversized(ctx, pending);
+    }
+
+    if (!ctx->output.empty()) {
+      submit_write(ctx);
+      return;
+    }
+    if (ctx->call) {
+      // Handlers bound their own waits (see async::Op::timeout()).
+      timers.cancel(*ctx);
+    } else if (ctx->input.empty()) {
+      if (buf_ring) {
+        // Idle connections keep no input storage of their own.
+        ctx->input.release();
+      }
+      arm_deadline(ctx, Deadline::Idle);
+    } else {
+      arm_deadline(ctx, pending.header_bytes == 0 ? Deadline::Header
+                                                  : Deadline::Body);
+    }
+  }
+
+  // "Keep-Alive: timeout=<idle seconds>, max=<requests>\r\n", leaving out
+  // the parameters this socket does not enforce; empty if it enforces none.
+  static std::string render_keep_alive(const SocketConfig &config) {
+    const auto timeout =
+        std::chrono::duration_cast<std::chrono::seconds>(config.idle_timeout)
+            .count();
+    std::string field;
+    if (timeout > 0) {
+      field = "timeout=" + std::to_string(timeout);
+    }
+    if (config.max_keepalive_requests > 0) {
+      field += field.empty() ? "max=" : ", max=";
+      field += std::to_string(config.max_keepalive_requests);
+    }
+    return field.empty() ? field : "Keep-Alive: " + field + "\r\n";
+  }
+
+  // Applies the connection's rules (keep-alive limit and draining, HEAD,
+  // HTTP/1.0 framing) to the response to `req` and queues it for sending.
+  void queue_response(ConnectionContext *ctx, const HttpRequest &req,
+                      HttpResponse &resp) {
+    if (!req.wants_keep_alive() ||
+        (config.max_keepalive_requests > 0 &&
+         ++ctx->requests >= config.max_keepalive_requests) ||
+        draining) {
+      resp.keep_alive = false;
+    }
+    if (req.method_id == HttpMethod::HEAD) {
+      resp.head_only = true;
+    }
+    if (resp.chunked && req.version_view != "HTTP/1.1") {
+      resp.chunked = false;
+    }
+    stats->count_status(resp.status_code);
+    resp.keep_alive_field = keep_alive_field;
+    resp.write_to(ctx->output);
+    if (!resp.keep_alive) {
+      ctx->close_after_write = true;
+    }
+  }
+
+  // Runs the coroutine handler behind a placeholder response. False if it
+  // suspended; its response is then queued by deliver_call() once it has
+  // finished, and the connection serves nothing else meanwhile.
+  bool start_call(ConnectionContext *ctx, HttpResponse &placeholder) {
+    std::shared_ptr<AsyncCall> call = std::move(placeholder.deferred);
+    call->keep_headers(placeholder.headers);
+    call->start();
+    if (call->finished()) {
+      queue_response(ctx, call->request(), call->response());
+      return true;
+    }
+    call->on_finish([this, ctx] { deliver_call(ctx); });
+    ctx->call = std::move(call);
+    return false;
+  }
+
+  // Queues the response of the connection's finished coroutine handler
+  // behind whatever is still being sent, then carries on with the requests
+  // that were pipelined behind it.
+  void deliver_call(ConnectionContext *ctx) {
+    if (ctx->closing || ctx->write_in_flight) {
+      return; // handle_write() comes back here
+    }
+    if (!ctx->call->finished()) {
+      timers.cancel(*ctx);
+      return;
+    }
+    const std::shared_ptr<AsyncCall> call = std::move(ctx->call);
+    queue_response(ctx, call->request(), call->response());
+    if (ctx->close_after_write) {
+      ctx->input.consume(ctx->input.size());
+    }
+    submit_write(ctx);
+  }
+
+  bool busy(const ConnectionContext *ctx) const {
+    return ctx->write_in_flight || ctx->call;
+  }
+
+  void upgrade(ConnectionContext *ctx,
+               std::shared_ptr<const WebSocketHandler> handler) {
+    ctx->input.set_limit(std::max(
+        config.max_request_bytes,
+        handler->max_message_bytes + websocket::MAX_HEADER_SIZE));
+    ctx->ws = std::make_unique<WebSocket>(std::move(handler), hub, ctx->fd);
+    ctx->ws->open();
+  }
+
+  // WebSocket counterpart of serve_buffered(): dispatches the complete
+  // frames in `data` and keeps a partial one in the input buffer.
+  void serve_websocket(ConnectionContext *ctx, char *data, size_t size,
+                       bool from_input) {
+    WebSocket &ws = *ctx->ws;
+    const size_t consumed = ws.receive(data, size);
+    if (from_input) {
+      ctx->input.consume(consumed);
+    } else if (consumed < size &&
+               !ctx->input.append(
+                   std::string_view(data + consumed, size - consumed))) {
+      clean_conn(ctx);
+      return;
+    }
+
+    if (!ctx->input.empty()) {
+      ctx->input.reserve(ws.bytes_needed());
+    } else if (buf_ring) {
+      ctx->input.release();
+    }
+    if (!ws.closing() && !ctx->write_in_flight) {
+      arm_deadline(ctx, Deadline::Idle);
+    }
+  }
+
+  // Hands the frames a WebSocket has queued to the socket, unless a write
+  // is already in flight (its completion comes back here).
+  void write_websocket(ConnectionContext *ctx) {
+    if (ctx->closing || ctx->write_in_flight) {
+      return;
+    }
+    WebSocket &ws = *ctx->ws;
+    if (ws.aborted()) {
+      clean_conn(ctx);
+      return;
+    }
+    if (ws.has_pending()) {
+      ctx->output.clear();
+      ws.take_pending(ctx->output);
+      ctx->close_after_write = ws.finished();
+      submit_write(ctx);
+      return;
+    }
+    if (ws.finished()) {
+      clean_conn(ctx);
+      return;
+    }
+    arm_deadline(ctx, ws.closing() ? Deadline::Close : Deadline::Idle);
+  }
+
+  // Sends what handlers and broadcasts queued during this loop iteration.
+  void flush_websockets() {
+    hub.flush([this](WebSocket &ws) {
+      write_websocket(fd_table[static_cast<size_t>(ws.fd())]);
+    });
+  }
+
+  // Checks an incomplete request at the head of the input buffer against the
+  // configured limits and queues the matching error response if it can never
+  // be served. Otherwise makes room for the declared body.
+  void reject_oversized(ConnectionContext *ctx, const ParseResult &pending) {
+    int status = 0;
+    const char *message = nullptr;
+
+    if (pending.malformed) {
+      status = 400;
+      message = "Bad Request";
+    } else if (pending.unsupported_framing) {
+      status = 501;
+      message = "Not Implemented";
+    } else if (pending.header_bytes == 0) {
+      if (ctx->input.size() >= config.max_header_bytes ||
+          ctx->input.full()) {
+        status = 431;
+        message = "Request Header Fields Too Large";
+      }
+    } else if (pending.content_length >
+               config.max_request_bytes - std::min(config.max_request_bytes,
+                                                   pending.header_bytes)) {
+      status = 413;
+      message = "Payload Too Large";
+    } else {
+      ctx->input.reserve(pending.header_bytes + pending.content_length);
+      return;
+    }
+
+    if (status != 0) {
+      queue_error(ctx, status, message);
+    }
+  }
+
+  // Queues a final error response; the connection closes once it is sent.
+  void queue_error(ConnectionContext *ctx, int status, const char *message) {
+    stats->parse_failures.add();
+    stats->count_status(status);
+    HttpResponse resp;
+    resp.set_status(status);
+    resp.set_body(message);
+    resp.keep_alive = false;
+    resp.write_to(ctx->output);
+    ctx->close_after_write = true;
+    ctx->input.consume(ctx->input.size());
+  }
+
+  // Starts tearing a connection down. Its context stays alive (and its fd
+  // open, so the number cannot be reused) until every operation still in
+  // flight has completed.
   void clean_conn(ConnectionContext *ctx) {
-    if (ctx && ctx->fd >= 0) {
-      int fd = ctx->fd;
-      close(fd);
-      if (fd < (int)fd_table.size()) {
-        fd_table[fd].reset();
+    if (!ctx || ctx->closing) {
+      return;
+    }
+    ctx->closing = true;
+    timers.cancel(*ctx);
+    if (ctx->ws) {
+      ctx->ws->detach();
+    }
+    if (ctx->call) {
+      ctx->call->abandon();
+      ctx->call.reset();
+    }
+
+    if (ctx->write_in_flight) {
+      // Unblocks a send stuck on a peer that stopped reading.
+      if (direct_fds) {
+        struct io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_shutdown(sqe, ctx->fd, SHUT_RDWR);
+        use_client_fd(sqe);
+        io_uring_sqe_set_data64(sqe,
+                                make_user_data(nullptr, EventType::DETACHED));
+      } else {
+        shutdown(ctx->fd, SHUT_RDWR);
       }
     }
+    if (ctx->recv_armed && !ctx->reads_paused) {
+      struct io_uring_sqe *sqe = get_sqe();
+      io_uring_prep_cancel64(sqe, make_user_data(ctx, EventType::READ), 0);
+      io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::DETACHED));
+    }
+    release_conn(ctx);
+  }
+
+  void release_conn(ConnectionContext *ctx) {
+    if (ctx->pending_ops > 0 || ctx->fd < 0) {
+      return;
+    }
+
+    if (direct_fds) {
+      struct io_uring_sqe *sqe = get_sqe();
+      io_uring_prep_close_direct(sqe, static_cast<unsigned>(ctx->fd));
+      io_uring_sqe_set_data64(sqe, make_user_data(nullptr, EventType::DETACHED));
+    } else {
+      close(ctx->fd);
+    }
+    stats->closes.add();
+    release_pipe(ctx);
+    ctx->send_length = 0;
+    release_send_buffer(ctx);
+    fd_table[static_cast<size_t>(ctx->fd)] = nullptr;
+    ctx->reset();
+    contexts.release(ctx);
   }
 
   void cleanup() {
@@ -217,12 +1371,31 @@ private:
 
     for (auto &conn : fd_table) {
       if (conn && conn->fd >= 0) {
-        close(conn->fd);
+        if (!direct_fds) {
+          close(conn->fd);
+        }
         conn->fd = -1;
       }
+      if (conn && conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+      }
     }
     fd_table.clear();
 
-    io_uring_queue_exit(&ring);
+    for (const auto &fds : pipe_pool) {
+      close(fds[0]);
+      close(fds[1]);
+    }
+    pipe_pool.clear();
+
+    if (ring_initialized) {
+      if (buf_ring) {
+        io_uring_free_buf_ring(&ring, buf_ring, buf_count, BUFFER_GROUP);
+        buf_ring = nullptr;
+      }
+      io_uring_queue_exit(&ring);
+      ring_initialized = false;
+    }
   }
 };
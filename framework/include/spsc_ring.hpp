@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded single-producer/single-consumer queue. The producer never blocks:
+// try_push() fails when the ring is full. Head and tail live on separate
+// cache lines and each side caches the other's index, so in steady state a
+// push or pop touches no line the other thread is writing.
+template <typename T> class SpscRing {
+public:
+  explicit SpscRing(size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+      rounded *= 2;
+    }
+    mask_ = rounded - 1;
+    slots_ = std::make_unique<T[]>(rounded);
+  }
+
+  size_t capacity() const noexcept { return mask_ + 1; }
+
+  // Producer side.
+  bool try_push(const T &item) noexcept {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - cached_tail_ > mask_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head - cached_tail_ > mask_) {
+        return false;
+      }
+    }
+    slots_[head & mask_] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: hands up to `max` queued items to `fn` in FIFO order and
+  // returns how many were consumed.
+  template <typename F> size_t drain(F &&fn, size_t max = SIZE_MAX) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (cached_head_ == tail) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+    const size_t count = std::min(cached_head_ - tail, max);
+    for (size_t i = 0; i < count; ++i) {
+      fn(slots_[(tail + i) & mask_]);
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0; // producer's last view of tail_
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0; // consumer's last view of head_
+  alignas(64) size_t mask_ = 0;
+  std::unique_ptr<T[]> slots_;
+};
@@ -0,0 +1,585 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <ctime>
+#include <fcntl.h>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+
+namespace mime {
+
+struct Entry {
+  std::string_view extension;
+  std::string_view type;
+};
+
+// Sorted by extension for binary search.
+inline constexpr Entry kTypes[] = {
+    {"avif", "image/avif"},
+    {"bmp", "image/bmp"},
+    {"css", "text/css; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html; charset=utf-8"},
+    {"html", "text/html; charset=utf-8"},
+    {"ico", "image/x-icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"ogg", "audio/ogg"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"webm", "video/webm"},
+    {"webmanifest", "application/manifest+json"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+};
+
+inline constexpr std::string_view DEFAULT_TYPE = "application/octet-stream";
+
+inline std::string_view lookup(std::string_view path) {
+  const size_t slash = path.rfind('/');
+  const size_t dot = path.rfind('.');
+  if (dot == std::string_view::npos ||
+      (slash != std::string_view::npos && dot < slash)) {
+    return DEFAULT_TYPE;
+  }
+
+  const std::string_view ext = path.substr(dot + 1);
+  char lower[16];
+  if (ext.empty() || ext.size() > sizeof(lower)) {
+    return DEFAULT_TYPE;
+  }
+  for (size_t i = 0; i < ext.size(); ++i) {
+    lower[i] = static_cast<char>(
+        http_detail::kLower.map[static_cast<unsigned char>(ext[i])]);
+  }
+  const std::string_view key(lower, ext.size());
+
+  const auto *end = std::end(kTypes);
+  const auto *it =
+      std::lower_bound(std::begin(kTypes), end, key,
+                       [](const Entry &e, std::string_view k) {
+                         return e.extension < k;
+                       });
+  return (it != end && it->extension == key) ? it->type : DEFAULT_TYPE;
+}
+
+} // namespace mime
+
+// An opened file with the metadata its responses need, formatted once.
+// Small files are read into `content` and keep no descriptor.
+struct StaticFile {
+  int fd = -1;
+  size_t size = 0;
+  std::time_t mtime = 0;
+  std::string etag;
+  std::string last_modified;
+  std::string_view content_type;
+  std::string content;
+
+  StaticFile() = default;
+  StaticFile(const StaticFile &) = delete;
+  StaticFile &operator=(const StaticFile &) = delete;
+  ~StaticFile() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool is_inline() const noexcept { return fd < 0; }
+};
+
+struct FileCacheConfig {
+  size_t max_entries = 1024; // also bounds the descriptors kept open
+  size_t inline_limit = 16 * 1024;
+};
+
+// Sharded LRU of open files keyed by path. Every cached file's directory is
+// watched with inotify; a background thread drops entries as soon as the
+// file changes, so a hit never calls open() or stat(). Without inotify the
+// cache is bypassed and every lookup opens the file.
+class FileCache {
+public:
+  static constexpr size_t SHARD_COUNT = 16;
+
+  explicit FileCache(FileCacheConfig config = {})
+      : config_(config),
+        per_shard_(std::max<size_t>(config.max_entries / SHARD_COUNT, 1)) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ >= 0) {
+      watcher_ = std::thread([this] { watch_loop(); });
+    }
+  }
+
+  ~FileCache() {
+    running_.store(false, std::memory_order_release);
+    if (watcher_.joinable()) {
+      watcher_.join();
+    }
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+    }
+  }
+
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+
+  // The cached file at `path`, loading it on a miss. Null if `path` is not a
+  // readable regular file.
+  std::shared_ptr<const StaticFile> open(const std::string &path) {
+    Shard &shard = shard_for(path);
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.index.find(path);
+      if (it != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->second;
+      }
+      generation = shard.generation;
+    }
+
+    // Watch before opening so a change racing with the load is not missed.
+    const bool cacheable = watch_directory(path);
+    std::shared_ptr<const StaticFile> file = load(path);
+    if (!file || !cacheable) {
+      return file;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.generation != generation) {
+      return file; // invalidated while loading; serve it but do not keep it
+    }
+    auto it = shard.index.find(path);
+    if (it != shard.index.end()) {
+      return it->second->second;
+    }
+    shard.lru.emplace_front(path, file);
+    shard.index.emplace(path, shard.lru.begin());
+    while (shard.lru.size() > per_shard_) {
+      shard.index.erase(shard.lru.back().first);
+      shard.lru.pop_back();
+    }
+    return file;
+  }
+
+  void invalidate(const std::string &path) {
+    Shard &shard = shard_for(path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ++shard.generation;
+    auto it = shard.index.find(path);
+    if (it != shard.index.end()) {
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
+    }
+  }
+
+  void clear() {
+    for (Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      ++shard.generation;
+      shard.index.clear();
+      shard.lru.clear();
+    }
+  }
+
+  size_t size() const {
+    size_t total = 0;
+    for (const Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      total += shard.lru.size();
+    }
+    return total;
+  }
+
+private:
+  using Entry = std::pair<std::string, std::shared_ptr<const StaticFile>>;
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    uint64_t generation = 0; // bumped by every invalidation
+  };
+
+  FileCacheConfig config_;
+  size_t per_shard_;
+  Shard shards_[SHARD_COUNT];
+
+  int inotify_fd_ = -1;
+  std::atomic<bool> running_{true};
+  std::thread watcher_;
+  std::mutex watch_mutex_;
+  std::unordered_map<std::string, int> dir_watches_;
+  std::unordered_map<int, std::string> watched_dirs_;
+
+  Shard &shard_for(const std::string &path) {
+    return shards_[std::hash<std::string>{}(path) % SHARD_COUNT];
+  }
+
+  std::shared_ptr<const StaticFile> load(const std::string &path) const {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return nullptr;
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return nullptr;
+    }
+
+    auto file = std::make_shared<StaticFile>();
+    file->fd = fd;
+    file->size = static_cast<size_t>(st.st_size);
+    file->mtime = st.st_mtime;
+    file->content_type = mime::lookup(path);
+
+    if (file->size <= config_.inline_limit) {
+      file->content.resize(file->size);
+      size_t done = 0;
+      while (done < file->size) {
+        const ssize_t n = pread(fd, file->content.data() + done,
+                                file->size - done, static_cast<off_t>(done));
+        if (n <= 0) {
+          break;
+        }
+        done += static_cast<size_t>(n);
+      }
+      file->content.resize(done);
+      file->size = done;
+      close(fd);
+      file->fd = -1;
+    }
+
+    char text[48];
+    char *p = text;
+    *p++ = '"';
+    p = std::to_chars(p, text + sizeof(text), file->size, 16).ptr;
+    *p++ = '-';
+    const uint64_t mtime_ns = static_cast<uint64_t>(st.st_mtim.tv_sec) *
+                                  1000000000ULL +
+                              static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    p = std::to_chars(p, text + sizeof(text) - 1, mtime_ns, 16).ptr;
+    *p++ = '"';
+    file->etag.assign(text, p);
+
+    const size_t length = HttpDate::format(file->mtime, text, sizeof(text));
+    file->last_modified.assign(text, length);
+    return file;
+  }
+
+  bool watch_directory(const std::string &path) {
+    if (inotify_fd_ < 0) {
+      return false;
+    }
+    const size_t slash = path.rfind('/');
+    const std::string dir =
+        slash == std::string::npos ? "." : path.substr(0, slash);
+
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    if (dir_watches_.count(dir)) {
+      return true;
+    }
+    const int wd = inotify_add_watch(
+        inotify_fd_, dir.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+      return false;
+    }
+    dir_watches_[dir] = wd;
+    watched_dirs_[wd] = dir;
+    return true;
+  }
+
+  void watch_loop() {
+    alignas(inotify_event) char buffer[16 * 1024];
+    while (running_.load(std::memory_order_acquire)) {
+      pollfd pfd{inotify_fd_, POLLIN, 0};
+      if (poll(&pfd, 1, 200) <= 0) {
+        continue;
+      }
+
+      const ssize_t n = read(inotify_fd_, buffer, sizeof(buffer));
+      for (ssize_t offset = 0; offset < n;) {
+        const auto *event =
+            reinterpret_cast<const inotify_event *>(buffer + offset);
+        offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        handle_event(*event);
+      }
+    }
+  }
+
+  void handle_event(const inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      clear();
+      return;
+    }
+
+    std::string path;
+    {
+      std::lock_guard<std::mutex> lock(watch_mutex_);
+      auto it = watched_dirs_.find(event.wd);
+      if (it == watched_dirs_.end()) {
+        return;
+      }
+      if (event.mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // The directory itself went away; forget it and everything cached.
+        dir_watches_.erase(it->second);
+        watched_dirs_.erase(it);
+        inotify_rm_watch(inotify_fd_, event.wd);
+        path.clear();
+      } else if (event.len > 0) {
+        path = it->second + "/" + event.name;
+      } else {
+        return;
+      }
+    }
+
+    if (path.empty()) {
+      clear();
+    } else {
+      invalidate(path);
+    }
+  }
+};
+
+struct StaticDirOptions {
+  std::string index = "index.html"; // served for directory paths
+  std::string cache_control;        // Cache-Control value; empty = none
+  FileCacheConfig cache;
+};
+
+// Route handler serving files below `root`. Registered by Router::static_dir
+// on a "*path" catch-all. Supports conditional requests (ETag and
+// Last-Modified, answered with 304) and single byte ranges (206/416). Small
+// files are served from memory; larger ones are spliced from the cached
+// descriptor without passing through user space.
+class StaticDir {
+public:
+  explicit StaticDir(std::string root, StaticDirOptions options = {})
+      : root_(std::move(root)), options_(std::move(options)),
+        cache_(std::make_shared<FileCache>(options_.cache)) {
+    while (root_.size() > 1 && root_.back() == '/') {
+      root_.pop_back();
+    }
+  }
+
+  HttpResponse operator()(HttpRequest &req) const {
+    const std::string_view relative = req.path_param("path");
+    if (!is_safe(relative)) {
+      return not_found(req);
+    }
+
+    thread_local std::string path;
+    path.assign(root_);
+    path += '/';
+    path.append(relative);
+    if (relative.empty() || relative.back() == '/') {
+      path += options_.index;
+    }
+
+    const std::shared_ptr<const StaticFile> file = cache_->open(path);
+    if (!file) {
+      return not_found(req);
+    }
+
+    HttpResponse res;
+    res.keep_alive = req.wants_keep_alive();
+    res.headers["ETag"] = file->etag;
+    res.headers["Last-Modified"] = file->last_modified;
+    res.headers["Accept-Ranges"] = "bytes";
+    if (!options_.cache_control.empty()) {
+      res.headers["Cache-Control"] = options_.cache_control;
+    }
+
+    if (not_modified(req, *file)) {
+      res.set_status(304);
+      return res;
+    }
+
+    size_t start = 0;
+    size_t length = file->size;
+    const std::string_view range = req.header("Range");
+    const std::string_view if_range = req.header("If-Range");
+    if (!range.empty() && (if_range.empty() || if_range == file->etag)) {
+      switch (parse_range(range, file->size, start, length)) {
+      case RangeResult::Full:
+        break;
+      case RangeResult::Partial:
+        res.set_status(206);
+        res.headers["Content-Range"] = "bytes " + std::to_string(start) + "-" +
+                                       std::to_string(start + length - 1) +
+                                       "/" + std::to_string(file->size);
+        break;
+      case RangeResult::Unsatisfiable:
+        res.set_status(416);
+        res.headers["Content-Range"] = "bytes */" + std::to_string(file->size);
+        return res;
+      }
+    }
+
+    if (file->is_inline()) {
+      res.set_body(file->content.substr(start, length), file->content_type);
+    } else {
+      res.set_file(FileRange{file, file->fd, static_cast<off_t>(start), length},
+                   file->content_type);
+    }
+    return res;
+  }
+
+  FileCache &cache() const noexcept { return *cache_; }
+
+private:
+  enum class RangeResult { Full, Partial, Unsatisfiable };
+
+  std::string root_;
+  StaticDirOptions options_;
+  std::shared_ptr<FileCache> cache_;
+
+  // Rejects any ".." segment (after percent-decoding) so requests cannot
+  // leave the root.
+  static bool is_safe(std::string_view relative) {
+    if (relative.find('\0') != std::string_view::npos) {
+      return false;
+    }
+    size_t pos = 0;
+    while (pos <= relative.size()) {
+      const size_t end = std::min(relative.find('/', pos), relative.size());
+      if (relative.substr(pos, end - pos) == "..") {
+        return false;
+      }
+      pos = end + 1;
+    }
+    return true;
+  }
+
+  static HttpResponse not_found(const HttpRequest &req) {
+    HttpResponse res;
+    res.set_status(404);
+    res.set_body("File not found");
+    res.keep_alive = req.wants_keep_alive();
+    return res;
+  }
+
+  static bool not_modified(const HttpRequest &req, const StaticFile &file) {
+    const std::string_view if_none_match = req.header("If-None-Match");
+    if (!if_none_match.empty()) {
+      size_t pos = 0;
+      while (pos < if_none_match.size()) {
+        const size_t end =
+            std::min(if_none_match.find(',', pos), if_none_match.size());
+        std::string_view tag = if_none_match.substr(pos, end - pos);
+        while (!tag.empty() && tag.front() == ' ') {
+          tag.remove_prefix(1);
+        }
+        while (!tag.empty() && tag.back() == ' ') {
+          tag.remove_suffix(1);
+        }
+        if (tag.substr(0, 2) == "W/") {
+          tag.remove_prefix(2);
+        }
+        if (tag == "*" || tag == file.etag) {
+          return true;
+        }
+        pos = end + 1;
+      }
+      return false;
+    }
+
+    const std::string_view since = req.header("If-Modified-Since");
+    if (since.empty() || since.size() >= 64) {
+      return false;
+    }
+    char text[64];
+    since.copy(text, since.size());
+    text[since.size()] = '\0';
+    std::tm tm{};
+    if (!strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+      return false;
+    }
+    return file.mtime <= timegm(&tm);
+  }
+
+  // Single "bytes=" ranges only; multiple ranges fall back to the whole file.
+  static RangeResult parse_range(std::string_view header, size_t size,
+                                 size_t &start, size_t &length) {
+    constexpr std::string_view prefix = "bytes=";
+    if (header.substr(0, prefix.size()) != prefix ||
+        header.find(',') != std::string_view::npos) {
+      return RangeResult::Full;
+    }
+    const std::string_view spec = header.substr(prefix.size());
+    const size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      return RangeResult::Full;
+    }
+
+    const std::string_view first = spec.substr(0, dash);
+    const std::string_view last = spec.substr(dash + 1);
+    size_t a = 0;
+    size_t b = 0;
+    auto parse = [](std::string_view text, size_t &out) {
+      const auto [ptr, ec] =
+          std::from_chars(text.data(), text.data() + text.size(), out);
+      return ec == std::errc() && ptr == text.data() + text.size();
+    };
+
+    if (first.empty()) {
+      // Suffix range: the last `b` bytes.
+      if (!parse(last, b)) {
+        return RangeResult::Full;
+      }
+      if (b == 0 || size == 0) {
+        return RangeResult::Unsatisfiable;
+      }
+      length = std::min(b, size);
+      start = size - length;
+      return RangeResult::Partial;
+    }
+
+    if (!parse(first, a) || (!last.empty() && (!parse(last, b) || b < a))) {
+      return RangeResult::Full;
+    }
+    if (a >= size) {
+      return RangeResult::Unsatisfiable;
+    }
+    const size_t end = last.empty() ? size - 1 : std::min(b, size - 1);
+    start = a;
+    length = end - a + 1;
+    return RangeResult::Partial;
+  }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+template <typename T = void> class Task;
+
+namespace task_detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation; // resumed when the task finishes
+  std::exception_ptr error;
+
+  // Tasks are lazy: nothing runs until the task is awaited.
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> self) noexcept {
+      const std::coroutine_handle<> next = self.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+
+  void rethrow() const {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object() noexcept;
+
+  template <typename U = T> void return_value(U &&result) {
+    value.emplace(std::forward<U>(result));
+  }
+
+  T take() {
+    rethrow();
+    return std::move(*value);
+  }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void take() const { rethrow(); }
+};
+
+} // namespace task_detail
+
+// Coroutine returning a T, started by co_await and finished on whatever
+// thread resumes it last (for handlers, the worker owning the ring the
+// awaited operations were submitted to). The awaiting coroutine is resumed
+// by symmetric transfer, so long chains of nested tasks do not grow the
+// stack. An exception escaping the task is rethrown from co_await.
+template <typename T> class [[nodiscard]] Task {
+public:
+  using promise_type = task_detail::Promise<T>;
+
+  explicit Task(std::coroutine_handle<promise_type> handle) noexcept
+      : handle_(handle) {}
+
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  ~Task() { destroy(); }
+
+  bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle_.promise().continuation = awaiting;
+    return handle_;
+  }
+
+  T await_resume() { return handle_.promise().take(); }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+
+  void destroy() noexcept {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+};
+
+namespace task_detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace task_detail
+
+// Fire-and-forget coroutine: runs as soon as it is called and frees its
+// frame when it returns. Whatever it needs must be owned by the frame
+// (arguments by value), since its caller does not wait for it.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
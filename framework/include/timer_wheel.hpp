@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Intrusive link for TimerWheel; embed it (as a base or member) in the
+// object that owns the deadline. An object is in at most one slot at a time.
+struct TimerNode {
+  TimerNode *prev = nullptr;
+  TimerNode *next = nullptr;
+  uint64_t expires = 0; // wheel tick at which the timer fires
+
+  bool scheduled() const noexcept { return next != nullptr; }
+};
+
+// Hashed timer wheel with a fixed tick. Scheduling, rescheduling and
+// cancelling are O(1) pointer updates, so a connection can move its deadline
+// on every read without touching the kernel; the owner drives the wheel from
+// a single periodic timer and calls advance() on each tick. Deadlines fire
+// up to one tick late. Timers further out than one revolution stay in their
+// slot and are skipped until their tick comes around.
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit TimerWheel(std::chrono::milliseconds tick, size_t slots = 512)
+      : tick_(tick.count() > 0 ? tick : std::chrono::milliseconds(1)),
+        origin_(Clock::now()) {
+    size_t rounded = 1;
+    while (rounded < slots) {
+      rounded *= 2;
+    }
+    mask_ = rounded - 1;
+    heads_ = std::make_unique<TimerNode[]>(rounded);
+    for (size_t i = 0; i < rounded; ++i) {
+      heads_[i].prev = heads_[i].next = &heads_[i];
+    }
+  }
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  std::chrono::milliseconds tick() const noexcept { return tick_; }
+
+  size_t size() const noexcept { return size_; }
+
+  // (Re)arms `node` to fire `delay` from now, rounded up to whole ticks.
+  void schedule(TimerNode &node, std::chrono::milliseconds delay) {
+    cancel(node);
+    const int64_t ticks =
+        std::max<int64_t>((delay.count() + tick_.count() - 1) / tick_.count(),
+                          1);
+    node.expires = current_ + static_cast<uint64_t>(ticks);
+    link(heads_[node.expires & mask_], node);
+    ++size_;
+  }
+
+  void cancel(TimerNode &node) noexcept {
+    if (!node.scheduled()) {
+      return;
+    }
+    unlink(node);
+    --size_;
+  }
+
+  // Moves the wheel up to `now`, calling `on_expire(TimerNode &)` for every
+  // timer that is due. The node is already unlinked, so the callback may
+  // reschedule or cancel any timer, including this one.
+  template <typename F> size_t advance(Clock::time_point now, F &&on_expire) {
+    const auto elapsed =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now - origin_);
+    const uint64_t target =
+        elapsed.count() > 0 ? static_cast<uint64_t>(elapsed / tick_) : 0;
+
+    size_t fired = 0;
+    while (current_ < target) {
+      ++current_;
+      TimerNode &head = heads_[current_ & mask_];
+      if (head.next == &head) {
+        continue;
+      }
+
+      // Detach the slot first: callbacks may link nodes back into it.
+      TimerNode pending;
+      pending.prev = head.prev;
+      pending.next = head.next;
+      pending.prev->next = &pending;
+      pending.next->prev = &pending;
+      head.prev = head.next = &head;
+
+      while (pending.next != &pending) {
+        TimerNode &node = *pending.next;
+        unlink(node);
+        if (node.expires <= current_) {
+          --size_;
+          on_expire(node);
+          ++fired;
+        } else {
+          link(head, node);
+        }
+      }
+    }
+    return fired;
+  }
+
+private:
+  std::chrono::milliseconds tick_;
+  Clock::time_point origin_;
+  uint64_t current_ = 0; // ticks since origin_ already processed
+  size_t mask_ = 0;
+  size_t size_ = 0;
+  std::unique_ptr<TimerNode[]> heads_; // per-slot list sentinels
+
+  static void link(TimerNode &head, TimerNode &node) noexcept {
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+  }
+
+  static void unlink(TimerNode &node) noexcept {
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+  }
+};
@@ -0,0 +1,975 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "http_request.hpp"
+#include "http_response.hpp"
+#include "output_buffer.hpp"
+
+// RFC 6455 building blocks: handshake key, frame header codec, payload
+// unmasking and UTF-8 validation.
+namespace websocket {
+
+inline constexpr std::string_view GUID =
+    "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+inline constexpr size_t MAX_HEADER_SIZE = 14; // 2 + 8 length + 4 mask
+
+namespace close_code {
+inline constexpr uint16_t NORMAL = 1000;
+inline constexpr uint16_t GOING_AWAY = 1001;
+inline constexpr uint16_t PROTOCOL_ERROR = 1002;
+inline constexpr uint16_t UNSUPPORTED_DATA = 1003;
+inline constexpr uint16_t NO_STATUS = 1005;
+inline constexpr uint16_t ABNORMAL = 1006;
+inline constexpr uint16_t INVALID_PAYLOAD = 1007;
+inline constexpr uint16_t POLICY_VIOLATION = 1008;
+inline constexpr uint16_t MESSAGE_TOO_BIG = 1009;
+inline constexpr uint16_t INTERNAL_ERROR = 1011;
+} // namespace close_code
+
+enum class Opcode : uint8_t {
+  Continuation = 0x0,
+  Text = 0x1,
+  Binary = 0x2,
+  Close = 0x8,
+  Ping = 0x9,
+  Pong = 0xA,
+};
+
+// SHA-1 (RFC 3174). Only used to derive Sec-WebSocket-Accept.
+inline std::array<uint8_t, 20> sha1(std::string_view input) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+  std::string message(input);
+  const uint64_t bit_length = static_cast<uint64_t>(input.size()) * 8;
+  message += static_cast<char>(0x80);
+  while (message.size() % 64 != 56) {
+    message += '\0';
+  }
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    message += static_cast<char>((bit_length >> shift) & 0xFF);
+  }
+
+  for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      const auto *p =
+          reinterpret_cast<const unsigned char *>(message.data() + chunk);
+      w[i] = static_cast<uint32_t>(p[4 * i]) << 24 |
+             static_cast<uint32_t>(p[4 * i + 1]) << 16 |
+             static_cast<uint32_t>(p[4 * i + 2]) << 8 |
+             static_cast<uint32_t>(p[4 * i + 3]);
+    }
+    for (int i = 16; i < 80; ++i) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  std::array<uint8_t, 20> digest;
+  for (int i = 0; i < 5; ++i) {
+    digest[4 * i] = static_cast<uint8_t>(h[i] >> 24);
+    digest[4 * i + 1] = static_cast<uint8_t>(h[i] >> 16);
+    digest[4 * i + 2] = static_cast<uint8_t>(h[i] >> 8);
+    digest[4 * i + 3] = static_cast<uint8_t>(h[i]);
+  }
+  return digest;
+}
+
+inline std::string base64(const uint8_t *data, size_t size) {
+  static constexpr char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((size + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    const uint32_t n = static_cast<uint32_t>(data[i]) << 16 |
+                       static_cast<uint32_t>(data[i + 1]) << 8 | data[i + 2];
+    out += kAlphabet[(n >> 18) & 63];
+    out += kAlphabet[(n >> 12) & 63];
+    out += kAlphabet[(n >> 6) & 63];
+    out += kAlphabet[n & 63];
+  }
+  if (i < size) {
+    uint32_t n = static_cast<uint32_t>(data[i]) << 16;
+    if (i + 1 < size) {
+      n |= static_cast<uint32_t>(data[i + 1]) << 8;
+    }
+    out += kAlphabet[(n >> 18) & 63];
+    out += kAlphabet[(n >> 12) & 63];
+    out += i + 1 < size ? kAlphabet[(n >> 6) & 63] : '=';
+    out += '=';
+  }
+  return out;
+}
+
+// Sec-WebSocket-Accept for a client's Sec-WebSocket-Key.
+inline std::string accept_key(std::string_view key) {
+  std::string text(key);
+  text.append(GUID);
+  const auto digest = sha1(text);
+  return base64(digest.data(), digest.size());
+}
+
+struct FrameHeader {
+  bool fin = false;
+  uint8_t rsv = 0; // RSV1-3; must be zero without extensions
+  Opcode opcode = Opcode::Continuation;
+  bool masked = false;
+  uint8_t mask[4] = {};
+  uint64_t length = 0; // payload bytes
+  size_t size = 0;     // header bytes
+};
+
+enum class ParseStatus { Complete, Incomplete, Invalid };
+
+// Decodes the frame header at the start of `data`. Complete only means the
+// header is there; the payload may still be partial.
+inline ParseStatus parse_header(std::string_view data, FrameHeader &header) {
+  if (data.size() < 2) {
+    return ParseStatus::Incomplete;
+  }
+  const auto *p = reinterpret_cast<const unsigned char *>(data.data());
+  header.fin = (p[0] & 0x80) != 0;
+  header.rsv = (p[0] >> 4) & 0x7;
+  header.opcode = static_cast<Opcode>(p[0] & 0x0F);
+  header.masked = (p[1] & 0x80) != 0;
+
+  size_t size = 2;
+  uint64_t length = p[1] & 0x7F;
+  if (length == 126) {
+    size += 2;
+  } else if (length == 127) {
+    size += 8;
+  }
+  if (header.masked) {
+    size += 4;
+  }
+  if (data.size() < size) {
+    return ParseStatus::Incomplete;
+  }
+
+  if (length == 126) {
+    length = static_cast<uint64_t>(p[2]) << 8 | p[3];
+    if (length < 126) {
+      return ParseStatus::Invalid; // not the minimal encoding
+    }
+  } else if (length == 127) {
+    length = 0;
+    for (int i = 0; i < 8; ++i) {
+      length = length << 8 | p[2 + i];
+    }
+    if (length <= 0xFFFF || (length >> 63) != 0) {
+      return ParseStatus::Invalid;
+    }
+  }
+  if (header.masked) {
+    std::memcpy(header.mask, p + size - 4, 4);
+  }
+  header.length = length;
+  header.size = size;
+  return ParseStatus::Complete;
+}
+
+// Encodes an unmasked (server-to-client) frame header into `out` and returns
+// its size.
+inline size_t encode_header(char *out, Opcode opcode, uint64_t length,
+                            bool fin = true) {
+  out[0] = static_cast<char>((fin ? 0x80 : 0x00) |
+                             static_cast<uint8_t>(opcode));
+  if (length < 126) {
+    out[1] = static_cast<char>(length);
+    return 2;
+  }
+  if (length <= 0xFFFF) {
+    out[1] = 126;
+    out[2] = static_cast<char>(length >> 8);
+    out[3] = static_cast<char>(length);
+    return 4;
+  }
+  out[1] = 127;
+  for (int i = 0; i < 8; ++i) {
+    out[2 + i] = static_cast<char>(length >> (56 - 8 * i));
+  }
+  return 10;
+}
+
+// XORs a client payload with its masking key in place. Every vector step
+// covers a multiple of four bytes, so the key stays aligned with the data.
+inline void unmask(char *data, size_t size, const uint8_t mask[4]) noexcept {
+  uint32_t key32;
+  std::memcpy(&key32, mask, 4);
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i key256 = _mm256_set1_epi32(static_cast<int>(key32));
+  for (; i + 32 <= size; i += 32) {
+    auto *p = reinterpret_cast<__m256i *>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i key128 = _mm_set1_epi32(static_cast<int>(key32));
+  for (; i + 16 <= size; i += 16) {
+    auto *p = reinterpret_cast<__m128i *>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+  }
+#endif
+
+  const uint64_t key64 = static_cast<uint64_t>(key32) << 32 | key32;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    word ^= key64;
+    std::memcpy(data + i, &word, 8);
+  }
+  for (; i < size; ++i) {
+    data[i] = static_cast<char>(data[i] ^ mask[i & 3]);
+  }
+}
+
+// Strict UTF-8 check (no overlongs, surrogates or code points past
+// U+10FFFF), with an eight-bytes-at-a-time ASCII fast path.
+inline bool valid_utf8(std::string_view text) noexcept {
+  const auto *p = reinterpret_cast<const unsigned char *>(text.data());
+  const size_t size = text.size();
+  size_t i = 0;
+  while (i < size) {
+    if (i + 8 <= size) {
+      uint64_t word;
+      std::memcpy(&word, p + i, 8);
+      if ((word & 0x8080808080808080ULL) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+    const unsigned char c = p[i];
+    if (c < 0x80) {
+      ++i;
+      continue;
+    }
+
+    size_t length;
+    unsigned char low = 0x80, high = 0xBF; // range of the second byte
+    if (c >= 0xC2 && c <= 0xDF) {
+      length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      length = 3;
+      if (c == 0xE0) {
+        low = 0xA0;
+      } else if (c == 0xED) {
+        high = 0x9F;
+      }
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      length = 4;
+      if (c == 0xF0) {
+        low = 0x90;
+      } else if (c == 0xF4) {
+        high = 0x8F;
+      }
+    } else {
+      return false;
+    }
+    if (i + length > size || p[i + 1] < low || p[i + 1] > high) {
+      return false;
+    }
+    for (size_t j = 2; j < length; ++j) {
+      if ((p[i + j] & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += length;
+  }
+  return true;
+}
+
+// A complete server frame, shareable between any number of connections.
+inline std::shared_ptr<const std::string> make_frame(Opcode opcode,
+                                                     std::string_view payload) {
+  auto frame = std::make_shared<std::string>();
+  char header[MAX_HEADER_SIZE];
+  const size_t size = encode_header(header, opcode, payload.size());
+  frame->reserve(size + payload.size());
+  frame->append(header, size);
+  frame->append(payload);
+  return frame;
+}
+
+} // namespace websocket
+
+using WebSocketFrame = std::shared_ptr<const std::string>;
+
+class WebSocket;
+class WebSocketHub;
+struct WebSocketTopic;
+
+struct WebSocketHandler {
+  std::function<void(WebSocket &)> on_open;
+  std::function<void(WebSocket &, std::string_view message, bool binary)>
+      on_message;
+  // Runs once per connection: after a close frame from the peer, or with
+  // 1006 when the connection is lost without one.
+  std::function<void(WebSocket &, uint16_t code, std::string_view reason)>
+      on_close;
+  size_t max_message_bytes = 1 << 20; // larger messages close with 1009
+  // Unsent bytes allowed to queue up for one slow client before it is
+  // disconnected.
+  size_t max_pending_bytes = 16 << 20;
+};
+
+// One upgraded connection. Handlers receive it by reference and may keep the
+// pointer until on_close; it belongs to the worker that accepted the
+// connection and must only be used from that worker's thread (use
+// WebSocketBroker::publish to reach connections on other workers).
+//
+// Outgoing frames are queued in `pending_` and handed to the socket in one
+// batch per event-loop iteration, so a burst of sends costs one sendmsg.
+class WebSocket {
+public:
+  WebSocket(std::shared_ptr<const WebSocketHandler> handler,
+            WebSocketHub &hub, int fd)
+      : handler_(std::move(handler)), hub_(hub), fd_(fd) {}
+
+  inline ~WebSocket();
+
+  WebSocket(const WebSocket &) = delete;
+  WebSocket &operator=(const WebSocket &) = delete;
+
+  void send_text(std::string_view message) {
+    send_frame(websocket::Opcode::Text, message);
+  }
+
+  void send_binary(std::string_view message) {
+    send_frame(websocket::Opcode::Binary, message);
+  }
+
+  // Queues a prebuilt frame (see websocket::make_frame) without copying it.
+  inline void send(const WebSocketFrame &frame);
+
+  void ping(std::string_view payload = {}) {
+    send_frame(websocket::Opcode::Ping, payload.substr(0, 125));
+  }
+
+  // Starts the closing handshake; the connection closes once the peer
+  // answers (or the close deadline passes).
+  inline void close(uint16_t code = websocket::close_code::NORMAL,
+                    std::string_view reason = {});
+
+  inline void subscribe(std::string_view topic);
+  inline void unsubscribe(std::string_view topic);
+
+  // Sends `message` to every subscriber of `topic` on every worker.
+  static inline void publish(std::string_view topic, std::string_view message,
+                             bool binary = false);
+
+  bool closing() const noexcept { return close_sent_; }
+
+  // Free for the application, e.g. the session behind the connection.
+  std::shared_ptr<void> user_data;
+
+  // Socket side.
+
+  int fd() const noexcept { return fd_; }
+
+  // Consumes the complete frames at the start of `data` (unmasking them in
+  // place) and dispatches them; returns the bytes consumed. Once the peer
+  // has closed or broken the protocol, everything is consumed and ignored.
+  inline size_t receive(char *data, size_t size);
+
+  // Total size of the frame that receive() stopped at.
+  size_t bytes_needed() const noexcept { return bytes_needed_; }
+
+  bool has_pending() const noexcept { return pending_bytes_ > 0; }
+
+  // Moves the queued frames into `out`, which must be empty.
+  void take_pending(OutputBuffer &out) {
+    std::swap(out, pending_);
+    pending_.clear();
+    pending_bytes_ = 0;
+  }
+
+  // The closing handshake is over (or the protocol failed): close the
+  // connection once the queued frames are out.
+  bool finished() const noexcept {
+    return close_sent_ && (close_received_ || failed_);
+  }
+
+  // The client fell too far behind; drop it without flushing.
+  bool aborted() const noexcept { return aborted_; }
+
+  inline void open();
+
+  // Called when the connection goes away: leaves every topic and reports
+  // 1006 if on_close has not run yet. Later sends are ignored.
+  inline void detach();
+
+private:
+  friend class WebSocketHub;
+
+  struct Subscription {
+    WebSocketTopic *topic;
+    size_t index; // position in the topic's subscriber list
+  };
+
+  std::shared_ptr<const WebSocketHandler> handler_;
+  WebSocketHub &hub_;
+  int fd_;
+
+  OutputBuffer pending_;
+  size_t pending_bytes_ = 0;
+  size_t bytes_needed_ = 0;
+
+  // Fragmented message being reassembled.
+  std::string message_;
+  websocket::Opcode message_opcode_ = websocket::Opcode::Text;
+  bool in_message_ = false;
+
+  bool close_sent_ = false;
+  bool close_received_ = false;
+  bool close_reported_ = false;
+  bool failed_ = false;
+  bool aborted_ = false;
+  bool detached_ = false;
+  bool dirty_ = false; // queued in the hub's flush list
+
+  std::vector<Subscription> subscriptions_;
+
+  inline void queued(size_t bytes);
+
+  void send_frame(websocket::Opcode opcode, std::string_view payload) {
+    if (detached_ || close_sent_) {
+      return;
+    }
+    char header[websocket::MAX_HEADER_SIZE];
+    const size_t size =
+        websocket::encode_header(header, opcode, payload.size());
+    pending_.append(std::string_view(header, size));
+    pending_.append(payload);
+    queued(size + payload.size());
+  }
+
+  void fail(uint16_t code) {
+    failed_ = true;
+    in_message_ = false;
+    close(code);
+    report_close(code, {});
+  }
+
+  void report_close(uint16_t code, std::string_view reason) {
+    if (close_reported_) {
+      return;
+    }
+    close_reported_ = true;
+    if (handler_->on_close) {
+      handler_->on_close(*this, code, reason);
+    }
+  }
+
+  void deliver(std::string_view message, bool binary) {
+    if (!binary && !websocket::valid_utf8(message)) {
+      fail(websocket::close_code::INVALID_PAYLOAD);
+      return;
+    }
+    if (handler_->on_message && !close_sent_) {
+      handler_->on_message(*this, message, binary);
+    }
+  }
+
+  inline void on_frame(const websocket::FrameHeader &header,
+                       std::string_view payload);
+  inline void on_close_frame(std::string_view payload);
+};
+
+struct WebSocketTopic {
+  std::vector<WebSocket *> subscribers;
+};
+
+// Per-worker registry of topic subscriptions plus a mailbox through which
+// other threads hand it frames to deliver. A published frame is serialized
+// once and every subscriber's output references the same buffer.
+class WebSocketHub {
+public:
+  inline WebSocketHub();
+  inline ~WebSocketHub();
+
+  WebSocketHub(const WebSocketHub &) = delete;
+  WebSocketHub &operator=(const WebSocketHub &) = delete;
+
+  // Readable (eventfd) whenever posted frames are waiting; -1 if eventfd
+  // is unavailable.
+  int event_fd() const noexcept { return event_fd_; }
+
+  void subscribe(WebSocket &ws, std::string_view topic) {
+    if (WebSocketTopic *existing = find(topic)) {
+      for (const auto &subscription : ws.subscriptions_) {
+        if (subscription.topic == existing) {
+          return;
+        }
+      }
+    }
+    std::unique_ptr<WebSocketTopic> &slot = topics_[std::string(topic)];
+    if (!slot) {
+      slot = std::make_unique<WebSocketTopic>();
+    }
+    ws.subscriptions_.push_back({slot.get(), slot->subscribers.size()});
+    slot->subscribers.push_back(&ws);
+  }
+
+  void unsubscribe(WebSocket &ws, std::string_view topic) {
+    WebSocketTopic *target = find(topic);
+    for (size_t i = 0; target && i < ws.subscriptions_.size(); ++i) {
+      if (ws.subscriptions_[i].topic == target) {
+        remove(ws, i);
+        if (target->subscribers.empty()) {
+          topics_.erase(std::string(topic));
+        }
+        return;
+      }
+    }
+  }
+
+  void unsubscribe_all(WebSocket &ws) {
+    while (!ws.subscriptions_.empty()) {
+      WebSocketTopic *topic = ws.subscriptions_.back().topic;
+      remove(ws, ws.subscriptions_.size() - 1);
+      if (topic->subscribers.empty()) {
+        for (auto it = topics_.begin(); it != topics_.end(); ++it) {
+          if (it->second.get() == topic) {
+            topics_.erase(it);
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Queues `frame` on this worker's subscribers of `topic`.
+  size_t deliver(std::string_view topic, const WebSocketFrame &frame) {
+    WebSocketTopic *target = find(topic);
+    if (!target) {
+      return 0;
+    }
+    for (WebSocket *ws : target->subscribers) {
+      ws->send(frame);
+    }
+    return target->subscribers.size();
+  }
+
+  // Any thread: hands `frame` to this worker.
+  void post(std::string_view topic, WebSocketFrame frame) {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      wake = mailbox_.empty();
+      mailbox_.emplace_back(std::string(topic), std::move(frame));
+    }
+    if (wake && event_fd_ >= 0) {
+      const uint64_t one = 1;
+      (void)!::write(event_fd_, &one, sizeof(one));
+    }
+  }
+
+  // Worker thread: delivers everything posted since the last call.
+  void drain() {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      std::swap(draining_, mailbox_);
+    }
+    for (const auto &[topic, frame] : draining_) {
+      deliver(topic, frame);
+    }
+    draining_.clear();
+  }
+
+  void mark_dirty(WebSocket &ws) {
+    if (!ws.dirty_) {
+      ws.dirty_ = true;
+      dirty_.push_back(&ws);
+    }
+  }
+
+  void forget(WebSocket &ws) {
+    if (ws.dirty_) {
+      ws.dirty_ = false;
+      dirty_.erase(std::find(dirty_.begin(), dirty_.end(), &ws));
+    }
+  }
+
+  // Calls `fn(WebSocket &)` for every connection with new output or state
+  // since the last flush.
+  template <typename F> void flush(F &&fn) {
+    std::swap(flushing_, dirty_);
+    for (WebSocket *ws : flushing_) {
+      ws->dirty_ = false;
+    }
+    for (size_t i = 0; i < flushing_.size(); ++i) {
+      fn(*flushing_[i]);
+    }
+    flushing_.clear();
+  }
+
+  bool has_dirty() const noexcept { return !dirty_.empty(); }
+
+private:
+  std::unordered_map<std::string, std::unique_ptr<WebSocketTopic>> topics_;
+  std::vector<WebSocket *> dirty_;
+  std::vector<WebSocket *> flushing_;
+
+  int event_fd_ = -1;
+  std::mutex mailbox_mutex_;
+  std::vector<std::pair<std::string, WebSocketFrame>> mailbox_;
+  std::vector<std::pair<std::string, WebSocketFrame>> draining_;
+
+  WebSocketTopic *find(std::string_view topic) {
+    thread_local std::string key;
+    key.assign(topic);
+    auto it = topics_.find(key);
+    return it == topics_.end() ? nullptr : it->second.get();
+  }
+
+  // Swap-removes `ws` from the topic of its i-th subscription.
+  static void remove(WebSocket &ws, size_t i) {
+    const WebSocket::Subscription subscription = ws.subscriptions_[i];
+    ws.subscriptions_[i] = ws.subscriptions_.back();
+    ws.subscriptions_.pop_back();
+
+    std::vector<WebSocket *> &list = subscription.topic->subscribers;
+    WebSocket *moved = list.back();
+    list[subscription.index] = moved;
+    list.pop_back();
+    if (moved != &ws) {
+      for (auto &other : moved->subscriptions_) {
+        if (other.topic == subscription.topic) {
+          other.index = subscription.index;
+          break;
+        }
+      }
+    }
+  }
+};
+
+// Process-wide fan-out to every worker's hub.
+class WebSocketBroker {
+public:
+  static WebSocketBroker &global() {
+    static WebSocketBroker broker;
+    return broker;
+  }
+
+  // Serializes the message once and posts the same frame to every worker.
+  void publish(std::string_view topic, std::string_view message,
+               bool binary = false) {
+    publish(topic, websocket::make_frame(binary ? websocket::Opcode::Binary
+                                                : websocket::Opcode::Text,
+                                         message));
+  }
+
+  void publish(std::string_view topic, const WebSocketFrame &frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (WebSocketHub *hub : hubs_) {
+      hub->post(topic, frame);
+    }
+  }
+
+  void add(WebSocketHub *hub) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hubs_.push_back(hub);
+  }
+
+  void remove(WebSocketHub *hub) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hubs_.erase(std::remove(hubs_.begin(), hubs_.end(), hub), hubs_.end());
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<WebSocketHub *> hubs_;
+};
+
+inline WebSocketHub::WebSocketHub()
+    : event_fd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+  WebSocketBroker::global().add(this);
+}
+
+inline WebSocketHub::~WebSocketHub() {
+  WebSocketBroker::global().remove(this);
+  if (event_fd_ >= 0) {
+    ::close(event_fd_);
+  }
+}
+
+inline WebSocket::~WebSocket() { detach(); }
+
+inline void WebSocket::queued(size_t bytes) {
+  pending_bytes_ += bytes;
+  if (pending_bytes_ > handler_->max_pending_bytes) {
+    aborted_ = true;
+  }
+  hub_.mark_dirty(*this);
+}
+
+inline void WebSocket::send(const WebSocketFrame &frame) {
+  if (detached_ || close_sent_ || !frame) {
+    return;
+  }
+  pending_.append_shared(frame, *frame);
+  queued(frame->size());
+}
+
+inline void WebSocket::close(uint16_t code, std::string_view reason) {
+  if (detached_ || close_sent_) {
+    return;
+  }
+  char payload[125];
+  payload[0] = static_cast<char>(code >> 8);
+  payload[1] = static_cast<char>(code);
+  reason = reason.substr(0, sizeof(payload) - 2);
+  std::memcpy(payload + 2, reason.data(), reason.size());
+  send_frame(websocket::Opcode::Close,
+             std::string_view(payload, 2 + reason.size()));
+  close_sent_ = true;
+  hub_.mark_dirty(*this);
+}
+
+inline void WebSocket::subscribe(std::string_view topic) {
+  if (!detached_) {
+    hub_.subscribe(*this, topic);
+  }
+}
+
+inline void WebSocket::unsubscribe(std::string_view topic) {
+  hub_.unsubscribe(*this, topic);
+}
+
+inline void WebSocket::publish(std::string_view topic,
+                               std::string_view message, bool binary) {
+  WebSocketBroker::global().publish(topic, message, binary);
+}
+
+inline void WebSocket::open() {
+  if (handler_->on_open) {
+    handler_->on_open(*this);
+  }
+}
+
+inline void WebSocket::detach() {
+  if (detached_) {
+    return;
+  }
+  detached_ = true;
+  report_close(websocket::close_code::ABNORMAL, {});
+  hub_.unsubscribe_all(*this);
+  hub_.forget(*this);
+}
+
+inline size_t WebSocket::receive(char *data, size_t size) {
+  size_t offset = 0;
+  bytes_needed_ = 0;
+  while (offset < size) {
+    if (close_received_ || failed_ || detached_) {
+      return size;
+    }
+
+    websocket::FrameHeader header;
+    const auto status =
+        websocket::parse_header(std::string_view(data + offset, size - offset),
+                                header);
+    if (status == websocket::ParseStatus::Incomplete) {
+      bytes_needed_ = websocket::MAX_HEADER_SIZE;
+      break;
+    }
+    if (status == websocket::ParseStatus::Invalid || !header.masked ||
+        header.rsv != 0) {
+      fail(websocket::close_code::PROTOCOL_ERROR);
+      return size;
+    }
+    if (header.length > handler_->max_message_bytes) {
+      fail(websocket::close_code::MESSAGE_TOO_BIG);
+      return size;
+    }
+    const size_t total = header.size + static_cast<size_t>(header.length);
+    if (size - offset < total) {
+      bytes_needed_ = total;
+      break;
+    }
+
+    char *payload = data + offset + header.size;
+    websocket::unmask(payload, static_cast<size_t>(header.length),
+                      header.mask);
+    offset += total;
+    on_frame(header,
+             std::string_view(payload, static_cast<size_t>(header.length)));
+  }
+  return offset;
+}
+
+inline void WebSocket::on_frame(const websocket::FrameHeader &header,
+                                std::string_view payload) {
+  using websocket::Opcode;
+  namespace code = websocket::close_code;
+
+  switch (header.opcode) {
+  case Opcode::Ping:
+  case Opcode::Pong:
+  case Opcode::Close:
+    if (!header.fin || payload.size() > 125) {
+      fail(code::PROTOCOL_ERROR);
+      return;
+    }
+    if (header.opcode == Opcode::Ping) {
+      send_frame(Opcode::Pong, payload);
+    } else if (header.opcode == Opcode::Close) {
+      on_close_frame(payload);
+    }
+    return;
+
+  case Opcode::Text:
+  case Opcode::Binary:
+    if (in_message_) {
+      fail(code::PROTOCOL_ERROR);
+      return;
+    }
+    if (header.fin) {
+      // Common case: the whole message sits in the read buffer.
+      deliver(payload, header.opcode == Opcode::Binary);
+      return;
+    }
+    in_message_ = true;
+    message_opcode_ = header.opcode;
+    message_.assign(payload);
+    return;
+
+  case Opcode::Continuation:
+    if (!in_message_) {
+      fail(code::PROTOCOL_ERROR);
+      return;
+    }
+    if (message_.size() + payload.size() > handler_->max_message_bytes) {
+      fail(code::MESSAGE_TOO_BIG);
+      return;
+    }
+    message_.append(payload);
+    if (header.fin) {
+      in_message_ = false;
+      deliver(message_, message_opcode_ == Opcode::Binary);
+      message_.clear();
+    }
+    return;
+
+  default:
+    fail(code::PROTOCOL_ERROR);
+    return;
+  }
+}
+
+inline void WebSocket::on_close_frame(std::string_view payload) {
+  namespace code = websocket::close_code;
+
+  uint16_t status = code::NO_STATUS;
+  std::string_view reason;
+  if (payload.size() == 1) {
+    fail(code::PROTOCOL_ERROR);
+    return;
+  }
+  if (payload.size() >= 2) {
+    status = static_cast<uint16_t>(
+        static_cast<unsigned char>(payload[0]) << 8 |
+        static_cast<unsigned char>(payload[1]));
+    reason = payload.substr(2);
+    const bool valid_code = (status >= 1000 && status <= 1003) ||
+                            (status >= 1007 && status <= 1011) ||
+                            (status >= 3000 && status <= 4999);
+    if (!valid_code || !websocket::valid_utf8(reason)) {
+      fail(code::PROTOCOL_ERROR);
+      return;
+    }
+  }
+
+  close_received_ = true;
+  // Echo the status, as RFC 6455 5.5.1 asks.
+  close(status == code::NO_STATUS ? code::NORMAL : status);
+  report_close(status, reason);
+  hub_.mark_dirty(*this);
+}
+
+// Answers an Upgrade request: 101 carrying `handler` for the socket to take
+// over the connection, 426 for another protocol version, 400 otherwise.
+inline HttpResponse
+websocket_handshake(const HttpRequest &req,
+                    std::shared_ptr<const WebSocketHandler> handler) {
+  HttpResponse res;
+  res.keep_alive = req.wants_keep_alive();
+
+  const std::string_view key = req.header("Sec-WebSocket-Key");
+  if (req.method_id != HttpMethod::GET ||
+      !http_detail::icontains(req.header("Upgrade"), "websocket") ||
+      !http_detail::icontains(req.header("Connection"), "upgrade") ||
+      key.size() != 24) {
+    res.set_status(400);
+    res.set_body("Bad WebSocket handshake");
+    return res;
+  }
+  if (req.header("Sec-WebSocket-Version") != "13") {
+    res.set_status(426);
+    res.headers["Sec-WebSocket-Version"] = "13";
+    res.set_body("Unsupported WebSocket version");
+    return res;
+  }
+
+  res.set_status(101);
+  res.headers["Upgrade"] = "websocket";
+  res.headers["Connection"] = "Upgrade";
+  res.headers["Sec-WebSocket-Accept"] = websocket::accept_key(key);
+  res.upgrade = std::move(handler);
+  return res;
+}
@@ -1,54 +1,95 @@
 #pragma once
+#include "access_log.hpp"
+#include "async_handler.hpp"
+#include "compression.hpp"
 #include "middleware.hpp"
+#include "rate_limiter.hpp"
+#include "response_cache.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <ctime>
-#include <iostream>
-#include <mutex>
+#include <memory>
 #include <string>
-#include <unordered_map>
 
 namespace Middlewares {
 
 // ---------------------------------------------------------------------------
 // Logger
-// Prints method, path, response status, and wall-clock duration to stdout.
+// Records method, path, response status, and wall-clock duration in an
+// AccessLog (stdout by default). Formatting and I/O happen on the log's
+// writer thread; a record that does not fit in the worker's ring is dropped.
+// Coroutine (and proxy) routes are recorded once their handler finishes,
+// with its final status.
+//
+// Parameter:
+//   log  – destination (default AccessLog::global())
 // ---------------------------------------------------------------------------
-inline Middleware logger() {
-  return [](HttpRequest &req, Next next) -> HttpResponse {
+struct Logger {
+  AccessLog *log = &AccessLog::global();
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &req, NextFn &&next) const {
     const auto start = std::chrono::steady_clock::now();
     HttpResponse res = next();
+
+    AccessRecord entry;
+    entry.set_method(req.method_view);
+    entry.set_path(req.raw_path_view);
+    if (res.deferred) {
+      res.deferred->on_response(
+          [log = log, entry, start](const HttpResponse &response) mutable {
+            finish(*log, entry, start, response);
+          });
+    } else {
+      finish(*log, entry, start, res);
+    }
+    return res;
+  }
+
+  static void finish(AccessLog &log, AccessRecord &entry,
+                     std::chrono::steady_clock::time_point start,
+                     const HttpResponse &res) {
     const auto end = std::chrono::steady_clock::now();
-    const auto ms =
-        std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+    entry.unix_seconds =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch())
             .count();
+    entry.duration_us = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+            .count());
+    entry.status = static_cast<uint16_t>(res.status_code);
+    log.record(entry);
+  }
+};
 
-    // ISO-8601-ish timestamp
-    std::time_t now = std::time(nullptr);
-    char ts[32];
-    std::strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
-
-    std::cout << ts << "  " << req.method << "  " << req.raw_path << "  "
-              << res.status_code << "  " << ms << "μs\n";
-    return res;
-  };
+inline Middleware logger(AccessLog &log = AccessLog::global()) {
+  return Logger{&log};
 }
 
 // ---------------------------------------------------------------------------
 // Request-ID
 // Stamps every response with a monotonically-increasing X-Request-Id header.
 // ---------------------------------------------------------------------------
-inline Middleware request_id() {
-  return [](HttpRequest &req, Next next) -> HttpResponse {
-    static std::atomic<uint64_t> counter{1};
+struct RequestId {
+  static inline std::atomic<uint64_t> counter{1};
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &, NextFn &&next) const {
     const uint64_t id = counter.fetch_add(1, std::memory_order_relaxed);
 
     HttpResponse res = next();
-    res.headers["X-Request-Id"] = std::to_string(id);
+    char digits[24];
+    const auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), id);
+    (void)ec;
+    res.headers["X-Request-Id"].assign(digits, end);
     return res;
-  };
-}
+  }
+};
+
+inline Middleware request_id() { return RequestId{}; }
 
 // ---------------------------------------------------------------------------
 // CORS
@@ -60,22 +101,32 @@ inline Middleware request_id() {
 //   allowed_headers  – comma-separated list (default common headers)
 //   max_age_seconds  – preflight cache duration in seconds (default 86400)
 // ---------------------------------------------------------------------------
-inline Middleware cors(const std::string &allowed_origins = "*",
-                       const std::string &allowed_methods =
-                           "GET, POST, PUT, DELETE, PATCH, OPTIONS",
-                       const std::string &allowed_headers =
-                           "Content-Type, Authorization, X-Request-Id",
-                       int max_age_seconds = 86400) {
-  return [=](HttpRequest &req, Next next) -> HttpResponse {
+struct Cors {
+  std::string allowed_origins;
+  std::string allowed_methods;
+  std::string allowed_headers;
+  std::string max_age;
+
+  explicit Cors(
+      std::string origins = "*",
+      std::string methods = "GET, POST, PUT, DELETE, PATCH, OPTIONS",
+      std::string headers = "Content-Type, Authorization, X-Request-Id",
+      int max_age_seconds = 86400)
+      : allowed_origins(std::move(origins)),
+        allowed_methods(std::move(methods)),
+        allowed_headers(std::move(headers)),
+        max_age(std::to_string(max_age_seconds)) {}
+
+  template <typename NextFn>
+  HttpResponse operator()(HttpRequest &req, NextFn &&next) const {
     // Preflight — respond immediately without hitting the route.
-    if (req.method == "OPTIONS") {
+    if (req.method_id == HttpMethod::OPTIONS) {
       HttpResponse res;
       res.set_status(204);
-      res.status_message = "No Content";
       res.headers["Access-Control-Allow-Origin"] = allowed_origins;
       res.headers["Access-Control-Allow-Methods"] = allowed_methods;
       res.headers["Access-Control-Allow-Headers"] = allowed_headers;
-      res.headers["Access-Control-Max-Age"] = std::to_string(max_age_seconds);
+      res.headers["Access-Control-Max-Age"] = max_age;
       res.keep_alive = req.wants_keep_alive();
       return res;
     }
@@ -83,72 +134,106 @@ inline Middleware cors(const std::string &allowed_origins = "*",
     HttpResponse res = next();
     res.headers["Access-Control-Allow-Origin"] = allowed_origins;
     return res;
-  };
+  }
+};
+
+inline Middleware cors(const std::string &allowed_origins = "*",
+                       const std::string &allowed_methods =
+                           "GET, POST, PUT, DELETE, PATCH, OPTIONS",
+                       const std::string &allowed_headers =
+                           "Content-Type, Authorization, X-Request-Id",
+                       int max_age_seconds = 86400) {
+  return Cors(allowed_origins, allowed_methods, allowed_headers,
+              max_age_seconds);
 }
 
 // ---------------------------------------------------------------------------
-// Rate Limiter (in-process, per-IP sliding window)
+// Rate Limiter (in-process, per-client GCRA)
 //
 // Parameters:
-//   max_requests  – number of requests allowed in the window
-//   window_secs   – rolling window length in seconds
+//   max_requests     – burst size, and requests allowed per window
+//   window_secs      – window length in seconds
+//   trust_forwarded  – key on the first X-Forwarded-For address when present.
+//                      Clients can send any X-Forwarded-For they like, so
+//                      enable this only when every request arrives through
+//                      a proxy that overwrites the header (default false)
+//   max_keys         – clients tracked at once; idle ones are evicted first
 //
-// The client IP is read from the X-Forwarded-For header first, then falls
-// back to a sentinel string when the header is absent (single-server use).
+// Otherwise the client is keyed by the connection's peer address, falling
+// back to a shared sentinel key when neither is known.
 //
-// Returns 429 Too Many Requests when the limit is exceeded.
+// Returns 429 Too Many Requests, with Retry-After, when the limit is
+// exceeded.
 // ---------------------------------------------------------------------------
-inline Middleware rate_limit(int max_requests, int window_secs) {
-  struct Bucket {
-    std::vector<std::chrono::steady_clock::time_point> timestamps;
-  };
-
+inline Middleware rate_limit(int max_requests, int window_secs,
+                             bool trust_forwarded = false,
+                             size_t max_keys = RateLimiter::DEFAULT_MAX_KEYS) {
   // Shared state wrapped in a shared_ptr so the lambda is copyable.
-  auto state = std::make_shared<
-      std::pair<std::mutex, std::unordered_map<std::string, Bucket>>>();
+  auto limiter = std::make_shared<RateLimiter>(
+      static_cast<uint32_t>(std::max(max_requests, 1)),
+      std::chrono::seconds(window_secs), max_keys);
 
   return [=](HttpRequest &req, Next next) -> HttpResponse {
-    const auto now = std::chrono::steady_clock::now();
-    const auto window = std::chrono::seconds(window_secs);
-
     // Determine client key.
-    std::string client_key = "local";
-    auto it = req.headers.find("X-Forwarded-For");
-    if (it != req.headers.end() && !it->second.empty()) {
+    std::string_view client_key = "local";
+    const std::string_view forwarded =
+        trust_forwarded ? req.header("X-Forwarded-For") : std::string_view();
+    if (!forwarded.empty()) {
       // Take only the first IP in a possibly comma-separated list.
-      client_key = it->second.substr(0, it->second.find(','));
+      client_key = forwarded.substr(0, forwarded.find(','));
       while (!client_key.empty() && client_key.back() == ' ')
-        client_key.pop_back();
+        client_key.remove_suffix(1);
+    } else if (req.peer && !req.peer->ip().empty()) {
+      client_key = req.peer->ip();
     }
 
-    auto &[mtx, buckets] = *state;
-    {
-      std::lock_guard<std::mutex> lock(mtx);
-      Bucket &bucket = buckets[client_key];
-
-      // Evict timestamps outside the current window.
-      bucket.timestamps.erase(
-          std::remove_if(bucket.timestamps.begin(), bucket.timestamps.end(),
-                         [&](const auto &tp) { return now - tp > window; }),
-          bucket.timestamps.end());
-
-      if (static_cast<int>(bucket.timestamps.size()) >= max_requests) {
-        HttpResponse res;
-        res.set_status(429);
-        res.status_message = "Too Many Requests";
-        res.headers["Retry-After"] = std::to_string(window_secs);
-        res.set_body("Rate limit exceeded. Try again later.");
-        res.keep_alive = req.wants_keep_alive();
-        return res;
-      }
-
-      bucket.timestamps.push_back(now);
+    const RateLimiter::Decision decision = limiter->acquire(client_key);
+    if (!decision.allowed) {
+      const auto wait =
+          std::chrono::ceil<std::chrono::seconds>(decision.retry_after);
+      HttpResponse res;
+      res.set_status(429);
+      res.headers["Retry-After"] =
+          std::to_string(std::max<long long>(wait.count(), 1));
+      res.set_body("Rate limit exceeded. Try again later.");
+      res.keep_alive = req.wants_keep_alive();
+      return res;
     }
 
     return next();
   };
 }
 
+// ---------------------------------------------------------------------------
+// Response Cache
+// Serves repeated GETs from stored, already-serialized responses (see
+// ResponseCache). Middleware added after it runs only on misses.
+//
+// Parameters:
+//   ttl        – how long an entry is served (default 1s)
+//   max_bytes  – memory cap across all entries (default 64 MiB)
+//   vary       – request headers that select between entries
+// ---------------------------------------------------------------------------
+inline Middleware response_cache(ResponseCacheOptions options = {}) {
+  return ResponseCache(std::move(options));
+}
+
+// ---------------------------------------------------------------------------
+// Compression
+// Compresses text-like bodies for clients that send Accept-Encoding (see
+// Compress). Place it inside response_cache(), which then needs
+// vary = {"Accept-Encoding"}.
+//
+// Parameters:
+//   min_size     – smallest body worth compressing (default 1 KiB)
+//   gzip_level   – zlib level for gzip/deflate, 1 (fast) – 9 (small)
+//   zstd_level   – zstd level, 1 (fast) – 19 (small); needs libzstd
+//   cache_bytes  – memory cap for reused compressed bodies (default 32 MiB)
+// ---------------------------------------------------------------------------
+inline Middleware compress(CompressionOptions options = {}) {
+  return Compress(std::move(options));
+}
+
 // ---------------------------------------------------------------------------
 // Content-Type Guard
 // Rejects non-preflight requests whose body-carrying methods lack a matching
@@ -163,12 +248,12 @@ inline Middleware require_content_type(const std::string &required_type) {
     static const std::vector<std::string> body_methods = {"POST", "PUT",
                                                           "PATCH"};
     bool is_body_method = std::find(body_methods.begin(), body_methods.end(),
-                                    req.method) != body_methods.end();
+                                    req.method_view) != body_methods.end();
 
     if (is_body_method) {
-      auto it = req.headers.find("Content-Type");
-      if (it == req.headers.end() ||
-          it->second.find(required_type) == std::string::npos) {
+      const std::string_view content_type =
+          req.header(KnownHeader::ContentType);
+      if (content_type.find(required_type) == std::string_view::npos) {
         HttpResponse res;
         res.set_status(415);
         res.status_message = "Unsupported Media Type";
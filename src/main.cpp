@@ -1,7 +1,57 @@
-#include "framework/include/socket.hpp"
+#include "framework/include/server.hpp"
 
-int main() {
-  Socket server;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char **argv) {
+  ServerConfig config;
+
+  // --workers=N (0 = one per core), --pin to bind each worker to a CPU,
+  // --backlog=N for the listen queue, --direct-fds for ring-registered
+  // client sockets, --ring-profile=default|defer-taskrun|sqpoll with
+  // --sqpoll-cpus=A,B,... for the poller threads, --send-buffers=N for
+  // registered zero-copy send buffers per worker, --handoff=PATH to take
+  // over the listeners of the server offering them at PATH (and offer them
+  // there in turn), --drain-timeout=SECONDS to bound the shutdown drain.
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--workers=", 10) == 0) {
+      config.workers = static_cast<unsigned>(std::atoi(argv[i] + 10));
+    } else if (std::strcmp(argv[i], "--pin") == 0) {
+      config.pin_workers = true;
+    } else if (std::strncmp(argv[i], "--backlog=", 10) == 0) {
+      config.socket.accept_backlog = std::atoi(argv[i] + 10);
+    } else if (std::strcmp(argv[i], "--direct-fds") == 0) {
+      config.socket.direct_descriptors = true;
+    } else if (std::strncmp(argv[i], "--ring-profile=", 15) == 0) {
+      const auto profile = parse_ring_profile(argv[i] + 15);
+      if (!profile) {
+        std::fprintf(stderr, "unknown ring profile: %s\n", argv[i] + 15);
+        return 1;
+      }
+      config.socket.ring.profile = *profile;
+    } else if (std::strncmp(argv[i], "--sqpoll-cpus=", 14) == 0) {
+      const char *cpu = argv[i] + 14;
+      while (*cpu != '\0') {
+        char *end = nullptr;
+        const long n = std::strtol(cpu, &end, 10);
+        if (end == cpu) {
+          break;
+        }
+        config.sqpoll_cpus.push_back(static_cast<int>(n));
+        cpu = *end == ',' ? end + 1 : end;
+      }
+    } else if (std::strncmp(argv[i], "--send-buffers=", 15) == 0) {
+      config.socket.send_buffer_count =
+          static_cast<unsigned>(std::atoi(argv[i] + 15));
+    } else if (std::strncmp(argv[i], "--handoff=", 10) == 0) {
+      config.handoff_path = argv[i] + 10;
+    } else if (std::strncmp(argv[i], "--drain-timeout=", 16) == 0) {
+      config.drain_timeout = std::chrono::seconds(std::atoi(argv[i] + 16));
+    }
+  }
+
+  Server server(config);
 
   if (!server.init()) {
     return 1;
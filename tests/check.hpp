@@ -0,0 +1,38 @@
+#pragma once
+
+// Minimal harness for the unit tests. A failed CHECK reports its location
+// and the case carries on; run() prints one line per case and returns the
+// exit status meson's test() looks at.
+//
+//   meson test -C <builddir> [parser router rate_limiter timer_wheel]
+
+#include <cstdio>
+#include <initializer_list>
+
+namespace check {
+
+inline int failures = 0;
+
+inline void fail(const char *file, int line, const char *expression) {
+  std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+  ++failures;
+}
+
+struct Case {
+  const char *name;
+  void (*body)();
+};
+
+inline int run(std::initializer_list<Case> cases) {
+  for (const Case &c : cases) {
+    const int before = failures;
+    c.body();
+    std::printf("%s %s\n", failures == before ? "ok  " : "FAIL", c.name);
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+} // namespace check
+
+#define CHECK(expression)                                                      \
+  ((expression) ? (void)0 : ::check::fail(__FILE__, __LINE__, #expression))
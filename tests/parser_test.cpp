@@ -0,0 +1,175 @@
+// parse_view(): request framing, pipelining and the fields the socket uses
+// to apply its header and body limits before a request is complete.
+
+#include "check.hpp"
+#include "http_request.hpp"
+
+#include <string>
+#include <string_view>
+
+namespace {
+
+void simple_get() {
+  const std::string_view raw = "GET /users/7?fields=name HTTP/1.1\r\n"
+                               "Host: example.com\r\n"
+                               "X-Trace: abc\r\n"
+                               "\r\n";
+  HttpRequest req;
+  const ParseResult result = req.parse_view(raw);
+  CHECK(result.success);
+  CHECK(result.bytes_consumed == raw.size());
+  CHECK(req.method_id == HttpMethod::GET);
+  CHECK(req.path_view == "/users/7");
+  CHECK(req.query_view == "fields=name");
+  CHECK(req.version_view == "HTTP/1.1");
+  CHECK(req.header("host") == "example.com");
+  CHECK(req.header("x-trace") == "abc");
+  CHECK(req.body_view.empty());
+}
+
+void body_by_content_length() {
+  const std::string_view raw = "POST /orders HTTP/1.1\r\n"
+                               "Content-Length: 5\r\n"
+                               "\r\n"
+                               "hello";
+  HttpRequest req;
+  const ParseResult result = req.parse_view(raw);
+  CHECK(result.success);
+  CHECK(result.bytes_consumed == raw.size());
+  CHECK(result.content_length == 5);
+  CHECK(req.body_view == "hello");
+}
+
+void pipelined_requests() {
+  const std::string first = "POST /a HTTP/1.1\r\n"
+                            "Content-Length: 3\r\n"
+                            "\r\n"
+                            "abc";
+  const std::string second = "GET /b HTTP/1.1\r\n"
+                             "\r\n";
+  const std::string third = "GET /c HTTP/1.1\r\n";
+  const std::string raw = first + second + third;
+
+  HttpRequest req;
+  ParseResult result = req.parse_view(raw);
+  CHECK(result.success);
+  CHECK(result.bytes_consumed == first.size());
+  CHECK(req.body_view == "abc");
+
+  size_t offset = result.bytes_consumed;
+  result = req.parse_view(std::string_view(raw).substr(offset));
+  CHECK(result.success);
+  CHECK(result.bytes_consumed == second.size());
+  CHECK(req.path_view == "/b");
+
+  // The third request is still missing its header block terminator.
+  offset += result.bytes_consumed;
+  result = req.parse_view(std::string_view(raw).substr(offset));
+  CHECK(!result.success);
+  CHECK(!result.malformed);
+  CHECK(result.header_bytes == 0);
+}
+
+void incomplete_body_reports_its_size() {
+  const std::string_view raw = "PUT /blob HTTP/1.1\r\n"
+                               "Content-Length: 100000\r\n"
+                               "\r\n"
+                               "partial";
+  HttpRequest req;
+  const ParseResult result = req.parse_view(raw);
+  CHECK(!result.success);
+  CHECK(!result.malformed);
+  CHECK(result.header_bytes == raw.size() - 7);
+  CHECK(result.content_length == 100000);
+}
+
+void malformed_request_line() {
+  HttpRequest req;
+  CHECK(req.parse_view("GARBAGE\r\n\r\n").malformed);
+  CHECK(req.parse_view("GET /only-two-parts\r\n\r\n").malformed);
+}
+
+void malformed_content_length() {
+  HttpRequest req;
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: 12abc\r\n"
+                       "\r\n")
+            .malformed);
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: -1\r\n"
+                       "\r\n")
+            .malformed);
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: +5\r\n"
+                       "\r\n"
+                       "hello")
+            .malformed);
+}
+
+void duplicate_content_length() {
+  HttpRequest req;
+  // The second length would frame "hello" as the next pipelined request.
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: 5\r\n"
+                       "Content-Length: 0\r\n"
+                       "\r\n"
+                       "hello")
+            .malformed);
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: 5\r\n"
+                       "content-length: 5\r\n"
+                       "\r\n"
+                       "hello")
+            .malformed);
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length: 5, 5\r\n"
+                       "\r\n"
+                       "hello")
+            .malformed);
+  CHECK(req.parse_view("POST / HTTP/1.1\r\n"
+                       "Content-Length:\r\n"
+                       "\r\n")
+            .malformed);
+}
+
+void transfer_encoding_is_refused() {
+  HttpRequest req;
+  // Chunked: the chunks must not be parsed as a pipelined request.
+  ParseResult result = req.parse_view("POST / HTTP/1.1\r\n"
+                                      "Transfer-Encoding: chunked\r\n"
+                                      "\r\n"
+                                      "1a\r\n"
+                                      "GET /admin HTTP/1.1\r\n"
+                                      "\r\n"
+                                      "0\r\n"
+                                      "\r\n");
+  CHECK(!result.success);
+  CHECK(result.unsupported_framing);
+  CHECK(!result.malformed);
+
+  // TE.CL: Content-Length next to Transfer-Encoding is malformed.
+  result = req.parse_view("POST / HTTP/1.1\r\n"
+                          "Content-Length: 4\r\n"
+                          "transfer-encoding: chunked\r\n"
+                          "\r\n"
+                          "5c\r\n"
+                          "GET /admin HTTP/1.1\r\n"
+                          "\r\n");
+  CHECK(!result.success);
+  CHECK(result.malformed);
+}
+
+} // namespace
+
+int main() {
+  return check::run({
+      {"simple_get", simple_get},
+      {"body_by_content_length", body_by_content_length},
+      {"pipelined_requests", pipelined_requests},
+      {"incomplete_body_reports_its_size", incomplete_body_reports_its_size},
+      {"malformed_request_line", malformed_request_line},
+      {"malformed_content_length", malformed_content_length},
+      {"duplicate_content_length", duplicate_content_length},
+      {"transfer_encoding_is_refused", transfer_encoding_is_refused},
+  });
+}
@@ -0,0 +1,94 @@
+// RateLimiter (GCRA): burst size, refill at the emission interval and the
+// Retry-After it reports, on an injected clock.
+
+#include "check.hpp"
+#include "rate_limiter.hpp"
+
+#include <chrono>
+#include <string>
+
+namespace {
+
+using std::chrono::milliseconds;
+
+const auto start =
+    std::chrono::steady_clock::time_point{} + std::chrono::hours(1);
+
+void allows_a_full_burst_at_once() {
+  RateLimiter limiter(5, std::chrono::seconds(1));
+  for (int i = 0; i < 5; ++i) {
+    CHECK(limiter.acquire("client", start).allowed);
+  }
+  const RateLimiter::Decision rejected = limiter.acquire("client", start);
+  CHECK(!rejected.allowed);
+  CHECK(rejected.retry_after == milliseconds(200));
+}
+
+void refills_one_request_per_interval() {
+  RateLimiter limiter(5, std::chrono::seconds(1));
+  for (int i = 0; i < 5; ++i) {
+    limiter.acquire("client", start);
+  }
+  const RateLimiter::Decision early =
+      limiter.acquire("client", start + milliseconds(150));
+  CHECK(!early.allowed);
+  CHECK(early.retry_after == milliseconds(50));
+
+  CHECK(limiter.acquire("client", start + milliseconds(200)).allowed);
+  CHECK(!limiter.acquire("client", start + milliseconds(200)).allowed);
+  CHECK(limiter.acquire("client", start + milliseconds(400)).allowed);
+  CHECK(!limiter.acquire("client", start + milliseconds(599)).allowed);
+}
+
+void idle_period_restores_the_burst_but_no_more() {
+  RateLimiter limiter(5, std::chrono::seconds(1));
+  for (int i = 0; i < 5; ++i) {
+    limiter.acquire("client", start);
+  }
+  const auto later = start + std::chrono::seconds(10);
+  for (int i = 0; i < 5; ++i) {
+    CHECK(limiter.acquire("client", later).allowed);
+  }
+  CHECK(!limiter.acquire("client", later).allowed);
+}
+
+void rejected_requests_do_not_consume_budget() {
+  RateLimiter limiter(2, std::chrono::seconds(1));
+  limiter.acquire("client", start);
+  limiter.acquire("client", start);
+  for (int i = 0; i < 100; ++i) {
+    CHECK(!limiter.acquire("client", start + milliseconds(i)).allowed);
+  }
+  CHECK(limiter.acquire("client", start + milliseconds(500)).allowed);
+}
+
+void keys_have_separate_budgets() {
+  RateLimiter limiter(1, std::chrono::seconds(1));
+  CHECK(limiter.acquire("a", start).allowed);
+  CHECK(!limiter.acquire("a", start).allowed);
+  CHECK(limiter.acquire("b", start).allowed);
+  CHECK(!limiter.acquire("b", start).allowed);
+}
+
+void new_keys_are_admitted_when_the_table_is_full() {
+  RateLimiter limiter(1, std::chrono::seconds(1), 1);
+  for (int i = 0; i < 10000; ++i) {
+    CHECK(limiter.acquire("client-" + std::to_string(i), start).allowed);
+  }
+}
+
+} // namespace
+
+int main() {
+  return check::run({
+      {"allows_a_full_burst_at_once", allows_a_full_burst_at_once},
+      {"refills_one_request_per_interval", refills_one_request_per_interval},
+      {"idle_period_restores_the_burst_but_no_more",
+       idle_period_restores_the_burst_but_no_more},
+      {"rejected_requests_do_not_consume_budget",
+       rejected_requests_do_not_consume_budget},
+      {"keys_have_separate_budgets", keys_have_separate_budgets},
+      {"new_keys_are_admitted_when_the_table_is_full",
+       new_keys_are_admitted_when_the_table_is_full},
+  });
+}
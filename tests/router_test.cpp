@@ -0,0 +1,134 @@
+// Router: radix-tree matching, including backtracking out of a static edge
+// into a parameter and out of a parameter into a catch-all.
+
+#include "check.hpp"
+#include "router.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// A handler answering with its label and the parameters it was given, as
+// "label name=value ...".
+RouteHandler labelled(std::string label) {
+  return [label](HttpRequest &req) {
+    std::string body = label;
+    for (const auto &param : req.path_param_views) {
+      body += ' ';
+      body.append(param.name);
+      body += '=';
+      body.append(param.value);
+    }
+    HttpResponse res;
+    res.set_body(body);
+    return res;
+  };
+}
+
+// The body of the answer to `method path`, or "404".
+std::string route(const Router &router, std::string_view method,
+                  std::string_view path) {
+  const std::string raw = std::string(method) + " " + std::string(path) +
+                          " HTTP/1.1\r\nHost: test\r\n\r\n";
+  HttpRequest req;
+  req.parse_view(raw);
+  const HttpResponse res = router.handle(req);
+  return res.status_code == 404 ? "404" : res.body;
+}
+
+void static_routes_share_split_edges() {
+  Router router;
+  router.get("/search", labelled("search"));
+  router.get("/settings", labelled("settings"));
+  router.get("/se", labelled("se"));
+  CHECK(route(router, "GET", "/search") == "search");
+  CHECK(route(router, "GET", "/settings") == "settings");
+  CHECK(route(router, "GET", "/se") == "se");
+  CHECK(route(router, "GET", "/s") == "404");
+  CHECK(route(router, "GET", "/searches") == "404");
+}
+
+void static_segment_wins_over_parameter() {
+  Router router;
+  router.get("/users/:id", labelled("user"));
+  router.get("/users/me", labelled("me"));
+  CHECK(route(router, "GET", "/users/me") == "me");
+  CHECK(route(router, "GET", "/users/7") == "user id=7");
+  CHECK(route(router, "GET", "/users/mead") == "user id=mead");
+  CHECK(route(router, "GET", "/users/") == "404");
+}
+
+void backtracks_from_static_edge_into_parameter() {
+  Router router;
+  router.get("/files/static/index", labelled("index"));
+  router.get("/files/:dir/list", labelled("list"));
+  CHECK(route(router, "GET", "/files/static/index") == "index");
+  // "static/" matches the static edge, which then has no "list" below it.
+  CHECK(route(router, "GET", "/files/static/list") == "list dir=static");
+  CHECK(route(router, "GET", "/files/other/list") == "list dir=other");
+}
+
+void backtracks_from_parameter_into_catch_all() {
+  Router router;
+  router.get("/assets/:name/meta", labelled("meta"));
+  router.get("/assets/*rest", labelled("asset"));
+  CHECK(route(router, "GET", "/assets/logo/meta") == "meta name=logo");
+  CHECK(route(router, "GET", "/assets/logo.png") == "asset rest=logo.png");
+  CHECK(route(router, "GET", "/assets/css/site/main.css") ==
+        "asset rest=css/site/main.css");
+  CHECK(route(router, "GET", "/assets/") == "asset rest=");
+}
+
+void abandoned_parameters_are_dropped() {
+  Router router;
+  router.get("/a/:x/b/:y/c", labelled("deep"));
+  router.get("/a/*rest", labelled("rest"));
+  CHECK(route(router, "GET", "/a/1/b/2/c") == "deep x=1 y=2");
+  // Both parameters were bound before the match failed on the last segment.
+  CHECK(route(router, "GET", "/a/1/b/2/d") == "rest rest=1/b/2/d");
+}
+
+void methods_have_separate_trees() {
+  Router router;
+  router.get("/items/:id", labelled("get"));
+  router.del("/items/:id", labelled("delete"));
+  CHECK(route(router, "GET", "/items/3") == "get id=3");
+  CHECK(route(router, "DELETE", "/items/3") == "delete id=3");
+  CHECK(route(router, "POST", "/items/3") == "404");
+}
+
+void invalid_patterns_are_rejected() {
+  auto rejects = [](auto &&add) {
+    try {
+      add();
+    } catch (const std::invalid_argument &) {
+      return true;
+    }
+    return false;
+  };
+  Router router;
+  router.get("/users/:id", labelled("user"));
+  CHECK(rejects([&] { router.get("/users/:id", labelled("again")); }));
+  CHECK(rejects([&] { router.get("/users/:name/posts", labelled("x")); }));
+  CHECK(rejects([&] { router.get("/files/:id.json", labelled("x")); }));
+  CHECK(rejects([&] { router.get("/static/*path/more", labelled("x")); }));
+}
+
+} // namespace
+
+int main() {
+  return check::run({
+      {"static_routes_share_split_edges", static_routes_share_split_edges},
+      {"static_segment_wins_over_parameter",
+       static_segment_wins_over_parameter},
+      {"backtracks_from_static_edge_into_parameter",
+       backtracks_from_static_edge_into_parameter},
+      {"backtracks_from_parameter_into_catch_all",
+       backtracks_from_parameter_into_catch_all},
+      {"abandoned_parameters_are_dropped", abandoned_parameters_are_dropped},
+      {"methods_have_separate_trees", methods_have_separate_trees},
+      {"invalid_patterns_are_rejected", invalid_patterns_are_rejected},
+  });
+}
@@ -0,0 +1,138 @@
+// TimerWheel: expiry rounded up to whole ticks, cancellation, timers more
+// than one revolution out and callbacks that reschedule.
+
+#include "check.hpp"
+#include "timer_wheel.hpp"
+
+#include <chrono>
+#include <vector>
+
+namespace {
+
+using std::chrono::milliseconds;
+using Clock = TimerWheel::Clock;
+
+struct Timer : TimerNode {
+  int id = 0;
+};
+
+// Advances `wheel` to `at` past `origin`, returning the ids that fired.
+std::vector<int> advance(TimerWheel &wheel, Clock::time_point origin,
+                         milliseconds at) {
+  std::vector<int> fired;
+  wheel.advance(origin + at, [&](TimerNode &node) {
+    fired.push_back(static_cast<Timer &>(node).id);
+  });
+  return fired;
+}
+
+void fires_once_the_rounded_up_delay_has_passed() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer timer;
+  timer.id = 1;
+  wheel.schedule(timer, milliseconds(25)); // three ticks
+  CHECK(wheel.size() == 1);
+  CHECK(advance(wheel, origin, milliseconds(25)).empty());
+  CHECK(advance(wheel, origin, milliseconds(35)) == std::vector<int>{1});
+  CHECK(!timer.scheduled());
+  CHECK(wheel.size() == 0);
+  CHECK(advance(wheel, origin, milliseconds(100)).empty());
+}
+
+void zero_delay_fires_on_the_next_tick() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer timer;
+  wheel.schedule(timer, milliseconds(0));
+  CHECK(advance(wheel, origin, milliseconds(5)).empty());
+  CHECK(advance(wheel, origin, milliseconds(15)).size() == 1);
+}
+
+void cancelled_timers_never_fire() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer kept, cancelled;
+  kept.id = 1;
+  cancelled.id = 2;
+  wheel.schedule(kept, milliseconds(20));
+  wheel.schedule(cancelled, milliseconds(20));
+  wheel.cancel(cancelled);
+  wheel.cancel(cancelled); // a second cancel is harmless
+  CHECK(wheel.size() == 1);
+  CHECK(advance(wheel, origin, milliseconds(50)) == std::vector<int>{1});
+}
+
+void rescheduling_moves_the_deadline() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer timer;
+  wheel.schedule(timer, milliseconds(20));
+  wheel.schedule(timer, milliseconds(60));
+  CHECK(wheel.size() == 1);
+  CHECK(advance(wheel, origin, milliseconds(45)).empty());
+  CHECK(advance(wheel, origin, milliseconds(65)).size() == 1);
+}
+
+void timers_beyond_one_revolution_wait_for_their_tick() {
+  TimerWheel wheel(milliseconds(10), 8); // one revolution is 80ms
+  const auto origin = Clock::now();
+  Timer near, far;
+  near.id = 1;
+  far.id = 2;
+  wheel.schedule(near, milliseconds(50));
+  wheel.schedule(far, milliseconds(250)); // same slot as `near`
+  CHECK(advance(wheel, origin, milliseconds(55)) == std::vector<int>{1});
+  CHECK(advance(wheel, origin, milliseconds(135)).empty());
+  CHECK(advance(wheel, origin, milliseconds(215)).empty());
+  CHECK(far.scheduled());
+  CHECK(advance(wheel, origin, milliseconds(255)) == std::vector<int>{2});
+}
+
+void one_jump_fires_every_due_timer_in_order() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer timers[4];
+  for (int i = 0; i < 4; ++i) {
+    timers[i].id = i;
+    wheel.schedule(timers[i], milliseconds(40 - 10 * i));
+  }
+  CHECK(advance(wheel, origin, milliseconds(500)) ==
+        (std::vector<int>{3, 2, 1, 0}));
+  CHECK(wheel.size() == 0);
+}
+
+void callbacks_may_reschedule_the_expired_timer() {
+  TimerWheel wheel(milliseconds(10));
+  const auto origin = Clock::now();
+  Timer timer;
+  wheel.schedule(timer, milliseconds(10));
+  int fired = 0;
+  for (int at = 15; at <= 95; at += 10) {
+    wheel.advance(origin + milliseconds(at), [&](TimerNode &node) {
+      ++fired;
+      wheel.schedule(node, milliseconds(10));
+    });
+  }
+  CHECK(fired == 9);
+  CHECK(timer.scheduled());
+  CHECK(wheel.size() == 1);
+}
+
+} // namespace
+
+int main() {
+  return check::run({
+      {"fires_once_the_rounded_up_delay_has_passed",
+       fires_once_the_rounded_up_delay_has_passed},
+      {"zero_delay_fires_on_the_next_tick", zero_delay_fires_on_the_next_tick},
+      {"cancelled_timers_never_fire", cancelled_timers_never_fire},
+      {"rescheduling_moves_the_deadline", rescheduling_moves_the_deadline},
+      {"timers_beyond_one_revolution_wait_for_their_tick",
+       timers_beyond_one_revolution_wait_for_their_tick},
+      {"one_jump_fires_every_due_timer_in_order",
+       one_jump_fires_every_due_timer_in_order},
+      {"callbacks_may_reschedule_the_expired_timer",
+       callbacks_may_reschedule_the_expired_timer},
+  });
+}